@@ -0,0 +1,116 @@
+/*
+ * Ffindex
+ * written by Andy Hauser <hauser@genzentrum.lmu.de>.
+ * Please add your name here if you distribute modified versions.
+ *
+ * Ffindex is provided under the Create Commons license "Attribution-ShareAlike
+ * 3.0", which basically captures the spirit of the Gnu Public License (GPL).
+ *
+ * See:
+ * http://creativecommons.org/licenses/by-sa/3.0/
+ *
+ * Helpers shared by the benchmarks: a clock and synthetic indexes whose names
+ * look like database accessions, "UniRef100_" followed by 10 characters.
+*/
+
+#ifndef FFINDEX_BENCH_H
+#define FFINDEX_BENCH_H
+
+#include "ffindex.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_NAME_PREFIX "UniRef100_"
+
+static inline double bench_seconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* xorshift64, state must not be 0 */
+static inline uint64_t bench_random(uint64_t* state)
+{
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *state = x;
+}
+
+/* Name of the i-th entry: i scrambled by an odd multiplier is distinct for every i
+ * below 2^50, written as 10 base 32 digits */
+static inline void bench_name(size_t i, char* name)
+{
+  static const char digits[] = "0123456789ABCDEFGHIJKLMNOPQRSTUV";
+  uint64_t x = ((uint64_t)i * 0x9E3779B97F4A7C15ULL) & ((1ULL << 50) - 1);
+  size_t prefix_length = strlen(BENCH_NAME_PREFIX);
+  memcpy(name, BENCH_NAME_PREFIX, prefix_length);
+  for(int d = 9; d >= 0; d--)
+  {
+    name[prefix_length + d] = digits[x & 31];
+    x >>= 5;
+  }
+  name[prefix_length + 10] = '\0';
+}
+
+/* An index of n entries with distinct names in random order, NULL if out of memory */
+static inline ffindex_index_t* bench_random_index(size_t n)
+{
+  ffindex_index_t* index = ffindex_index_new(n);
+  if(index == NULL)
+    return NULL;
+  char name[FFINDEX_MAX_ENTRY_NAME_LENTH];
+  for(size_t i = 0; i < n; i++)
+  {
+    bench_name(i, name);
+    ffindex_index_add_entry(index, name, i * 100, 100);
+  }
+  return index;
+}
+
+/* n_queries names of random entries of an index made by bench_random_index(n) */
+static inline char** bench_random_queries(size_t n, size_t n_queries, uint64_t seed)
+{
+  char** queries = (char**)malloc(sizeof(char*) * n_queries);
+  char* names = (char*)malloc(FFINDEX_MAX_ENTRY_NAME_LENTH * n_queries);
+  if(queries == NULL || names == NULL)
+  {
+    free(queries);
+    free(names);
+    return NULL;
+  }
+  for(size_t q = 0; q < n_queries; q++)
+  {
+    queries[q] = names + q * FFINDEX_MAX_ENTRY_NAME_LENTH;
+    bench_name(bench_random(&seed) % n, queries[q]);
+  }
+  return queries;
+}
+
+static inline void bench_free_queries(char** queries)
+{
+  if(queries != NULL)
+    free(queries[0]);
+  free(queries);
+}
+
+/* Seconds per lookup of all queries, the entries found are counted */
+static inline double bench_lookups(ffindex_index_t* index, char** queries, size_t n_queries,
+                                   ffindex_entry_t* (*lookup)(ffindex_index_t*, char*), size_t* n_found)
+{
+  *n_found = 0;
+  double start = bench_seconds();
+  for(size_t q = 0; q < n_queries; q++)
+    *n_found += lookup(index, queries[q]) != NULL;
+  return (bench_seconds() - start) / n_queries;
+}
+
+#endif
+/* vim: ts=2 sw=2 et
+*/
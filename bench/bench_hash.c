@@ -0,0 +1,70 @@
+/*
+ * Ffindex
+ * written by Andy Hauser <hauser@genzentrum.lmu.de>.
+ * Please add your name here if you distribute modified versions.
+ *
+ * Ffindex is provided under the Create Commons license "Attribution-ShareAlike
+ * 3.0", which basically captures the spirit of the Gnu Public License (GPL).
+ *
+ * See:
+ * http://creativecommons.org/licenses/by-sa/3.0/
+ *
+ * Lookups by name through the hash index against the binary search of a sorted index.
+*/
+
+#define _GNU_SOURCE 1
+
+#include "bench.h"
+
+int main(int argn, char** argv)
+{
+  size_t n = argn > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+  size_t n_queries = argn > 2 ? strtoull(argv[2], NULL, 10) : 1000000;
+  if(n == 0 || n_queries == 0)
+  {
+    fprintf(stderr, "USAGE: %s [ENTRIES] [LOOKUPS]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  ffindex_index_t* index = bench_random_index(n);
+  char** queries = bench_random_queries(n, n_queries, 42);
+  if(index == NULL || queries == NULL)
+  {
+    fprintf(stderr, "out of memory\n");
+    return EXIT_FAILURE;
+  }
+
+  /* The hash index needs no sorted entries, built before the sort it is measured unsorted */
+  double start = bench_seconds();
+  ffindex_index_build_hash(index);
+  double hash_build = bench_seconds() - start;
+  size_t found_unsorted;
+  double hash_unsorted = bench_lookups(index, queries, n_queries, ffindex_get_entry_by_name, &found_unsorted);
+
+  start = bench_seconds();
+  ffindex_sort_index_file(index);
+  double sort = bench_seconds() - start;
+  size_t found_bsearch;
+  double bsearch_lookup = bench_lookups(index, queries, n_queries, ffindex_bsearch_get_entry, &found_bsearch);
+
+  ffindex_index_build_hash(index);
+  size_t found_hash;
+  double hash_lookup = bench_lookups(index, queries, n_queries, ffindex_get_entry_by_name, &found_hash);
+
+  printf("%zu entries, %zu lookups\n", n, n_queries);
+  printf("sort             %8.3f s\n", sort);
+  printf("hash build       %8.3f s\n", hash_build);
+  printf("bsearch          %8.1f ns/lookup\n", bsearch_lookup * 1e9);
+  printf("hash             %8.1f ns/lookup, %.1fx\n", hash_lookup * 1e9, bsearch_lookup / hash_lookup);
+  printf("hash, unsorted   %8.1f ns/lookup\n", hash_unsorted * 1e9);
+
+  int err = found_unsorted != n_queries || found_bsearch != n_queries || found_hash != n_queries;
+  if(err)
+    fprintf(stderr, "not all names found: %zu %zu %zu of %zu\n", found_unsorted, found_bsearch, found_hash, n_queries);
+  bench_free_queries(queries);
+  ffindex_index_free(index);
+  return err ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* vim: ts=2 sw=2 et
+*/
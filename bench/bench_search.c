@@ -0,0 +1,88 @@
+/*
+ * Ffindex
+ * written by Andy Hauser <hauser@genzentrum.lmu.de>.
+ * Please add your name here if you distribute modified versions.
+ *
+ * Ffindex is provided under the Create Commons license "Attribution-ShareAlike
+ * 3.0", which basically captures the spirit of the Gnu Public License (GPL).
+ *
+ * See:
+ * http://creativecommons.org/licenses/by-sa/3.0/
+ *
+ * Lookups by name in a sorted index with each search accelerator: plain bsearch,
+ * name keys in Eytzinger order and name keys parallel to the entries.
+*/
+
+#define _GNU_SOURCE 1
+
+#include "bench.h"
+
+int main(int argn, char** argv)
+{
+  size_t n = argn > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+  size_t n_queries = argn > 2 ? strtoull(argv[2], NULL, 10) : 1000000;
+  if(n == 0 || n_queries == 0)
+  {
+    fprintf(stderr, "USAGE: %s [ENTRIES] [LOOKUPS]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  ffindex_index_t* index = bench_random_index(n);
+  char** queries = bench_random_queries(n, n_queries, 42);
+  if(index == NULL || queries == NULL)
+  {
+    fprintf(stderr, "out of memory\n");
+    return EXIT_FAILURE;
+  }
+  ffindex_sort_index_file(index);
+
+  const char* mode_names[] = { "bsearch", "eytzinger", "prefix" };
+  enum ffindex_search_mode modes[] = { FFINDEX_SEARCH_BSEARCH, FFINDEX_SEARCH_EYTZINGER, FFINDEX_SEARCH_PREFIX };
+  double bsearch_lookup = 0;
+  int err = 0;
+  printf("%zu entries, %zu lookups\n", n, n_queries);
+  for(int m = 0; m < 3; m++)
+  {
+    double start = bench_seconds();
+    if(ffindex_index_build_search(index, modes[m]) != EXIT_SUCCESS)
+      return EXIT_FAILURE;
+    double build = bench_seconds() - start;
+
+    size_t found;
+    double lookup = bench_lookups(index, queries, n_queries, ffindex_bsearch_get_entry, &found);
+    if(m == 0)
+      bsearch_lookup = lookup;
+    printf("%-10s build %7.3f s %8.1f ns/lookup, %.1fx\n", mode_names[m], build, lookup * 1e9, bsearch_lookup / lookup);
+    if(found != n_queries)
+    {
+      fprintf(stderr, "%s: %zu of %zu names found\n", mode_names[m], found, n_queries);
+      err = 1;
+    }
+  }
+
+  /* All names at once, sorted and merge-joined against the entries */
+  ffindex_index_drop_search(index);
+  ffindex_entry_t** entries = (ffindex_entry_t**)malloc(sizeof(ffindex_entry_t*) * n_queries);
+  if(entries == NULL)
+    return EXIT_FAILURE;
+  double start = bench_seconds();
+  ffindex_get_entries_by_names(index, queries, n_queries, entries);
+  double batch = (bench_seconds() - start) / n_queries;
+  size_t found = 0;
+  for(size_t q = 0; q < n_queries; q++)
+    found += entries[q] != NULL;
+  printf("%-10s %15s %8.1f ns/lookup, %.1fx\n", "batch", "", batch * 1e9, bsearch_lookup / batch);
+  if(found != n_queries)
+  {
+    fprintf(stderr, "batch: %zu of %zu names found\n", found, n_queries);
+    err = 1;
+  }
+
+  free(entries);
+  bench_free_queries(queries);
+  ffindex_index_free(index);
+  return err ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* vim: ts=2 sw=2 et
+*/
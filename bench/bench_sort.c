@@ -0,0 +1,77 @@
+/*
+ * Ffindex
+ * written by Andy Hauser <hauser@genzentrum.lmu.de>.
+ * Please add your name here if you distribute modified versions.
+ *
+ * Ffindex is provided under the Create Commons license "Attribution-ShareAlike
+ * 3.0", which basically captures the spirit of the Gnu Public License (GPL).
+ *
+ * See:
+ * http://creativecommons.org/licenses/by-sa/3.0/
+ *
+ * Sorting entries by name: the radix sort of ffsort_entries_by_name against qsort
+ * with a strncmp callback, as the index was sorted before.
+*/
+
+#define _GNU_SOURCE 1
+
+#include "bench.h"
+#include "ffutil.h"
+
+static int compare_entries_by_name(const void* pentry1, const void* pentry2)
+{
+  return strncmp(((ffindex_entry_t*)pentry1)->name, ((ffindex_entry_t*)pentry2)->name, FFINDEX_MAX_ENTRY_NAME_CHARS);
+}
+
+int main(int argn, char** argv)
+{
+  size_t n = argn > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+  int n_threads = argn > 2 ? atoi(argv[2]) : ffget_num_threads();
+  if(n == 0 || n_threads <= 0)
+  {
+    fprintf(stderr, "USAGE: %s [ENTRIES] [THREADS]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  ffindex_index_t* index = bench_random_index(n);
+  size_t size = sizeof(ffindex_entry_t) * n;
+  ffindex_entry_t* expected = (ffindex_entry_t*)malloc(size);
+  ffindex_entry_t* entries = (ffindex_entry_t*)malloc(size);
+  if(index == NULL || expected == NULL || entries == NULL)
+  {
+    fprintf(stderr, "out of memory\n");
+    return EXIT_FAILURE;
+  }
+
+  memcpy(expected, index->entries, size);
+  double start = bench_seconds();
+  qsort(expected, n, sizeof(ffindex_entry_t), compare_entries_by_name);
+  double qsort_time = bench_seconds() - start;
+  printf("%zu entries\n", n);
+  printf("qsort                %8.3f s\n", qsort_time);
+
+  int err = 0;
+  int threads[] = { 1, n_threads };
+  for(int t = 0; t < (n_threads > 1 ? 2 : 1); t++)
+  {
+    memcpy(entries, index->entries, size);
+    start = bench_seconds();
+    if(ffsort_entries_by_name(entries, n, threads[t]) != EXIT_SUCCESS)
+      return EXIT_FAILURE;
+    double radix_time = bench_seconds() - start;
+    printf("radix, %3d threads   %8.3f s, %.1fx\n", threads[t], radix_time, qsort_time / radix_time);
+    if(memcmp(entries, expected, size) != 0)
+    {
+      fprintf(stderr, "radix sort with %d threads differs from qsort\n", threads[t]);
+      err = 1;
+    }
+  }
+
+  free(entries);
+  free(expected);
+  ffindex_index_free(index);
+  return err ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* vim: ts=2 sw=2 et
+*/
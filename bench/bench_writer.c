@@ -0,0 +1,111 @@
+/*
+ * Ffindex
+ * written by Andy Hauser <hauser@genzentrum.lmu.de>.
+ * Please add your name here if you distribute modified versions.
+ *
+ * Ffindex is provided under the Create Commons license "Attribution-ShareAlike
+ * 3.0", which basically captures the spirit of the Gnu Public License (GPL).
+ *
+ * See:
+ * http://creativecommons.org/licenses/by-sa/3.0/
+ *
+ * Entries written per second: the buffered writer against ffindex_insert_memory
+ * through stdio, for many small entries. Both write the same files.
+*/
+
+#define _GNU_SOURCE 1
+
+#include "bench.h"
+
+#include <limits.h>
+#include <unistd.h>
+
+#define BENCH_ENTRY_LENGTH 20
+
+static int same_file(const char* filename1, const char* filename2)
+{
+  FILE* file1 = fopen(filename1, "r");
+  FILE* file2 = fopen(filename2, "r");
+  int same = file1 != NULL && file2 != NULL;
+  while(same)
+  {
+    int c = getc(file1);
+    same = c == getc(file2);
+    if(c == EOF)
+      break;
+  }
+  if(file1 != NULL)
+    fclose(file1);
+  if(file2 != NULL)
+    fclose(file2);
+  return same;
+}
+
+int main(int argn, char** argv)
+{
+  size_t n = argn > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+  const char* dir = argn > 2 ? argv[2] : ".";
+  if(n == 0)
+  {
+    fprintf(stderr, "USAGE: %s [ENTRIES] [DIR]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  char filenames[4][PATH_MAX];
+  const char* suffixes[] = { "stdio.ffdata", "stdio.ffindex", "writer.ffdata", "writer.ffindex" };
+  for(int f = 0; f < 4; f++)
+    snprintf(filenames[f], PATH_MAX, "%s/bench_writer.%d.%s", dir, (int)getpid(), suffixes[f]);
+
+  char name[FFINDEX_MAX_ENTRY_NAME_LENTH];
+  char data[BENCH_ENTRY_LENGTH];
+  uint64_t seed = 42;
+  for(int i = 0; i < BENCH_ENTRY_LENGTH; i++)
+    data[i] = "ACGT"[bench_random(&seed) & 3];
+
+  /* Through stdio, a formatted index line and a separator byte per entry */
+  double start = bench_seconds();
+  FILE* data_file = fopen(filenames[0], "w");
+  FILE* index_file = fopen(filenames[1], "w");
+  if(data_file == NULL || index_file == NULL)
+  {
+    perror(dir);
+    return EXIT_FAILURE;
+  }
+  size_t offset = 0;
+  for(size_t i = 0; i < n; i++)
+  {
+    bench_name(i, name);
+    ffindex_insert_memory(data_file, index_file, &offset, data, BENCH_ENTRY_LENGTH, name);
+  }
+  fclose(data_file);
+  fclose(index_file);
+  double stdio_time = bench_seconds() - start;
+
+  start = bench_seconds();
+  ffindex_writer_t* writer = ffindex_writer_open(filenames[2], filenames[3], "w");
+  if(writer == NULL)
+    return EXIT_FAILURE;
+  for(size_t i = 0; i < n; i++)
+  {
+    bench_name(i, name);
+    ffindex_writer_insert_memory(writer, data, BENCH_ENTRY_LENGTH, name);
+  }
+  int err = ffindex_writer_close(writer) != EXIT_SUCCESS;
+  double writer_time = bench_seconds() - start;
+
+  printf("%zu entries of %d bytes\n", n, BENCH_ENTRY_LENGTH);
+  printf("stdio   %8.3f s %12.0f entries/s\n", stdio_time, n / stdio_time);
+  printf("writer  %8.3f s %12.0f entries/s, %.1fx\n", writer_time, n / writer_time, stdio_time / writer_time);
+
+  if(!same_file(filenames[0], filenames[2]) || !same_file(filenames[1], filenames[3]))
+  {
+    fprintf(stderr, "the writer and stdio wrote different files\n");
+    err = 1;
+  }
+  for(int f = 0; f < 4; f++)
+    unlink(filenames[f]);
+  return err ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* vim: ts=2 sw=2 et
+*/
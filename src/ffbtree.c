@@ -0,0 +1,481 @@
+/*
+ * Ffindex
+ * written by Andy Hauser <hauser@genzentrum.lmu.de>.
+ * Please add your name here if you distribute modified versions.
+ *
+ * Ffindex is provided under the Create Commons license "Attribution-ShareAlike
+ * 3.0", which basically captures the spirit of the Gnu Public License (GPL).
+ *
+ * See:
+ * http://creativecommons.org/licenses/by-sa/3.0/
+ *
+ * B+-tree of index entries for the tree mode. Leaves hold the entries themselves in
+ * sorted arrays and are linked for in-order iteration, inner nodes hold the first name
+ * of every child but the first. Equal names are kept, in insertion order.
+ *
+ * Every name in child i + 1 is not less than keys[i], every name in child i not greater.
+ * Deleting keeps this without merging nodes: empty nodes are freed, others may stay underfull.
+*/
+
+#define _GNU_SOURCE 1
+#define _LARGEFILE64_SOURCE 1
+#define _FILE_OFFSET_BITS 64
+
+#include "ffindex.h"
+#include "ffutil.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* About 3 KB per leaf and per inner node */
+#define FFBTREE_LEAF_ENTRIES 64
+#define FFBTREE_INNER_CHILDREN 64
+
+typedef struct ffbtree_leaf {
+  int is_leaf;
+  int n;
+  struct ffbtree_leaf* prev;
+  struct ffbtree_leaf* next;
+  ffindex_entry_t entries[FFBTREE_LEAF_ENTRIES + 1]; /* one more until split */
+} ffbtree_leaf_t;
+
+typedef struct ffbtree_inner {
+  int is_leaf;
+  int n; /* children */
+  char keys[FFBTREE_INNER_CHILDREN][FFINDEX_MAX_ENTRY_NAME_LENTH];
+  void* children[FFBTREE_INNER_CHILDREN + 1]; /* one more until split */
+} ffbtree_inner_t;
+
+struct ffbtree {
+  void* root;
+  ffbtree_leaf_t* first;
+  size_t n_entries;
+};
+
+static int ffbtree_compare(const char* name1, const char* name2)
+{
+  return strncmp(name1, name2, FFINDEX_MAX_ENTRY_NAME_CHARS);
+}
+
+static int ffbtree_is_leaf(void* node)
+{
+  return ((ffbtree_leaf_t*)node)->is_leaf;
+}
+
+static ffbtree_leaf_t* ffbtree_leaf_new(void)
+{
+  ffbtree_leaf_t* leaf = (ffbtree_leaf_t*)malloc(sizeof(ffbtree_leaf_t));
+  if(leaf == NULL)
+  {
+    fferror_print(__FILE__, __LINE__, __func__, "malloc failed");
+    return NULL;
+  }
+  leaf->is_leaf = 1;
+  leaf->n = 0;
+  leaf->prev = NULL;
+  leaf->next = NULL;
+  return leaf;
+}
+
+static ffbtree_inner_t* ffbtree_inner_new(void)
+{
+  ffbtree_inner_t* inner = (ffbtree_inner_t*)malloc(sizeof(ffbtree_inner_t));
+  if(inner == NULL)
+  {
+    fferror_print(__FILE__, __LINE__, __func__, "malloc failed");
+    return NULL;
+  }
+  inner->is_leaf = 0;
+  inner->n = 0;
+  return inner;
+}
+
+/* Number of entries less than name, or with or_equal not greater */
+static int ffbtree_leaf_bound(ffbtree_leaf_t* leaf, const char* name, int or_equal)
+{
+  int low = 0, high = leaf->n;
+  while(low < high)
+  {
+    int mid = (low + high) / 2;
+    int cmp = ffbtree_compare(leaf->entries[mid].name, name);
+    if(cmp < 0 || (or_equal && cmp == 0))
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return low;
+}
+
+/* Child to descend into: the first one that can hold name, or with or_equal the last one */
+static int ffbtree_inner_bound(ffbtree_inner_t* inner, const char* name, int or_equal)
+{
+  int low = 0, high = inner->n - 1;
+  while(low < high)
+  {
+    int mid = (low + high) / 2;
+    int cmp = ffbtree_compare(inner->keys[mid], name);
+    if(cmp < 0 || (or_equal && cmp == 0))
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return low;
+}
+
+ffbtree_t* ffbtree_new(void)
+{
+  ffbtree_t* tree = (ffbtree_t*)malloc(sizeof(ffbtree_t));
+  if(tree == NULL)
+  {
+    fferror_print(__FILE__, __LINE__, __func__, "malloc failed");
+    return NULL;
+  }
+  tree->root = NULL;
+  tree->first = NULL;
+  tree->n_entries = 0;
+  return tree;
+}
+
+static void ffbtree_free_node(void* node)
+{
+  if(!ffbtree_is_leaf(node))
+  {
+    ffbtree_inner_t* inner = (ffbtree_inner_t*)node;
+    for(int i = 0; i < inner->n; i++)
+      ffbtree_free_node(inner->children[i]);
+  }
+  free(node);
+}
+
+void ffbtree_free(ffbtree_t* tree)
+{
+  if(tree == NULL)
+    return;
+  if(tree->root != NULL)
+    ffbtree_free_node(tree->root);
+  free(tree);
+}
+
+size_t ffbtree_size(ffbtree_t* tree)
+{
+  return tree->n_entries;
+}
+
+ffbtree_t* ffbtree_from_sorted(ffindex_entry_t* entries, size_t n)
+{
+  ffbtree_t* tree = ffbtree_new();
+  if(tree == NULL || n == 0)
+    return tree;
+
+  /* Full leaves, then each level of inner nodes over the one below */
+  size_t n_nodes = (n + FFBTREE_LEAF_ENTRIES - 1) / FFBTREE_LEAF_ENTRIES;
+  void** nodes = (void**)malloc(sizeof(void*) * n_nodes);
+  if(nodes == NULL)
+  {
+    fferror_print(__FILE__, __LINE__, __func__, "malloc failed");
+    free(tree);
+    return NULL;
+  }
+
+  ffbtree_leaf_t* prev = NULL;
+  for(size_t i = 0; i < n_nodes; i++)
+  {
+    ffbtree_leaf_t* leaf = ffbtree_leaf_new();
+    if(leaf == NULL)
+    {
+      tree->first = NULL;
+      for(size_t j = 0; j < i; j++)
+        free(nodes[j]);
+      free(nodes);
+      free(tree);
+      return NULL;
+    }
+    leaf->n = i < n_nodes - 1 ? FFBTREE_LEAF_ENTRIES : n - i * FFBTREE_LEAF_ENTRIES;
+    memcpy(leaf->entries, entries + i * FFBTREE_LEAF_ENTRIES, sizeof(ffindex_entry_t) * leaf->n);
+    leaf->prev = prev;
+    if(prev != NULL)
+      prev->next = leaf;
+    else
+      tree->first = leaf;
+    prev = leaf;
+    nodes[i] = leaf;
+  }
+  tree->n_entries = n;
+
+  /* The first name in each node's subtree, for the separators one level up */
+  while(n_nodes > 1)
+  {
+    size_t n_inner = (n_nodes + FFBTREE_INNER_CHILDREN - 1) / FFBTREE_INNER_CHILDREN;
+    for(size_t i = 0; i < n_inner; i++)
+    {
+      ffbtree_inner_t* inner = ffbtree_inner_new();
+      if(inner == NULL)
+      {
+        /* nodes[0, i) are the new inner nodes, nodes[begin of i, n_nodes) are not taken yet */
+        for(size_t j = 0; j < i; j++)
+          ffbtree_free_node(nodes[j]);
+        for(size_t j = i * FFBTREE_INNER_CHILDREN; j < n_nodes; j++)
+          ffbtree_free_node(nodes[j]);
+        free(nodes);
+        free(tree);
+        return NULL;
+      }
+      size_t begin = i * FFBTREE_INNER_CHILDREN;
+      inner->n = n_nodes - begin < FFBTREE_INNER_CHILDREN ? n_nodes - begin : FFBTREE_INNER_CHILDREN;
+      for(int c = 0; c < inner->n; c++)
+      {
+        inner->children[c] = nodes[begin + c];
+        if(c > 0)
+        {
+          void* node = nodes[begin + c];
+          while(!ffbtree_is_leaf(node))
+            node = ((ffbtree_inner_t*)node)->children[0];
+          memcpy(inner->keys[c - 1], ((ffbtree_leaf_t*)node)->entries[0].name, FFINDEX_MAX_ENTRY_NAME_LENTH);
+        }
+      }
+      nodes[i] = inner;
+    }
+    n_nodes = n_inner;
+  }
+
+  tree->root = nodes[0];
+  free(nodes);
+  return tree;
+}
+
+/* Inserts into the subtree of node. If node had to be split, returns the new right
+ * sibling and its first name in separator, NULL otherwise. A full node gets its sibling
+ * allocated before anything is changed, so on failure (*err set) the tree is unchanged.
+ */
+static void* ffbtree_insert_node(void* node, ffindex_entry_t* entry, char* separator, int* err)
+{
+  if(ffbtree_is_leaf(node))
+  {
+    ffbtree_leaf_t* leaf = (ffbtree_leaf_t*)node;
+    ffbtree_leaf_t* right = NULL;
+    if(leaf->n == FFBTREE_LEAF_ENTRIES && (right = ffbtree_leaf_new()) == NULL)
+    {
+      *err = 1;
+      return NULL;
+    }
+
+    int position = ffbtree_leaf_bound(leaf, entry->name, 1);
+    memmove(leaf->entries + position + 1, leaf->entries + position, sizeof(ffindex_entry_t) * (leaf->n - position));
+    leaf->entries[position] = *entry;
+    leaf->n++;
+    if(right == NULL)
+      return NULL;
+
+    right->n = leaf->n / 2;
+    leaf->n -= right->n;
+    memcpy(right->entries, leaf->entries + leaf->n, sizeof(ffindex_entry_t) * right->n);
+    right->prev = leaf;
+    right->next = leaf->next;
+    if(leaf->next != NULL)
+      leaf->next->prev = right;
+    leaf->next = right;
+    memcpy(separator, right->entries[0].name, FFINDEX_MAX_ENTRY_NAME_LENTH);
+    return right;
+  }
+
+  ffbtree_inner_t* inner = (ffbtree_inner_t*)node;
+  ffbtree_inner_t* right = NULL;
+  if(inner->n == FFBTREE_INNER_CHILDREN && (right = ffbtree_inner_new()) == NULL)
+  {
+    *err = 1;
+    return NULL;
+  }
+
+  int child = ffbtree_inner_bound(inner, entry->name, 1);
+  char child_separator[FFINDEX_MAX_ENTRY_NAME_LENTH];
+  void* new_child = ffbtree_insert_node(inner->children[child], entry, child_separator, err);
+  if(new_child == NULL)
+  {
+    free(right);
+    return NULL;
+  }
+
+  memmove(inner->children + child + 2, inner->children + child + 1, sizeof(void*) * (inner->n - child - 1));
+  memmove(inner->keys[child + 1], inner->keys[child], FFINDEX_MAX_ENTRY_NAME_LENTH * (inner->n - child - 1));
+  inner->children[child + 1] = new_child;
+  memcpy(inner->keys[child], child_separator, FFINDEX_MAX_ENTRY_NAME_LENTH);
+  inner->n++;
+  if(right == NULL)
+    return NULL;
+
+  /* The key between the halves moves up */
+  right->n = inner->n / 2;
+  inner->n -= right->n;
+  memcpy(right->children, inner->children + inner->n, sizeof(void*) * right->n);
+  memcpy(right->keys, inner->keys[inner->n], FFINDEX_MAX_ENTRY_NAME_LENTH * (right->n - 1));
+  memcpy(separator, inner->keys[inner->n - 1], FFINDEX_MAX_ENTRY_NAME_LENTH);
+  return right;
+}
+
+int ffbtree_insert(ffbtree_t* tree, ffindex_entry_t* entry)
+{
+  if(tree->root == NULL)
+  {
+    ffbtree_leaf_t* leaf = ffbtree_leaf_new();
+    if(leaf == NULL)
+      return EXIT_FAILURE;
+    tree->root = leaf;
+    tree->first = leaf;
+  }
+
+  /* A full root may split, then the tree grows by a new root */
+  int root_full = ffbtree_is_leaf(tree->root) ? ((ffbtree_leaf_t*)tree->root)->n == FFBTREE_LEAF_ENTRIES
+                                             : ((ffbtree_inner_t*)tree->root)->n == FFBTREE_INNER_CHILDREN;
+  ffbtree_inner_t* root = NULL;
+  if(root_full && (root = ffbtree_inner_new()) == NULL)
+    return EXIT_FAILURE;
+
+  int err = 0;
+  char separator[FFINDEX_MAX_ENTRY_NAME_LENTH];
+  void* right = ffbtree_insert_node(tree->root, entry, separator, &err);
+  if(right != NULL)
+  {
+    root->n = 2;
+    root->children[0] = tree->root;
+    root->children[1] = right;
+    memcpy(root->keys[0], separator, FFINDEX_MAX_ENTRY_NAME_LENTH);
+    tree->root = root;
+  }
+  else
+    free(root);
+  if(err)
+    return EXIT_FAILURE;
+  tree->n_entries++;
+  return EXIT_SUCCESS;
+}
+
+/* Equal names can continue in the next child if its separator is the name */
+static ffindex_entry_t* ffbtree_find_node(void* node, const char* name)
+{
+  if(ffbtree_is_leaf(node))
+  {
+    ffbtree_leaf_t* leaf = (ffbtree_leaf_t*)node;
+    int position = ffbtree_leaf_bound(leaf, name, 0);
+    if(position < leaf->n && ffbtree_compare(leaf->entries[position].name, name) == 0)
+      return &leaf->entries[position];
+    return NULL;
+  }
+
+  ffbtree_inner_t* inner = (ffbtree_inner_t*)node;
+  for(int child = ffbtree_inner_bound(inner, name, 0); child < inner->n; child++)
+  {
+    ffindex_entry_t* entry = ffbtree_find_node(inner->children[child], name);
+    if(entry != NULL)
+      return entry;
+    if(child == inner->n - 1 || ffbtree_compare(inner->keys[child], name) != 0)
+      break;
+  }
+  return NULL;
+}
+
+ffindex_entry_t* ffbtree_find(ffbtree_t* tree, const char* name)
+{
+  if(tree->root == NULL)
+    return NULL;
+  return ffbtree_find_node(tree->root, name);
+}
+
+/* Deletes the first entry named name in the subtree of node. Returns 1 if deleted,
+ * 0 if not found. Sets *empty if node has to be freed by the caller.
+ */
+static int ffbtree_delete_node(ffbtree_t* tree, void* node, const char* name, int* empty)
+{
+  if(ffbtree_is_leaf(node))
+  {
+    ffbtree_leaf_t* leaf = (ffbtree_leaf_t*)node;
+    int position = ffbtree_leaf_bound(leaf, name, 0);
+    if(position == leaf->n || ffbtree_compare(leaf->entries[position].name, name) != 0)
+      return 0;
+    memmove(leaf->entries + position, leaf->entries + position + 1, sizeof(ffindex_entry_t) * (leaf->n - position - 1));
+    leaf->n--;
+    if(leaf->n == 0)
+    {
+      if(leaf->prev != NULL)
+        leaf->prev->next = leaf->next;
+      else
+        tree->first = leaf->next;
+      if(leaf->next != NULL)
+        leaf->next->prev = leaf->prev;
+      *empty = 1;
+    }
+    return 1;
+  }
+
+  ffbtree_inner_t* inner = (ffbtree_inner_t*)node;
+  for(int child = ffbtree_inner_bound(inner, name, 0); child < inner->n; child++)
+  {
+    int child_empty = 0;
+    if(ffbtree_delete_node(tree, inner->children[child], name, &child_empty))
+    {
+      if(child_empty)
+      {
+        free(inner->children[child]);
+        /* Drop the separator on the left of the child, or on its right for the first child */
+        int key = child > 0 ? child - 1 : 0;
+        memmove(inner->children + child, inner->children + child + 1, sizeof(void*) * (inner->n - child - 1));
+        if(inner->n > 1)
+          memmove(inner->keys[key], inner->keys[key + 1], FFINDEX_MAX_ENTRY_NAME_LENTH * (inner->n - 2 - key));
+        inner->n--;
+        *empty = inner->n == 0;
+      }
+      return 1;
+    }
+    if(child == inner->n - 1 || ffbtree_compare(inner->keys[child], name) != 0)
+      break;
+  }
+  return 0;
+}
+
+int ffbtree_delete(ffbtree_t* tree, const char* name)
+{
+  if(tree->root == NULL)
+    return 0;
+
+  int empty = 0;
+  if(!ffbtree_delete_node(tree, tree->root, name, &empty))
+    return 0;
+  tree->n_entries--;
+
+  if(empty)
+  {
+    free(tree->root);
+    tree->root = NULL;
+  }
+  /* A root with a single child is not needed */
+  while(tree->root != NULL && !ffbtree_is_leaf(tree->root) && ((ffbtree_inner_t*)tree->root)->n == 1)
+  {
+    ffbtree_inner_t* root = (ffbtree_inner_t*)tree->root;
+    tree->root = root->children[0];
+    free(root);
+  }
+  return 1;
+}
+
+void ffbtree_cursor_first(ffbtree_t* tree, ffbtree_cursor_t* cursor)
+{
+  cursor->leaf = tree->first;
+  cursor->position = 0;
+}
+
+ffindex_entry_t* ffbtree_cursor_next(ffbtree_cursor_t* cursor)
+{
+  ffbtree_leaf_t* leaf = (ffbtree_leaf_t*)cursor->leaf;
+  if(leaf == NULL)
+    return NULL;
+  ffindex_entry_t* entry = &leaf->entries[cursor->position++];
+  if(cursor->position == leaf->n)
+  {
+    cursor->leaf = leaf->next;
+    cursor->position = 0;
+  }
+  return entry;
+}
+
+/* vim: ts=2 sw=2 et
+*/
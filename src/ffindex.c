@@ -20,21 +20,21 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <libgen.h>
-#include <search.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "ext/fmemopen.h" /* For OS not yet implementing this new standard function */
-#include "twalkmisc.h"
 
 /* XXX Use page size? */
 #define FFINDEX_BUFFER_SIZE 4096
+#define FFINDEX_PARSE_CHUNK_MIN_SIZE (4 * 1024 * 1024)
 
 char* ffindex_copyright_text = "Designed and implemented by Andy Hauser <hauser@genzentrum.lmu.de>.";
 
@@ -82,6 +82,22 @@ int ffindex_index_open(char *data_filename, char *index_filename, char* mode, FI
   return EXIT_SUCCESS;
 }
 
+/* One index line with a single fwrite, names that do not fit the line buffer with two */
+int ffindex_fwrite_entry(FILE* index_file, const char* name, size_t offset, size_t length)
+{
+  char line[FFINDEX_MAX_ENTRY_NAME_LENTH + FFINDEX_ENTRY_NUMBERS_MAX];
+  size_t name_length = strlen(name), line_length = 0;
+  if(name_length <= FFINDEX_MAX_ENTRY_NAME_LENTH)
+  {
+    memcpy(line, name, name_length);
+    line_length = name_length;
+  }
+  else if(fwrite(name, sizeof(char), name_length, index_file) != name_length)
+    return EXIT_FAILURE;
+  line_length += ffindex_format_entry_numbers(line + line_length, offset, length);
+  return fwrite(line, sizeof(char), line_length, index_file) == line_length ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
 int ffindex_insert_ffindex(FILE* data_file, FILE* index_file, size_t* offset, char* data_to_add, ffindex_index_t* index_to_add)
 {
   for(size_t entry_i = 0; entry_i < index_to_add->n_entries; entry_i++)
@@ -102,36 +118,21 @@ int ffindex_insert_memory_add(FILE *data_file, size_t *offset, char *from_start,
     }
     *offset += write_size;
 
-    if (ferror(data_file) != 0) {
-        return 1;
-    }
-
     return 0;
 }
 
 // Finishes one entry that was filled by ffindex_insert_memory_add call(s)
 int ffindex_insert_memory_end(FILE *data_file, FILE *index_file, size_t offset_before, size_t *offset, char *name) {
      // Seperate by '\0' and thus also make sure at least one byte is written
-    char buffer[1] = {'\0'};
-    if (fwrite(buffer, sizeof(char), 1, data_file) != 1) {
-        perror("ffindex_insert_memory_end fwrite(data_file)");
+    if (putc('\0', data_file) == EOF) {
+        perror("ffindex_insert_memory_end putc(data_file)");
         return 1;
     }
     *offset += 1;
 
-    if (ferror(data_file) != 0) {
-        perror("ffindex_insert_memory_end ferror(data_file)");
-        return 1;
-    }
-
     /* write index entry */
-    if (fprintf(index_file, "%s\t%zd\t%zd\n", name, offset_before, *offset - offset_before) < 0) {
-      perror("ffindex_insert_memory_end fprintf(index_file)");
-      return 1;
-    }
-
-    if (ferror(index_file) != 0) {
-      perror("ffindex_insert_memory_end ferror(index_file)");
+    if (ffindex_fwrite_entry(index_file, name, offset_before, *offset - offset_before) != EXIT_SUCCESS) {
+      perror("ffindex_insert_memory_end fwrite(index_file)");
       return 1;
     }
 
@@ -178,42 +179,19 @@ int ffindex_insert_list_file(FILE *data_file, FILE *index_file, size_t *start_of
 /* Insert all files from directory into ffindex */
 int ffindex_insert_dir(FILE *data_file, FILE *index_file, size_t *start_offset, char *input_dir_name)
 {
-  DIR *dir = opendir(input_dir_name);
-  if(dir == NULL)
-  {
-    fferror_print(__FILE__, __LINE__, __func__, input_dir_name);
-    return -1;
-  }
-
-  size_t input_dir_name_len = strlen(input_dir_name);
-  char path[PATH_MAX];
-  strncpy(path, input_dir_name, NAME_MAX);
-  if(input_dir_name[input_dir_name_len - 1] != '/')
-  {
-    path[input_dir_name_len] = '/';
-    input_dir_name_len += 1;
-  }
+  ffindex_file_list_t files;
+  memset(&files, 0, sizeof(files));
+  int err = ffindex_file_list_add_dir(&files, input_dir_name);
 
   size_t offset = *start_offset;
-  struct dirent *entry;
-  while((entry = readdir(dir)) != NULL)
-  {
-    if(entry->d_name[0] == '.')
-      continue;
-    strncpy(path + input_dir_name_len, entry->d_name, NAME_MAX);
-    struct stat sb;
-    if(stat(path, &sb) == -1)
-      fferror_print(__FILE__, __LINE__, __func__, path);
-    if(!S_ISREG(sb.st_mode))
-      continue;
-    ffindex_insert_file(data_file, index_file, &offset, path, entry->d_name);
-  }
-  closedir(dir);
+  for(size_t i = 0; i < files.n_files; i++)
+    ffindex_insert_file(data_file, index_file, &offset, files.paths[i], files.names[i]);
+  ffindex_file_list_free(&files);
 
   /* update return value */
   *start_offset = offset;
 
-  return 0;
+  return err == EXIT_SUCCESS ? 0 : -1;
 }
 
 
@@ -248,17 +226,15 @@ int ffindex_insert_filestream(FILE *data_file, FILE *index_file, size_t *offset,
       warn("fread");
 
     /* Seperate by '\0' and thus also make sure at least one byte is written */
-    buffer[0] = '\0';
-    if(fwrite(buffer, sizeof(char), 1, data_file) != 1)
+    if(putc('\0', data_file) == EOF)
+    {
       perror("ffindex_insert_filestream");
-    *offset += 1;
-    if(ferror(data_file) != 0)
       goto EXCEPTION_ffindex_insert_file;
+    }
+    *offset += 1;
 
     /* write index entry */
-    fprintf(index_file, "%s\t%zd\t%zd\n", name, offset_before, *offset - offset_before);
-
-    if(ferror(file) != 0)
+    if(ffindex_fwrite_entry(index_file, name, offset_before, *offset - offset_before) != EXIT_SUCCESS)
       goto EXCEPTION_ffindex_insert_file;
 
     return myerrno;
@@ -296,70 +272,394 @@ static int ffindex_compare_entries_by_name(const void *pentry1, const void *pent
 {   
   ffindex_entry_t* entry1 = (ffindex_entry_t*)pentry1;
   ffindex_entry_t* entry2 = (ffindex_entry_t*)pentry2;
-  return strncmp(entry1->name, entry2->name, FFINDEX_MAX_ENTRY_NAME_LENTH);
+  return strncmp(entry1->name, entry2->name, FFINDEX_MAX_ENTRY_NAME_CHARS);
 }
 
+static ffindex_entry_t* ffindex_hash_get_entry(ffindex_index_t *index, char *name);
+
+/* Uses the hash index or the numeric keys if present, a binary search otherwise */
 ffindex_entry_t* ffindex_get_entry_by_name(ffindex_index_t *index, char *name)
 {
-  if(index != NULL) {
-	return ffindex_bsearch_get_entry(index, name);
-  }
-  else {
-	return NULL;
-  }
+  if(index == NULL)
+    return NULL;
+  if(index->type == TREE)
+    return ffindex_tree_get_entry(index, name);
+  if(index->hash_slots != NULL)
+    return ffindex_hash_get_entry(index, name);
+  if(index->block_summary != NULL)
+    return ffindex_blocks_get_entry(index, name);
+  if(index->numeric_keys != NULL)
+    return ffindex_numeric_get_entry(index, name);
+  return ffindex_bsearch_get_entry(index, name);
 }
 
 ffindex_entry_t* ffindex_bsearch_get_entry(ffindex_index_t *index, char *name)
 {
+  if(index->search_mode != FFINDEX_SEARCH_BSEARCH)
+    return ffindex_search_get_entry(index, name);
+
   ffindex_entry_t search;
-  strncpy(search.name, name, FFINDEX_MAX_ENTRY_NAME_LENTH);
+  strncpy(search.name, name, FFINDEX_MAX_ENTRY_NAME_CHARS);
+  search.name[FFINDEX_MAX_ENTRY_NAME_CHARS] = '\0';
   return (ffindex_entry_t*)bsearch(&search, index->entries, index->n_entries, sizeof(ffindex_entry_t), ffindex_compare_entries_by_name);
 }
 
 
-ffindex_index_t* ffindex_index_parse(FILE *index_file, size_t num_max_entries)
+/* First entry in [low, n_entries) not less than name: gallop from low, then binary search */
+static size_t ffindex_lower_bound_from(ffindex_index_t* index, size_t low, const char* name)
 {
-  if(num_max_entries == 0)
-    num_max_entries = FFINDEX_MAX_INDEX_ENTRIES_DEFAULT;
-  size_t nbytes = sizeof(ffindex_index_t) + (sizeof(ffindex_entry_t) * num_max_entries);
-  ffindex_index_t *index = (ffindex_index_t *)malloc(nbytes);
+  size_t n = index->n_entries;
+  size_t high = low;
+  for(size_t step = 1; high < n && strncmp(index->entries[high].name, name, FFINDEX_MAX_ENTRY_NAME_CHARS) < 0; step *= 2)
+  {
+    low = high + 1;
+    high = low + step;
+  }
+  if(high > n)
+    high = n;
+  while(low < high)
+  {
+    size_t mid = low + (high - low) / 2;
+    if(strncmp(index->entries[mid].name, name, FFINDEX_MAX_ENTRY_NAME_CHARS) < 0)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return low;
+}
+
+/* Sort the names and merge-join them against the sorted entries, each search starting
+ * where the previous one ended. A blocked index is searched by block instead, a merge join
+ * would page in all of its entries.
+ */
+int ffindex_get_entries_by_names(ffindex_index_t* index, char** names, size_t n_names, ffindex_entry_t** entries)
+{
+  if(index->type == TREE || index->hash_slots != NULL || index->block_summary != NULL || index->numeric_keys != NULL || index->n_entries == 0)
+  {
+    for(size_t i = 0; i < n_names; i++)
+      entries[i] = ffindex_get_entry_by_name(index, names[i]);
+    return EXIT_SUCCESS;
+  }
+
+  size_t* positions = (size_t*)malloc(sizeof(size_t) * n_names);
+  if(positions == NULL && n_names > 0)
+  {
+    fferror_print(__FILE__, __LINE__, __func__, "malloc failed");
+    return EXIT_FAILURE;
+  }
+  if(ffsort_names(names, n_names, positions) != EXIT_SUCCESS)
+  {
+    free(positions);
+    return EXIT_FAILURE;
+  }
+
+  size_t position = 0;
+  for(size_t i = 0; i < n_names; i++)
+  {
+    char* name = names[positions[i]];
+    position = ffindex_lower_bound_from(index, position, name);
+    if(position < index->n_entries && strncmp(index->entries[position].name, name, FFINDEX_MAX_ENTRY_NAME_CHARS) == 0)
+      entries[positions[i]] = &index->entries[position];
+    else
+      entries[positions[i]] = NULL;
+  }
+
+  free(positions);
+  return EXIT_SUCCESS;
+}
+
+
+ffindex_index_t* ffindex_index_new(size_t num_max_entries)
+{
+  ffindex_index_t *index = (ffindex_index_t *)malloc(sizeof(ffindex_index_t));
   if(index == NULL)
   {
-    fprintf(stderr, "Failed to allocate %ld bytes\n", nbytes);
     fferror_print(__FILE__, __LINE__, __func__, "malloc failed");
     return NULL;
   }
-  index->num_max_entries = num_max_entries;
-
-  index->file = index_file;
-  index->index_data = ffindex_mmap_data(index_file, &(index->index_data_size));
-  if(index->index_data_size == 0)
-    warn("Problem with data file. Is the file empty or is another process reading it?");
-  
-  if(index->index_data == MAP_FAILED)
+  index->type = SORTED_ARRAY; /* XXX Assume a sorted file for now */
+  index->filename = NULL;
+  index->file = NULL;
+  index->index_data = NULL;
+  index->index_data_size = 0;
+  index->tree_root = NULL;
+  index->num_max_entries = 0;
+  index->n_entries = 0;
+  index->entries = NULL;
+  index->binary_data = NULL;
+  index->binary_data_size = 0;
+  index->hash_slots = NULL;
+  index->hash_n_slots = 0;
+  index->hash_data = NULL;
+  index->hash_data_size = 0;
+  index->search_mode = FFINDEX_SEARCH_BSEARCH;
+  index->search_keys = NULL;
+  index->search_positions = NULL;
+  index->search_prefix_offset = 0;
+  index->numeric_keys = NULL;
+  index->numeric_positions = NULL;
+  index->numeric_interpolate = 0;
+  index->block_summary = NULL;
+  index->block_n_entries = 0;
+  index->n_blocks = 0;
+
+  if(ffindex_index_reserve(index, num_max_entries) != EXIT_SUCCESS)
   {
     free(index);
     return NULL;
   }
+  return index;
+}
 
-  index->type = SORTED_ARRAY; /* XXX Assume a sorted file for now */
-  size_t i = 0;
-  char* d = index->index_data;
-  char* end;
+int ffindex_index_reserve(ffindex_index_t* index, size_t num_max_entries)
+{
+  if(num_max_entries <= index->num_max_entries && index->binary_data == NULL)
+    return EXIT_SUCCESS;
+  if(num_max_entries < index->n_entries)
+    num_max_entries = index->n_entries;
+
+  size_t nbytes = sizeof(ffindex_entry_t) * num_max_entries;
+  ffindex_entry_t* entries;
+  if(index->binary_data == NULL)
+    entries = (ffindex_entry_t*)realloc(index->entries, nbytes);
+  else
+    entries = (ffindex_entry_t*)malloc(nbytes);
+  if(entries == NULL && nbytes > 0)
+  {
+    fprintf(stderr, "Failed to allocate %zu bytes\n", nbytes);
+    fferror_print(__FILE__, __LINE__, __func__, "malloc failed");
+    return EXIT_FAILURE;
+  }
+
+  /* Entries of a binary index are copied out of the mapping */
+  if(index->binary_data != NULL)
+  {
+    memcpy(entries, index->entries, sizeof(ffindex_entry_t) * index->n_entries);
+    munmap(index->binary_data, index->binary_data_size);
+    index->binary_data = NULL;
+    index->binary_data_size = 0;
+  }
+
+  index->entries = entries;
+  index->num_max_entries = num_max_entries;
+  return EXIT_SUCCESS;
+}
+
+/* Lookup structures built from the entries are stale once the entries change */
+static void ffindex_index_entries_changed(ffindex_index_t* index)
+{
+  ffindex_index_drop_hash(index);
+  ffindex_index_drop_search(index);
+  ffindex_index_drop_numeric(index);
+  ffindex_index_drop_blocks(index);
+}
+
+ffindex_entry_t* ffindex_index_add_entry(ffindex_index_t* index, const char* name, size_t offset, size_t length)
+{
+  if(index->n_entries == index->num_max_entries)
+  {
+    size_t num_max_entries = index->num_max_entries < 1024 ? 1024 : index->num_max_entries * 2;
+    if(ffindex_index_reserve(index, num_max_entries) != EXIT_SUCCESS)
+      return NULL;
+  }
+
+  ffindex_index_entries_changed(index);
+  ffindex_entry_t* entry = &index->entries[index->n_entries++];
+  strncpy(entry->name, name, FFINDEX_MAX_ENTRY_NAME_CHARS);
+  entry->name[FFINDEX_MAX_ENTRY_NAME_CHARS] = '\0';
+  entry->offset = offset;
+  entry->length = length;
+  return entry;
+}
+
+/* Parse the index lines in [d, end) into entries, at most max_entries. Returns the number of entries. */
+static size_t ffindex_parse_entries(char* d, char* end, ffindex_entry_t* entries, size_t max_entries)
+{
+  size_t i;
+  char* next;
   /* Faster than scanf per line */
-  for(i = 0; d < (index->index_data + index->index_data_size); i++)
+  for(i = 0; d < end && i < max_entries; i++)
   {
     int p;
-    for(p = 0; *d != '\t'; d++)
-      index->entries[i].name[p++] = *d;
-    index->entries[i].name[p] = '\0';
-    index->entries[i].offset = strtoull(d, &end, 10);
-    d = end;
-    index->entries[i].length  = strtoull(d, &end, 10);
-    d = end + 1; /* +1 for newline */
+    for(p = 0; d < end && *d != '\t'; d++)
+      if(p < FFINDEX_MAX_ENTRY_NAME_CHARS)
+        entries[i].name[p++] = *d;
+    entries[i].name[p] = '\0';
+    entries[i].offset = strtoull(d, &next, 10);
+    d = next;
+    entries[i].length  = strtoull(d, &next, 10);
+    d = next + 1; /* +1 for newline */
+  }
+  return i;
+}
+
+/* Number of lines in [d, end), a last line without newline counts too */
+static size_t ffindex_count_entries(char* d, char* end)
+{
+  size_t n = 0;
+  char* last = d;
+  while(d < end && (d = memchr(d, '\n', end - d)) != NULL)
+  {
+    n++;
+    last = ++d;
+  }
+  if(last < end)
+    n++;
+  return n;
+}
+
+/* Start of the line containing position, at begin or after it */
+static char* ffindex_line_start(char* begin, char* position)
+{
+  char* newline = (char*)memrchr(begin, '\n', position - begin);
+  return newline == NULL ? begin : newline + 1;
+}
+
+/* Compares the name of a parsed line like the sorted entries are compared */
+static int ffindex_lazy_compare(ffindex_entry_t* entry, const char* name, int numeric, uint64_t key)
+{
+  if(!numeric)
+    return strncmp(entry->name, name, FFINDEX_MAX_ENTRY_NAME_CHARS);
+  uint64_t entry_key;
+  if(!ffindex_parse_numeric_name(entry->name, &entry_key))
+    return 1;
+  return entry_key < key ? -1 : entry_key > key;
+}
+
+/* Binary search over the line starts in [index_data, end), parsing only the lines probed */
+static ffindex_entry_t* ffindex_lazy_search(char* index_data, size_t index_data_size, const char* name,
+                                            int numeric, uint64_t key, ffindex_entry_t* entry)
+{
+  char* end = index_data + index_data_size;
+  char* low = index_data;
+  char* high = end;
+  while(low < high)
+  {
+    char* line = ffindex_line_start(low, low + (high - low) / 2);
+    ffindex_parse_entries(line, end, entry, 1);
+    if(ffindex_lazy_compare(entry, name, numeric, key) < 0)
+    {
+      char* next = (char*)memchr(line, '\n', end - line);
+      low = next == NULL ? end : next + 1;
+    }
+    else
+      high = line;
   }
+  if(low == end || ffindex_parse_entries(low, end, entry, 1) == 0 || ffindex_lazy_compare(entry, name, numeric, key) != 0)
+    return NULL;
+  return entry;
+}
 
-  index->n_entries = i;
+ffindex_entry_t* ffindex_lazy_get_entry(char* index_data, size_t index_data_size, const char* name, ffindex_entry_t* entry)
+{
+  if(index_data_size == 0)
+    return NULL;
+  if(ffindex_lazy_search(index_data, index_data_size, name, 0, 0, entry) != NULL)
+    return entry;
+
+  /* Not found in name order, but the index may be sorted by numeric value (-N) */
+  uint64_t key, first, last;
+  if(!ffindex_parse_numeric_name(name, &key))
+    return NULL;
+  char* end = index_data + index_data_size;
+  ffindex_parse_entries(index_data, end, entry, 1);
+  if(!ffindex_parse_numeric_name(entry->name, &first))
+    return NULL;
+  ffindex_parse_entries(ffindex_line_start(index_data, end - 1), end, entry, 1);
+  if(!ffindex_parse_numeric_name(entry->name, &last) || first > last)
+    return NULL;
+  return ffindex_lazy_search(index_data, index_data_size, name, 1, key, entry);
+}
+
+typedef struct ffindex_parse_chunk {
+  char* start;
+  char* end;
+  ffindex_entry_t* entries;
+  size_t n_entries;
+} ffindex_parse_chunk_t;
+
+static void* ffindex_count_chunk(void* arg)
+{
+  ffindex_parse_chunk_t* chunk = (ffindex_parse_chunk_t*)arg;
+  chunk->n_entries = ffindex_count_entries(chunk->start, chunk->end);
+  return NULL;
+}
+
+static void* ffindex_parse_chunk(void* arg)
+{
+  ffindex_parse_chunk_t* chunk = (ffindex_parse_chunk_t*)arg;
+  ffindex_parse_entries(chunk->start, chunk->end, chunk->entries, chunk->n_entries);
+  return NULL;
+}
+
+/* Split at newlines into one chunk per thread */
+static void ffindex_split_chunks(char* data, size_t data_size, ffindex_parse_chunk_t* chunks, int n_chunks)
+{
+  char* end = data + data_size;
+  char* start = data;
+  for(int t = 0; t < n_chunks; t++)
+  {
+    char* chunk_end = end;
+    if(t < n_chunks - 1)
+    {
+      chunk_end = data + data_size / n_chunks * (t + 1);
+      if(chunk_end < start)
+        chunk_end = start;
+      char* newline = memchr(chunk_end, '\n', end - chunk_end);
+      chunk_end = newline == NULL ? end : newline + 1;
+    }
+    chunks[t].start = start;
+    chunks[t].end = chunk_end;
+    start = chunk_end;
+  }
+}
+
+/* Single pass over the mmapped index: count the lines of each chunk concurrently,
+ * allocate, then parse every chunk at its prefix-summed position.
+ * num_max_entries == 0 allocates exactly as many entries as there are lines.
+ */
+static ffindex_index_t* ffindex_index_parse_mapped(FILE *index_file, char* data, size_t data_size, size_t num_max_entries, int n_threads)
+{
+  /* Not worth a thread below some MB per chunk */
+  if((size_t)n_threads > data_size / FFINDEX_PARSE_CHUNK_MIN_SIZE)
+    n_threads = data_size / FFINDEX_PARSE_CHUNK_MIN_SIZE;
+  if(n_threads > FFINDEX_MAX_THREADS)
+    n_threads = FFINDEX_MAX_THREADS;
+  if(n_threads < 1)
+    n_threads = 1;
+
+  ffindex_parse_chunk_t chunks[n_threads];
+  ffindex_split_chunks(data, data_size, chunks, n_threads);
+  ffrun_tasks(chunks, sizeof(ffindex_parse_chunk_t), n_threads, ffindex_count_chunk);
+
+  size_t n_lines = 0;
+  for(int t = 0; t < n_threads; t++)
+    n_lines += chunks[t].n_entries;
+
+  if(num_max_entries == 0)
+    num_max_entries = n_lines;
+  else if(n_lines > num_max_entries)
+    fprintf(stderr, "Warning: index has more than %zu entries, the rest is ignored\n", num_max_entries);
+
+  ffindex_index_t *index = ffindex_index_new(num_max_entries);
+  if(index == NULL)
+    return NULL;
+  index->file = index_file;
+  index->index_data = data;
+  index->index_data_size = data_size;
+
+  size_t n_entries = 0;
+  for(int t = 0; t < n_threads; t++)
+  {
+    chunks[t].entries = index->entries + n_entries;
+    if(n_entries + chunks[t].n_entries > num_max_entries)
+      chunks[t].n_entries = num_max_entries - n_entries;
+    n_entries += chunks[t].n_entries;
+  }
+
+  ffrun_tasks(chunks, sizeof(ffindex_parse_chunk_t), n_threads, ffindex_parse_chunk);
+
+  index->n_entries = n_entries;
 
   if(index->n_entries == 0)
     warn("index with 0 entries");
@@ -367,9 +667,617 @@ ffindex_index_t* ffindex_index_parse(FILE *index_file, size_t num_max_entries)
   return index;
 }
 
+static ffindex_index_t* ffindex_index_parse_file(FILE *index_file, size_t num_max_entries, int n_threads)
+{
+  size_t data_size;
+  char* data = ffindex_mmap_data(index_file, &data_size);
+  if(data_size == 0)
+    warn("Problem with data file. Is the file empty or is another process reading it?");
+
+  if(data == MAP_FAILED)
+    return NULL;
+
+  ffindex_index_t* index = ffindex_index_parse_mapped(index_file, data, data_size, num_max_entries, n_threads);
+  if(index == NULL)
+    munmap(data, data_size);
+  return index;
+}
+
+ffindex_index_t* ffindex_index_parse(FILE *index_file, size_t num_max_entries)
+{
+  return ffindex_index_parse_threaded(index_file, num_max_entries, ffget_num_threads());
+}
+
+ffindex_index_t* ffindex_index_parse_threaded(FILE *index_file, size_t num_max_entries, int n_threads)
+{
+  return ffindex_index_parse_file(index_file, num_max_entries, n_threads);
+}
+
+
+/* On-disk layout of the sidecar files next to a text index: this header followed by n_records records.
+ * The binary index stores the entries, the hash index its slots. The blocked index has its own layout,
+ * see ffindex_write_blocks.
+ * The size, the mtime to the nanosecond and the inode of the text index it was created from are used
+ * to detect a stale sidecar, also one left behind when the text index was replaced by another file.
+ */
+#define FFINDEX_BINARY_MAGIC "FFINDEXB"
+#define FFINDEX_HASH_MAGIC "FFINDEXH"
+#define FFINDEX_BLOCKS_MAGIC "FFINDEXK"
+#define FFINDEX_SIDECAR_VERSION 2
+
+typedef struct ffindex_sidecar_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  uint32_t name_length;
+  uint32_t type;
+  uint64_t n_entries;
+  uint64_t index_size;
+  int64_t index_mtime_sec;
+  int64_t index_mtime_nsec;
+  uint64_t index_inode;
+  uint64_t n_records;
+} ffindex_sidecar_header_t;
+
+static void ffindex_stat_mtime(struct stat *sb, int64_t *sec, int64_t *nsec)
+{
+#ifdef __APPLE__
+  *sec = sb->st_mtimespec.tv_sec;
+  *nsec = sb->st_mtimespec.tv_nsec;
+#else
+  *sec = sb->st_mtim.tv_sec;
+  *nsec = sb->st_mtim.tv_nsec;
+#endif
+}
+
+/* index_sb is set to the stat of the text index */
+static int ffindex_sidecar_header_init(ffindex_sidecar_header_t* header, ffindex_index_t* index, const char* index_filename,
+                                       const char* magic, size_t record_size, size_t n_records, struct stat* index_sb)
+{
+  /* The text index has to be completely written and closed at this point */
+  struct stat sb;
+  if(stat(index_filename, &sb) == -1) { perror(index_filename); return EXIT_FAILURE; }
+  *index_sb = sb;
+
+  memset(header, 0, sizeof(*header));
+  memcpy(header->magic, magic, sizeof(header->magic));
+  header->version = FFINDEX_SIDECAR_VERSION;
+  header->record_size = record_size;
+  header->name_length = FFINDEX_MAX_ENTRY_NAME_LENTH;
+  header->type = index->type;
+  header->n_entries = index->n_entries;
+  header->index_size = sb.st_size;
+  ffindex_stat_mtime(&sb, &header->index_mtime_sec, &header->index_mtime_nsec);
+  header->index_inode = sb.st_ino;
+  header->n_records = n_records;
+  return EXIT_SUCCESS;
+}
+
+/* The sidecar was written for the text index as it is now */
+static int ffindex_sidecar_header_valid(ffindex_sidecar_header_t* header, struct stat* index_sb, const char* magic, size_t record_size)
+{
+  int64_t mtime_sec, mtime_nsec;
+  ffindex_stat_mtime(index_sb, &mtime_sec, &mtime_nsec);
+  return memcmp(header->magic, magic, sizeof(header->magic)) == 0
+         && header->version == FFINDEX_SIDECAR_VERSION
+         && header->record_size == record_size
+         && header->name_length == FFINDEX_MAX_ENTRY_NAME_LENTH
+         && header->index_size == (uint64_t)index_sb->st_size
+         && header->index_mtime_sec == mtime_sec
+         && header->index_mtime_nsec == mtime_nsec
+         && header->index_inode == (uint64_t)index_sb->st_ino;
+}
+
+/* The sidecar next to the index and the temporary file it is first written to */
+static int ffindex_sidecar_filenames(const char* index_filename, const char* suffix, char* sidecar_filename, char* tmp_filename)
+{
+  if(snprintf(sidecar_filename, FILENAME_MAX, "%s%s", index_filename, suffix) >= FILENAME_MAX
+     || snprintf(tmp_filename, FILENAME_MAX, "%s.%d", sidecar_filename, (int)getpid()) >= FILENAME_MAX)
+  {
+    errno = ENAMETOOLONG;
+    perror(index_filename);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+/* Created with the permissions of the text index instead of the umask, readable by whoever may read the index */
+static FILE* ffindex_create_sidecar(const char* tmp_filename, struct stat* index_sb)
+{
+  mode_t mode = index_sb->st_mode & 0777;
+  int fd = open(tmp_filename, O_WRONLY | O_CREAT | O_TRUNC, mode);
+  if(fd < 0)
+  {
+    perror(tmp_filename);
+    return NULL;
+  }
+  FILE* sidecar_file = NULL;
+  if(fchmod(fd, mode) == -1 || (sidecar_file = fdopen(fd, "w")) == NULL)
+  {
+    perror(tmp_filename);
+    close(fd);
+    unlink(tmp_filename);
+  }
+  return sidecar_file;
+}
+
+static int ffindex_write_sidecar(ffindex_index_t* index, const char* index_filename, const char* suffix, const char* magic,
+                                 const void* records, size_t record_size, size_t n_records)
+{
+  ffindex_sidecar_header_t header;
+  struct stat index_sb;
+  if(ffindex_sidecar_header_init(&header, index, index_filename, magic, record_size, n_records, &index_sb) != EXIT_SUCCESS)
+    return EXIT_FAILURE;
+
+  char sidecar_filename[FILENAME_MAX];
+  char tmp_filename[FILENAME_MAX];
+  if(ffindex_sidecar_filenames(index_filename, suffix, sidecar_filename, tmp_filename) != EXIT_SUCCESS)
+    return EXIT_FAILURE;
+
+  FILE* sidecar_file = ffindex_create_sidecar(tmp_filename, &index_sb);
+  if(sidecar_file == NULL)
+    return EXIT_FAILURE;
+
+  if(fwrite(&header, sizeof(header), 1, sidecar_file) != 1
+     || fwrite(records, record_size, n_records, sidecar_file) != n_records
+     || fclose(sidecar_file) != 0)
+  {
+    perror(tmp_filename);
+    unlink(tmp_filename);
+    return EXIT_FAILURE;
+  }
+
+  /* Readers see either the old or the new sidecar, never a partial one */
+  if(rename(tmp_filename, sidecar_filename) == -1)
+  {
+    perror(sidecar_filename);
+    unlink(tmp_filename);
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/* Maps a sidecar private and writable if it is up to date. Returns NULL without complaining otherwise. */
+static char* ffindex_map_sidecar(const char* index_filename, const char* suffix, const char* magic, size_t record_size, size_t* sidecar_size)
+{
+  struct stat index_sb;
+  if(stat(index_filename, &index_sb) == -1)
+    return NULL;
+
+  char sidecar_filename[FILENAME_MAX];
+  if(snprintf(sidecar_filename, FILENAME_MAX, "%s%s", index_filename, suffix) >= FILENAME_MAX)
+    return NULL;
+
+  int fd = open(sidecar_filename, O_RDONLY);
+  if(fd < 0)
+    return NULL;
+
+  struct stat sb;
+  if(fstat(fd, &sb) == -1 || (size_t)sb.st_size < sizeof(ffindex_sidecar_header_t))
+  {
+    close(fd);
+    return NULL;
+  }
+
+  *sidecar_size = sb.st_size;
+  char* sidecar = mmap(NULL, *sidecar_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(sidecar == MAP_FAILED)
+    return NULL;
+
+  ffindex_sidecar_header_t* header = (ffindex_sidecar_header_t*)sidecar;
+  if(!ffindex_sidecar_header_valid(header, &index_sb, magic, record_size)
+     || header->n_records != (*sidecar_size - sizeof(ffindex_sidecar_header_t)) / record_size)
+  {
+    munmap(sidecar, *sidecar_size);
+    return NULL;
+  }
+
+  return sidecar;
+}
+
+int ffindex_write_binary(ffindex_index_t* index, const char* index_filename)
+{
+  if(index->type == TREE)
+  {
+    fprintf(stderr, "ffindex_write_binary: index in tree mode can not be written as binary index\n");
+    return EXIT_FAILURE;
+  }
+  return ffindex_write_sidecar(index, index_filename, FFINDEX_BINARY_SUFFIX, FFINDEX_BINARY_MAGIC,
+                               index->entries, sizeof(ffindex_entry_t), index->n_entries);
+}
+
+/* Returns NULL without complaining if there is no usable binary index. */
+ffindex_index_t* ffindex_index_parse_binary(const char* index_filename)
+{
+  /* Private writable mapping, so the entries can be sorted and unlinked like parsed ones */
+  size_t binary_data_size;
+  char* binary_data = ffindex_map_sidecar(index_filename, FFINDEX_BINARY_SUFFIX, FFINDEX_BINARY_MAGIC, sizeof(ffindex_entry_t), &binary_data_size);
+  if(binary_data == NULL)
+    return NULL;
+
+  ffindex_sidecar_header_t* header = (ffindex_sidecar_header_t*)binary_data;
+  if(header->n_records != header->n_entries)
+  {
+    munmap(binary_data, binary_data_size);
+    return NULL;
+  }
+
+  ffindex_index_t *index = ffindex_index_new(0);
+  if(index == NULL)
+  {
+    munmap(binary_data, binary_data_size);
+    return NULL;
+  }
+
+  index->type = header->type;
+  index->n_entries = header->n_entries;
+  index->num_max_entries = header->n_entries;
+  index->entries = (ffindex_entry_t*)(binary_data + sizeof(ffindex_sidecar_header_t));
+  index->binary_data = binary_data;
+  index->binary_data_size = binary_data_size;
+
+  return index;
+}
+
+
+/* Blocked index: the sidecar header, this header, zeros up to the page aligned entries,
+ * the entries and the summary of the first name of every block. A block holds a multiple
+ * of the entries that fill whole pages, so every block starts at a page boundary.
+ */
+#define FFINDEX_BLOCK_ALIGN 4096
+
+typedef struct ffindex_blocks_header {
+  uint64_t block_n_entries;
+  uint64_t n_blocks;
+  uint64_t entries_offset;
+  uint64_t summary_offset;
+} ffindex_blocks_header_t;
+
+static size_t ffindex_block_n_entries(size_t block_size)
+{
+  size_t a = sizeof(ffindex_entry_t), b = FFINDEX_BLOCK_ALIGN;
+  while(b != 0)
+  {
+    size_t r = a % b;
+    a = b;
+    b = r;
+  }
+  size_t page_n_entries = FFINDEX_BLOCK_ALIGN / a; /* entries filling whole pages */
+  size_t n = block_size / sizeof(ffindex_entry_t) / page_n_entries * page_n_entries;
+  return n < page_n_entries ? page_n_entries : n;
+}
+
+int ffindex_write_blocks(ffindex_index_t* index, const char* index_filename, size_t block_size)
+{
+  if(index->type == TREE || ffsort_sorted_prefix(index->entries, index->n_entries) != index->n_entries)
+  {
+    fprintf(stderr, "ffindex_write_blocks: only a sorted index can be written as blocked index\n");
+    return EXIT_FAILURE;
+  }
+
+  ffindex_sidecar_header_t header;
+  struct stat index_sb;
+  if(ffindex_sidecar_header_init(&header, index, index_filename, FFINDEX_BLOCKS_MAGIC, sizeof(ffindex_entry_t), index->n_entries, &index_sb) != EXIT_SUCCESS)
+    return EXIT_FAILURE;
+
+  ffindex_blocks_header_t blocks_header;
+  blocks_header.block_n_entries = ffindex_block_n_entries(block_size);
+  blocks_header.n_blocks = (index->n_entries + blocks_header.block_n_entries - 1) / blocks_header.block_n_entries;
+  blocks_header.entries_offset = (sizeof(header) + sizeof(blocks_header) + FFINDEX_BLOCK_ALIGN - 1) / FFINDEX_BLOCK_ALIGN * FFINDEX_BLOCK_ALIGN;
+  blocks_header.summary_offset = blocks_header.entries_offset + sizeof(ffindex_entry_t) * index->n_entries;
+
+  char sidecar_filename[FILENAME_MAX];
+  char tmp_filename[FILENAME_MAX];
+  if(ffindex_sidecar_filenames(index_filename, FFINDEX_BLOCKS_SUFFIX, sidecar_filename, tmp_filename) != EXIT_SUCCESS)
+    return EXIT_FAILURE;
+
+  FILE* sidecar_file = ffindex_create_sidecar(tmp_filename, &index_sb);
+  if(sidecar_file == NULL)
+    return EXIT_FAILURE;
+
+  static const char zeros[FFINDEX_BLOCK_ALIGN];
+  size_t padding = blocks_header.entries_offset - sizeof(header) - sizeof(blocks_header);
+  int err = fwrite(&header, sizeof(header), 1, sidecar_file) != 1
+            || fwrite(&blocks_header, sizeof(blocks_header), 1, sidecar_file) != 1
+            || fwrite(zeros, 1, padding, sidecar_file) != padding
+            || fwrite(index->entries, sizeof(ffindex_entry_t), index->n_entries, sidecar_file) != index->n_entries;
+  for(size_t block = 0; block < blocks_header.n_blocks && !err; block++)
+    err = fwrite(index->entries[block * blocks_header.block_n_entries].name, FFINDEX_MAX_ENTRY_NAME_LENTH, 1, sidecar_file) != 1;
+  if(fclose(sidecar_file) != 0 || err)
+  {
+    perror(tmp_filename);
+    unlink(tmp_filename);
+    return EXIT_FAILURE;
+  }
+
+  if(rename(tmp_filename, sidecar_filename) == -1)
+  {
+    perror(sidecar_filename);
+    unlink(tmp_filename);
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/* Returns NULL without complaining if there is no usable blocked index. */
+ffindex_index_t* ffindex_index_parse_blocks(const char* index_filename)
+{
+  struct stat index_sb;
+  if(stat(index_filename, &index_sb) == -1)
+    return NULL;
+
+  char sidecar_filename[FILENAME_MAX];
+  if(snprintf(sidecar_filename, FILENAME_MAX, "%s%s", index_filename, FFINDEX_BLOCKS_SUFFIX) >= FILENAME_MAX)
+    return NULL;
+  int fd = open(sidecar_filename, O_RDONLY);
+  if(fd < 0)
+    return NULL;
+
+  ffindex_sidecar_header_t header;
+  ffindex_blocks_header_t blocks_header;
+  struct stat sb;
+  if(fstat(fd, &sb) == -1
+     || pread(fd, &header, sizeof(header), 0) != sizeof(header)
+     || pread(fd, &blocks_header, sizeof(blocks_header), sizeof(header)) != sizeof(blocks_header)
+     || !ffindex_sidecar_header_valid(&header, &index_sb, FFINDEX_BLOCKS_MAGIC, sizeof(ffindex_entry_t))
+     || header.n_records != header.n_entries
+     || blocks_header.block_n_entries == 0
+     || blocks_header.n_blocks != (header.n_entries + blocks_header.block_n_entries - 1) / blocks_header.block_n_entries
+     || blocks_header.summary_offset != blocks_header.entries_offset + sizeof(ffindex_entry_t) * header.n_entries
+     || (uint64_t)sb.st_size != blocks_header.summary_offset + FFINDEX_MAX_ENTRY_NAME_LENTH * blocks_header.n_blocks)
+  {
+    close(fd);
+    return NULL;
+  }
+
+  /* Only the summary is read, the blocks are paged in when looked up */
+  size_t summary_size = FFINDEX_MAX_ENTRY_NAME_LENTH * blocks_header.n_blocks;
+  char* summary = (char*)malloc(summary_size);
+  char* blocks_data = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(summary == NULL || blocks_data == MAP_FAILED || pread(fd, summary, summary_size, blocks_header.summary_offset) != (ssize_t)summary_size)
+  {
+    free(summary);
+    if(blocks_data != MAP_FAILED)
+      munmap(blocks_data, sb.st_size);
+    close(fd);
+    return NULL;
+  }
+  close(fd);
+  /* A lookup needs one block, read ahead would only fill the page cache with others */
+  madvise(blocks_data, sb.st_size, MADV_RANDOM);
+
+  ffindex_index_t *index = ffindex_index_new(0);
+  if(index == NULL)
+  {
+    free(summary);
+    munmap(blocks_data, sb.st_size);
+    return NULL;
+  }
+
+  index->type = header.type;
+  index->n_entries = header.n_entries;
+  index->num_max_entries = header.n_entries;
+  index->entries = (ffindex_entry_t*)(blocks_data + blocks_header.entries_offset);
+  index->binary_data = blocks_data;
+  index->binary_data_size = sb.st_size;
+  index->block_summary = summary;
+  index->block_n_entries = blocks_header.block_n_entries;
+  index->n_blocks = blocks_header.n_blocks;
+
+  return index;
+}
+
+ffindex_entry_t* ffindex_blocks_get_entry(ffindex_index_t* index, char* name)
+{
+  /* The last block starting with a name not greater than name */
+  size_t low = 0, high = index->n_blocks;
+  while(low < high)
+  {
+    size_t mid = low + (high - low) / 2;
+    if(strncmp(index->block_summary + mid * FFINDEX_MAX_ENTRY_NAME_LENTH, name, FFINDEX_MAX_ENTRY_NAME_CHARS) <= 0)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  if(low == 0)
+    return NULL;
+
+  size_t begin = (low - 1) * index->block_n_entries;
+  size_t n = index->n_entries - begin < index->block_n_entries ? index->n_entries - begin : index->block_n_entries;
+  ffindex_entry_t search;
+  strncpy(search.name, name, FFINDEX_MAX_ENTRY_NAME_CHARS);
+  search.name[FFINDEX_MAX_ENTRY_NAME_CHARS] = '\0';
+  return (ffindex_entry_t*)bsearch(&search, index->entries + begin, n, sizeof(ffindex_entry_t), ffindex_compare_entries_by_name);
+}
+
+void ffindex_index_drop_blocks(ffindex_index_t* index)
+{
+  /* The entries stay in the mapping, which is unmapped with the index or when the entries are copied out */
+  free(index->block_summary);
+  index->block_summary = NULL;
+  index->block_n_entries = 0;
+  index->n_blocks = 0;
+}
+
+
+/* Hash index: open addressing with linear probing over a power of two number of slots.
+ * A slot holds the entry position + 1 (0 is empty) in the lower bits and the upper
+ * bits of the name hash, so most probes of other names do not touch the entries.
+ */
+#define FFINDEX_HASH_POSITION_BITS 40
+#define FFINDEX_HASH_POSITION_MASK ((UINT64_C(1) << FFINDEX_HASH_POSITION_BITS) - 1)
+
+static uint64_t ffindex_hash_name(const char* name)
+{
+  /* FNV-1a over the part of the name strncmp compares, then a final mix for the lower bits */
+  uint64_t hash = UINT64_C(14695981039346656037);
+  for(int i = 0; i < FFINDEX_MAX_ENTRY_NAME_CHARS && name[i] != '\0'; i++)
+  {
+    hash ^= (unsigned char)name[i];
+    hash *= UINT64_C(1099511628211);
+  }
+  hash ^= hash >> 33;
+  hash *= UINT64_C(0xff51afd7ed558ccd);
+  hash ^= hash >> 33;
+  return hash;
+}
+
+void ffindex_index_drop_hash(ffindex_index_t* index)
+{
+  if(index->hash_data != NULL)
+    munmap(index->hash_data, index->hash_data_size);
+  else
+    free(index->hash_slots);
+  index->hash_data = NULL;
+  index->hash_data_size = 0;
+  index->hash_slots = NULL;
+  index->hash_n_slots = 0;
+}
+
+int ffindex_index_build_hash(ffindex_index_t* index)
+{
+  if(index->type == TREE || index->n_entries >= FFINDEX_HASH_POSITION_MASK)
+    return EXIT_FAILURE;
+
+  size_t n_slots = 16;
+  while(n_slots < 2 * index->n_entries)
+    n_slots *= 2;
+
+  uint64_t* slots = (uint64_t*)calloc(n_slots, sizeof(uint64_t));
+  if(slots == NULL)
+  {
+    fferror_print(__FILE__, __LINE__, __func__, "calloc failed");
+    return EXIT_FAILURE;
+  }
+
+  for(size_t i = 0; i < index->n_entries; i++)
+  {
+    uint64_t hash = ffindex_hash_name(index->entries[i].name);
+    size_t slot = hash & (n_slots - 1);
+    while(slots[slot] != 0)
+      slot = (slot + 1) & (n_slots - 1);
+    slots[slot] = (hash & ~FFINDEX_HASH_POSITION_MASK) | (i + 1);
+  }
+
+  ffindex_index_drop_hash(index);
+  index->hash_slots = slots;
+  index->hash_n_slots = n_slots;
+  return EXIT_SUCCESS;
+}
+
+static ffindex_entry_t* ffindex_hash_get_entry(ffindex_index_t *index, char *name)
+{
+  uint64_t hash = ffindex_hash_name(name);
+  uint64_t fingerprint = hash & ~FFINDEX_HASH_POSITION_MASK;
+  size_t mask = index->hash_n_slots - 1;
+  uint64_t slot;
+  for(size_t i = hash & mask; (slot = index->hash_slots[i]) != 0; i = (i + 1) & mask)
+  {
+    if((slot & ~FFINDEX_HASH_POSITION_MASK) != fingerprint)
+      continue;
+    ffindex_entry_t* entry = &index->entries[(slot & FFINDEX_HASH_POSITION_MASK) - 1];
+    if(strncmp(entry->name, name, FFINDEX_MAX_ENTRY_NAME_CHARS) == 0)
+      return entry;
+  }
+  return NULL;
+}
+
+int ffindex_write_hash(ffindex_index_t* index, const char* index_filename)
+{
+  if(index->hash_slots == NULL && ffindex_index_build_hash(index) != EXIT_SUCCESS)
+  {
+    fprintf(stderr, "ffindex_write_hash: could not build hash index\n");
+    return EXIT_FAILURE;
+  }
+  return ffindex_write_sidecar(index, index_filename, FFINDEX_HASH_SUFFIX, FFINDEX_HASH_MAGIC,
+                               index->hash_slots, sizeof(uint64_t), index->hash_n_slots);
+}
+
+int ffindex_index_attach_hash(ffindex_index_t* index, const char* index_filename)
+{
+  size_t hash_data_size;
+  char* hash_data = ffindex_map_sidecar(index_filename, FFINDEX_HASH_SUFFIX, FFINDEX_HASH_MAGIC, sizeof(uint64_t), &hash_data_size);
+  if(hash_data == NULL)
+    return EXIT_FAILURE;
+
+  ffindex_sidecar_header_t* header = (ffindex_sidecar_header_t*)hash_data;
+  size_t n_slots = header->n_records;
+  if(header->n_entries != index->n_entries || n_slots == 0 || (n_slots & (n_slots - 1)) != 0)
+  {
+    munmap(hash_data, hash_data_size);
+    return EXIT_FAILURE;
+  }
+
+  ffindex_index_drop_hash(index);
+  index->hash_data = hash_data;
+  index->hash_data_size = hash_data_size;
+  index->hash_slots = (uint64_t*)(hash_data + sizeof(ffindex_sidecar_header_t));
+  index->hash_n_slots = n_slots;
+  return EXIT_SUCCESS;
+}
+
+ffindex_index_t* ffindex_index_load(FILE *index_file, const char* index_filename)
+{
+  ffindex_index_t* index = ffindex_index_parse_blocks(index_filename);
+  if(index == NULL)
+    index = ffindex_index_parse_binary(index_filename);
+
+  /* mmap once, count the lines and parse, no separate pass with ffcount_lines */
+  if(index == NULL)
+    index = ffindex_index_parse_file(index_file, 0, ffget_num_threads());
+
+  if(index != NULL)
+  {
+    ffindex_index_attach_hash(index, index_filename);
+
+    const char* search = getenv("FFINDEX_SEARCH");
+    if(search != NULL && strcmp(search, "eytzinger") == 0)
+      ffindex_index_build_search(index, FFINDEX_SEARCH_EYTZINGER);
+    else if(search != NULL && strcmp(search, "prefix") == 0)
+      ffindex_index_build_search(index, FFINDEX_SEARCH_PREFIX);
+  }
+
+  return index;
+}
+
+void ffindex_index_prepare_lookups(ffindex_index_t* index)
+{
+  /* Checking the first and last name is cheap, building fails on the first non-numeric name.
+   * Not for a blocked index, which would be read completely. */
+  const char* numeric = getenv("FFINDEX_NUMERIC_KEYS");
+  uint64_t key;
+  if(index->type != TREE && index->hash_slots == NULL && index->block_summary == NULL && index->numeric_keys == NULL
+     && index->n_entries > 0 && (numeric == NULL || strcmp(numeric, "0") != 0)
+     && ffindex_parse_numeric_name(index->entries[0].name, &key)
+     && ffindex_parse_numeric_name(index->entries[index->n_entries - 1].name, &key))
+    ffindex_index_build_numeric(index);
+}
+
+void ffindex_index_free(ffindex_index_t* index)
+{
+  if(index == NULL)
+    return;
+  if(index->index_data != NULL)
+    munmap(index->index_data, index->index_data_size);
+  if(index->binary_data != NULL)
+    munmap(index->binary_data, index->binary_data_size);
+  else
+    free(index->entries);
+  ffindex_index_drop_hash(index);
+  ffindex_index_drop_search(index);
+  ffindex_index_drop_numeric(index);
+  ffindex_index_drop_blocks(index);
+  if(index->type == TREE)
+    ffbtree_free((ffbtree_t*)index->tree_root);
+  free(index);
+}
+
 ffindex_entry_t* ffindex_get_entry_by_index(ffindex_index_t *index, size_t entry_index)
 {
-  if(index != NULL && entry_index < index->n_entries)
+  if(index != NULL && index->type != TREE && entry_index < index->n_entries)
     return &index->entries[entry_index];
   else
     return NULL;
@@ -392,7 +1300,7 @@ char* ffindex_get_data_by_entry(char *data, ffindex_entry_t* entry)
 
 char* ffindex_get_data_by_name(char *data, ffindex_index_t *index, char *name)
 {
-  ffindex_entry_t* entry = ffindex_bsearch_get_entry(index, name);
+  ffindex_entry_t* entry = ffindex_get_entry_by_name(index, name);
 
   if(entry == NULL)
     return NULL;
@@ -421,7 +1329,7 @@ FILE* ffindex_fopen_by_entry(char *data, ffindex_entry_t* entry)
 
 FILE* ffindex_fopen_by_name(char *data, ffindex_index_t *index, char *filename)
 {
-  ffindex_entry_t* entry = ffindex_bsearch_get_entry(index, filename);
+  ffindex_entry_t* entry = ffindex_get_entry_by_name(index, filename);
 
   if(entry == NULL)
     return NULL;
@@ -432,7 +1340,17 @@ FILE* ffindex_fopen_by_name(char *data, ffindex_index_t *index, char *filename)
 
 void ffindex_sort_index_file(ffindex_index_t *index)
 {
-  qsort(index->entries, index->n_entries, sizeof(ffindex_entry_t), ffindex_compare_entries_by_name);
+  ffindex_index_entries_changed(index);
+  /* Appended to a sorted index: sort the tail and merge, O(n + k log k) */
+  size_t n_sorted = ffsort_sorted_prefix(index->entries, index->n_entries);
+  if(n_sorted == index->n_entries)
+    return;
+  if(index->n_entries - n_sorted <= n_sorted &&
+     ffsort_merge_tail(index->entries, index->n_entries, n_sorted, ffget_num_threads()) == EXIT_SUCCESS)
+    return;
+  /* qsort needs no extra memory */
+  if(ffsort_entries_by_name(index->entries, index->n_entries, ffget_num_threads()) != EXIT_SUCCESS)
+    qsort(index->entries, index->n_entries, sizeof(ffindex_entry_t), ffindex_compare_entries_by_name);
 }
 
 
@@ -444,40 +1362,256 @@ int ffindex_write(ffindex_index_t* index, FILE* index_file)
 
   for(size_t i = 0; i < index->n_entries; i++)
   {
-    ffindex_entry_t ffindex_entry = index->entries[i];
-    if(fprintf(index_file, "%s\t%zd\t%zd\n", ffindex_entry.name, ffindex_entry.offset, ffindex_entry.length) < 0)
+    ffindex_entry_t* entry = &index->entries[i];
+    if(ffindex_fwrite_entry(index_file, entry->name, entry->offset, entry->length) != EXIT_SUCCESS)
       return EXIT_FAILURE;
   }
   return EXIT_SUCCESS;
 }
 
 
+/* First of the sorted names that is not less than name */
+static size_t ffindex_names_lower_bound(char** names, size_t* positions, size_t n_names, const char* name)
+{
+  size_t low = 0, high = n_names;
+  while(low < high)
+  {
+    size_t mid = low + (high - low) / 2;
+    if(strncmp(names[positions[mid]], name, FFINDEX_MAX_ENTRY_NAME_CHARS) < 0)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return low;
+}
+
+int ffindex_unlink_names(ffindex_index_t* index, char** names, size_t n_names, ffindex_entry_t** unlinked, size_t* n_unlinked)
+{
+  if(unlinked != NULL)
+  {
+    *unlinked = NULL;
+    *n_unlinked = 0;
+  }
+  if(index->type == TREE)
+  {
+    if(unlinked != NULL)
+    {
+      fprintf(stderr, "ffindex_unlink_names: the unlinked entries of a tree are not available\n");
+      return EXIT_FAILURE;
+    }
+    for(size_t i = 0; i < n_names; i++)
+      ffindex_tree_unlink(index, names[i]);
+    return EXIT_SUCCESS;
+  }
+
+  /* Entries sorted by name are merge joined with the names. Otherwise, e.g. in numeric order,
+   * each entry is looked up among the names, which keeps the order of the index. */
+  int sorted = ffsort_sorted_prefix(index->entries, index->n_entries) == index->n_entries;
+  size_t* positions = (size_t*)malloc(sizeof(size_t) * n_names);
+  ffindex_entry_t* removed = unlinked != NULL ? (ffindex_entry_t*)malloc(sizeof(ffindex_entry_t) * n_names) : NULL;
+  char* found = sorted ? NULL : (char*)calloc(n_names, 1);
+  if((positions == NULL || (unlinked != NULL && removed == NULL) || (!sorted && found == NULL)) && n_names > 0)
+  {
+    fferror_print(__FILE__, __LINE__, __func__, "malloc failed");
+    free(positions);
+    free(removed);
+    free(found);
+    return EXIT_FAILURE;
+  }
+  if(ffsort_names(names, n_names, positions) != EXIT_SUCCESS)
+  {
+    free(positions);
+    free(removed);
+    free(found);
+    return EXIT_FAILURE;
+  }
+
+  /* The kept entries are moved down in the same pass */
+  size_t n_kept = 0, j = 0;
+  for(size_t i = 0; i < index->n_entries; i++)
+  {
+    const char* name = index->entries[i].name;
+    int cmp = 1;
+    if(sorted)
+    {
+      while(j < n_names && (cmp = strncmp(names[positions[j]], name, FFINDEX_MAX_ENTRY_NAME_CHARS)) < 0)
+        fprintf(stderr, "Warning: could not find '%s'\n", names[positions[j++]]);
+    }
+    else
+    {
+      /* Each name unlinks one entry, a repeated name the next one */
+      j = ffindex_names_lower_bound(names, positions, n_names, name);
+      while(j < n_names && (cmp = strncmp(names[positions[j]], name, FFINDEX_MAX_ENTRY_NAME_CHARS)) == 0 && found[j])
+        j++;
+    }
+    if(j < n_names && cmp == 0)
+    {
+      if(removed != NULL)
+        removed[(*n_unlinked)++] = index->entries[i];
+      if(found != NULL)
+        found[j] = 1;
+      j++;
+      continue;
+    }
+    if(n_kept != i)
+      index->entries[n_kept] = index->entries[i];
+    n_kept++;
+  }
+  for(j = sorted ? j : 0; j < n_names; j++)
+    if(found == NULL || !found[j])
+      fprintf(stderr, "Warning: could not find '%s'\n", names[positions[j]]);
+  if(n_kept != index->n_entries)
+    ffindex_index_entries_changed(index);
+  index->n_entries = n_kept;
+
+  if(unlinked != NULL)
+    *unlinked = removed;
+  free(positions);
+  free(found);
+  return EXIT_SUCCESS;
+}
+
 ffindex_index_t* ffindex_unlink_entries(ffindex_index_t* index, char** sorted_names_to_unlink, int n_names)
 {
-  size_t i = index->n_entries - 1;
-  /* walk list of names to delete */
-  for(int n = n_names - 1; n >= 0;  n--)
+  ffindex_unlink_names(index, sorted_names_to_unlink, n_names, NULL, NULL);
+  return index;
+}
+
+
+typedef struct ffindex_range {
+  size_t begin;
+  size_t end;
+} ffindex_range_t;
+
+static int ffindex_compare_ranges(const void* prange1, const void* prange2)
+{
+  const ffindex_range_t* range1 = (const ffindex_range_t*)prange1;
+  const ffindex_range_t* range2 = (const ffindex_range_t*)prange2;
+  return range1->begin < range2->begin ? -1 : range1->begin > range2->begin;
+}
+
+/* Sorts and merges overlapping or adjacent ranges, returns the new number of ranges */
+static size_t ffindex_merge_ranges(ffindex_range_t* ranges, size_t n)
+{
+  if(n == 0)
+    return 0;
+  qsort(ranges, n, sizeof(ffindex_range_t), ffindex_compare_ranges);
+  size_t n_merged = 1;
+  for(size_t i = 1; i < n; i++)
   {
-    char* name_to_unlink = sorted_names_to_unlink[n];
-    /* walk index entries */
-    for(; i-- > 0;)
+    if(ranges[i].begin <= ranges[n_merged - 1].end)
     {
-      int cmp = strncmp(name_to_unlink, index->entries[i].name, FFINDEX_MAX_ENTRY_NAME_LENTH);
-      if(cmp == 0) /* found entry */
+      if(ranges[i].end > ranges[n_merged - 1].end)
+        ranges[n_merged - 1].end = ranges[i].end;
+    }
+    else
+      ranges[n_merged++] = ranges[i];
+  }
+  return n_merged;
+}
+
+int ffindex_punch_holes(int data_fd, ffindex_index_t* index, ffindex_entry_t* unlinked, size_t n_unlinked, size_t* punched)
+{
+  *punched = 0;
+#if defined(FALLOC_FL_PUNCH_HOLE) && defined(FALLOC_FL_KEEP_SIZE)
+  if(index->type == TREE)
+  {
+    fprintf(stderr, "ffindex_punch_holes: index in tree mode is not supported\n");
+    return EXIT_FAILURE;
+  }
+
+  ffindex_range_t* dead = (ffindex_range_t*)malloc(sizeof(ffindex_range_t) * (n_unlinked + 1));
+  if(dead == NULL)
+  {
+    fferror_print(__FILE__, __LINE__, __func__, "malloc failed");
+    return EXIT_FAILURE;
+  }
+  size_t n_dead = 0;
+  for(size_t i = 0; i < n_unlinked; i++)
+    if(unlinked[i].length > 0)
+    {
+      dead[n_dead].begin = unlinked[i].offset;
+      dead[n_dead].end = unlinked[i].offset + unlinked[i].length;
+      n_dead++;
+    }
+  n_dead = ffindex_merge_ranges(dead, n_dead);
+
+  /* Live entries overlapping the dead ranges, usually none unless entries share data.
+   * One pass over the entries with a binary search each, memory only for the overlaps. */
+  size_t n_live = 0, max_live = 1024;
+  ffindex_range_t* live = (ffindex_range_t*)malloc(sizeof(ffindex_range_t) * max_live);
+  if(live == NULL)
+  {
+    fferror_print(__FILE__, __LINE__, __func__, "malloc failed");
+    free(dead);
+    return EXIT_FAILURE;
+  }
+  for(size_t i = 0; i < index->n_entries && n_dead > 0; i++)
+  {
+    size_t begin = index->entries[i].offset, end = begin + index->entries[i].length;
+    /* The first dead range ending after begin */
+    size_t low = 0, high = n_dead;
+    while(low < high)
+    {
+      size_t mid = low + (high - low) / 2;
+      if(dead[mid].end <= begin)
+        low = mid + 1;
+      else
+        high = mid;
+    }
+    if(low == n_dead || dead[low].begin >= end)
+      continue;
+    if(n_live == max_live)
+    {
+      max_live *= 2;
+      ffindex_range_t* more = (ffindex_range_t*)realloc(live, sizeof(ffindex_range_t) * max_live);
+      if(more == NULL)
       {
-        /* Move entries after the unlinked ones to close the gap */
-        size_t n_entries_to_move = index->n_entries - i - 1;
-        if(n_entries_to_move > 0) /* not last element of array */
-          memmove(index->entries + i, index->entries + i + 1, n_entries_to_move * sizeof(ffindex_entry_t));
-        index->n_entries--;
-        break;
+        fferror_print(__FILE__, __LINE__, __func__, "realloc failed");
+        free(dead);
+        free(live);
+        return EXIT_FAILURE;
+      }
+      live = more;
+    }
+    live[n_live].begin = begin;
+    live[n_live].end = end;
+    n_live++;
+  }
+  n_live = ffindex_merge_ranges(live, n_live);
+
+  /* Punch the dead ranges minus the live ones */
+  int err = EXIT_SUCCESS;
+  size_t l = 0;
+  for(size_t d = 0; d < n_dead && err == EXIT_SUCCESS; d++)
+  {
+    size_t position = dead[d].begin;
+    while(l < n_live && live[l].end <= position)
+      l++;
+    for(size_t k = l; position < dead[d].end && err == EXIT_SUCCESS; k++)
+    {
+      size_t end = k < n_live && live[k].begin < dead[d].end ? live[k].begin : dead[d].end;
+      if(end > position)
+      {
+        if(fallocate(data_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, position, end - position) == -1)
+          err = EXIT_FAILURE;
+        else
+          *punched += end - position;
       }
-      else if(cmp > 0) /* not found */
+      if(k >= n_live || live[k].begin >= dead[d].end)
         break;
+      if(live[k].end > position)
+        position = live[k].end;
     }
   }
 
-  return index;
+  free(dead);
+  free(live);
+  return err;
+#else
+  errno = EOPNOTSUPP;
+  return EXIT_FAILURE;
+#endif
 }
 
 
@@ -487,12 +1621,13 @@ ffindex_index_t* ffindex_unlink(ffindex_index_t* index, char* name_to_unlink)
   if(index->type == TREE)
     return ffindex_tree_unlink(index, name_to_unlink);
 
-  ffindex_entry_t* entry = ffindex_bsearch_get_entry(index, name_to_unlink);
+  ffindex_entry_t* entry = ffindex_get_entry_by_name(index, name_to_unlink);
   if(entry == NULL)
   {
     fprintf(stderr, "Warning: could not find '%s'\n", name_to_unlink);
     return index;
   }
+  ffindex_index_entries_changed(index);
   /* Move entries after the unlinked one to close the gap */
   size_t n_entries_to_move = index->entries + index->n_entries - entry - 1;
   if(n_entries_to_move > 0) /* not last element of array */
@@ -505,9 +1640,7 @@ ffindex_index_t* ffindex_unlink(ffindex_index_t* index, char* name_to_unlink)
 
 ffindex_entry_t *ffindex_tree_get_entry(ffindex_index_t* index, char* name)
 {
-  ffindex_entry_t search;
-  strncpy(search.name, name, FFINDEX_MAX_ENTRY_NAME_LENTH);
-  return (ffindex_entry_t *)tfind((const void *)&search, &index->tree_root, ffindex_compare_entries_by_name);
+  return ffbtree_find((ffbtree_t*)index->tree_root, name);
 }
 
 
@@ -518,57 +1651,65 @@ ffindex_index_t* ffindex_tree_unlink(ffindex_index_t* index, char* name_to_unlin
     fferror_print(__FILE__, __LINE__, __func__, "tree is NULL");
     return NULL;
   }
-  ffindex_entry_t search;
-  strncpy(search.name, name_to_unlink, FFINDEX_MAX_ENTRY_NAME_LENTH);
-  tdelete((const void *)&search, &index->tree_root, ffindex_compare_entries_by_name);
+  if(!ffbtree_delete((ffbtree_t*)index->tree_root, name_to_unlink))
+    fprintf(stderr, "Warning: could not find '%s'\n", name_to_unlink);
+  index->n_entries = ffbtree_size((ffbtree_t*)index->tree_root);
   return index;
 }
 
 ffindex_index_t* ffindex_index_as_tree(ffindex_index_t* index)
 {
-  index->tree_root = NULL;
-  for(size_t i = 0; i < index->n_entries; i++)
+  ffindex_index_entries_changed(index);
+  /* Sorting first and bulk loading full nodes is much faster than inserting one by one */
+  ffbtree_t* tree;
+  if(ffsort_sorted_prefix(index->entries, index->n_entries) == index->n_entries
+     || ffsort_entries_by_name(index->entries, index->n_entries, ffget_num_threads()) == EXIT_SUCCESS)
+    tree = ffbtree_from_sorted(index->entries, index->n_entries);
+  else
   {
-    ffindex_entry_t *entry = &index->entries[i];
-    tsearch((const void *)entry, &index->tree_root, ffindex_compare_entries_by_name);
-    //entry = *(ffindex_entry_t **)tsearch((const void *)entry, &index->tree_root, ffindex_compare_entries_by_name);
-    //printf("entry find: %s\n", entry->name); 
+    tree = ffbtree_new();
+    for(size_t i = 0; tree != NULL && i < index->n_entries; i++)
+      if(ffbtree_insert(tree, &index->entries[i]) != EXIT_SUCCESS)
+      {
+        ffbtree_free(tree);
+        tree = NULL;
+      }
+  }
+  if(tree == NULL)
+  {
+    fferror_print(__FILE__, __LINE__, __func__, "building the tree failed");
+    return NULL;
   }
+
+  /* The tree holds copies of the entries, the array is not needed anymore */
+  if(index->binary_data != NULL)
+    munmap(index->binary_data, index->binary_data_size);
+  else
+    free(index->entries);
+  index->binary_data = NULL;
+  index->binary_data_size = 0;
+  index->entries = NULL;
+  index->num_max_entries = 0;
+
+  index->tree_root = tree;
   index->type = TREE;
   return index;
 }
 
-void action(const void *node, const VISIT which, const int depth, void * misc)
-{
-    ffindex_entry_t *entry;
-    FILE * index_file = (FILE *) misc;
-    switch (which)
-    {
-        case preorder:
-            break;
-        case endorder:
-            break;
-        case postorder:
-        case leaf:
-            entry = *(ffindex_entry_t **) node;
-            if(fprintf(index_file, "%s\t%zd\t%zd\n", entry->name, entry->offset, entry->length) < 0)
-                break;
-    }
-}
-
 int ffindex_tree_write(ffindex_index_t* index, FILE* index_file)
 {
-  int ret = EXIT_SUCCESS;
-
-  twalkmisc(index->tree_root, action, (void *) index_file);
-  return ret;
+  ffbtree_cursor_t cursor;
+  ffbtree_cursor_first((ffbtree_t*)index->tree_root, &cursor);
+  ffindex_entry_t* entry;
+  while((entry = ffbtree_cursor_next(&cursor)) != NULL)
+    if(ffindex_fwrite_entry(index_file, entry->name, entry->offset, entry->length) != EXIT_SUCCESS)
+      return EXIT_FAILURE;
+  return EXIT_SUCCESS;
 }
 
 void ffsort_index(const char* index_filename) {
   FILE* index_fh = fopen(index_filename, "r");
-  size_t lines = ffcount_lines(index_filename);
-
-  ffindex_index_t* index = ffindex_index_parse(index_fh, lines);
+  ffindex_index_t* index = ffindex_index_parse(index_fh, 0);
   fclose(index_fh);
 
   if(index == NULL)	{
@@ -602,7 +1743,10 @@ void ffmerge_splits(const char* data_filename, const char* index_filename,
     exit(EXIT_FAILURE);
   }
 
-  size_t offset = 0;
+  /* Only the writer writes to the files */
+  ffindex_writer_t* writer = ffindex_writer_new(fileno(data_file), fileno(index_file), 0);
+  if(writer == NULL)
+    exit(EXIT_FAILURE);
 
   // Append ffindex split databases
   for (int i = first_split_index; i <= last_split_index; i++) {
@@ -647,16 +1791,10 @@ void ffmerge_splits(const char* data_filename, const char* index_filename,
     size_t data_size;
     char *data_to_add = ffindex_mmap_data(data_file_to_add, &data_size);
 
-    size_t lines = ffcount_lines(index_file_name_to_add);
-    ffindex_index_t* index_to_add = ffindex_index_parse(index_file_to_add, lines);
+    ffindex_index_t* index_to_add = ffindex_index_load(index_file_to_add, index_file_name_to_add);
 
-    for(size_t entry_i = 0; entry_i < index_to_add->n_entries; entry_i++)
-    {
-      ffindex_entry_t *entry = ffindex_get_entry_by_index(index_to_add, entry_i);
-      ffindex_insert_memory(data_file, index_file, &offset,
-                            ffindex_get_data_by_entry(data_to_add, entry),
-                            entry->length - 1, entry->name);
-    }
+    if(ffindex_writer_insert_ffindex(writer, data_to_add, index_to_add) != EXIT_SUCCESS)
+      exit(EXIT_FAILURE);
 
     fclose(data_file_to_add);
     fclose(index_file_to_add);
@@ -667,6 +1805,8 @@ void ffmerge_splits(const char* data_filename, const char* index_filename,
     }
   }
 
+  if(ffindex_writer_close(writer) != EXIT_SUCCESS)
+    exit(EXIT_FAILURE);
   fclose(data_file);
   fclose(index_file);
 
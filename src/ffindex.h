@@ -19,14 +19,25 @@
 
 #define _FFINDEX_H 1
 
+#include <stdint.h>
 #include <stdio.h>
 
 #define FFINDEX_VERSION 0.980
 #define FFINDEX_MAX_INDEX_ENTRIES_DEFAULT 200000000 
 #define FFINDEX_MAX_ENTRY_NAME_LENTH 32
+/* Characters of a name kept in an entry and compared in lookups, longer names are cut */
+#define FFINDEX_MAX_ENTRY_NAME_CHARS (FFINDEX_MAX_ENTRY_NAME_LENTH - 1)
+#define FFINDEX_MAX_THREADS 1024
+#define FFINDEX_BINARY_SUFFIX ".bin"
+#define FFINDEX_HASH_SUFFIX ".hash"
+#define FFINDEX_BLOCKS_SUFFIX ".blocks"
+#define FFINDEX_BLOCK_SIZE_DEFAULT (64 * 1024)
+#define FFINDEX_NUMERIC_MAX_DIGITS 19
 
 enum ffindex_type { PLAIN_FILE, SORTED_FILE, SORTED_ARRAY, TREE };
 
+enum ffindex_search_mode { FFINDEX_SEARCH_BSEARCH, FFINDEX_SEARCH_EYTZINGER, FFINDEX_SEARCH_PREFIX };
+
 typedef struct ffindex_entry {
   size_t offset;
   size_t length;
@@ -39,12 +50,43 @@ typedef struct ffindex_index {
   FILE* file;
   char* index_data;
   size_t index_data_size;
-  void* tree_root;
+  void* tree_root; /* ffbtree_t in tree mode */
   size_t num_max_entries;
   size_t n_entries;
-  ffindex_entry_t entries[]; /* This array is as big as the excess memory allocated for this struct. */
+  ffindex_entry_t* entries; /* Allocated separately or pointing into the mmapped binary index. */
+  char* binary_data; /* mmapped binary index, NULL if parsed from text */
+  size_t binary_data_size;
+  uint64_t* hash_slots; /* hash index for lookups by name, NULL if not present */
+  size_t hash_n_slots;
+  char* hash_data; /* mmapped hash index, NULL if built in memory */
+  size_t hash_data_size;
+  enum ffindex_search_mode search_mode; /* layout of the search accelerator for sorted indexes */
+  uint64_t* search_keys; /* name keys in search order, NULL if not present */
+  size_t* search_positions; /* entries position of each key, NULL if keys are in entries order */
+  size_t search_prefix_offset; /* length of the prefix shared by all names */
+  uint64_t* numeric_keys; /* sorted integer values of numeric names, NULL if not present */
+  size_t* numeric_positions; /* entries position of each key, NULL if entries are in numeric order */
+  int numeric_interpolate; /* keys are spread evenly enough for an interpolation search */
+  char* block_summary; /* first name of each block of the blocked index, NULL if not present */
+  size_t block_n_entries; /* entries per block */
+  size_t n_blocks;
 } ffindex_index_t;
 
+/* Compact alternative to ffindex_index_t: dense offset and length arrays, names are
+ * (position << 24 | length) references into the mmapped text index. Names are not
+ * limited to FFINDEX_MAX_ENTRY_NAME_LENTH, entries are limited to 4 GB.
+ */
+typedef struct ffindex_packed_index {
+  char* index_data;
+  size_t index_data_size;
+  size_t n_entries;
+  uint64_t* offsets;
+  uint32_t* lengths;
+  uint64_t* names;
+} ffindex_packed_index_t;
+
+#define FFINDEX_PACKED_NOT_FOUND ((size_t)-1)
+
 /* return *out_data_file, *out_index_file, out_offset. */
 int ffindex_index_open(char *data_filename, char *index_filename, char* mode, FILE **out_data_file, FILE **out_index_file, size_t *out_offset);
 
@@ -66,6 +108,109 @@ int ffindex_insert_list_file(FILE *data_file, FILE *index_file, size_t *start_of
 
 int ffindex_insert_dir(FILE *data_file, FILE *index_file, size_t *offset, char *input_dir_name);
 
+/* Longest "\t<offset>\t<length>\n" of an index line */
+#define FFINDEX_ENTRY_NUMBERS_MAX (2 * 21 + 1)
+#define FFINDEX_WRITER_BUFFER_SIZE (1024 * 1024)
+/* Smaller files are cheaper to copy into the buffer than to flush it for them */
+#define FFINDEX_WRITER_ZERO_COPY_MIN (64 * 1024)
+
+/* Formats "\t<offset>\t<length>\n" of an index line into buffer, returns its length */
+size_t ffindex_format_entry_numbers(char* buffer, size_t offset, size_t length);
+
+/* Writes one index line through ffindex_format_entry_numbers */
+int ffindex_fwrite_entry(FILE* index_file, const char* name, size_t offset, size_t length);
+
+/* Buffered writer of new entries, faster than the ffindex_insert_* functions on
+ * stdio streams for many small entries. Nothing is written before a buffer is full
+ * or ffindex_writer_flush or ffindex_writer_close is called.
+ */
+typedef struct ffindex_writer {
+  int data_fd;
+  int index_fd;
+  int owns_fds;
+  size_t offset;       /* data file offset of the next byte */
+  size_t entry_offset; /* data file offset of the entry being added */
+  char* data_buffer;
+  size_t data_used;
+  char* index_buffer;
+  size_t index_used;
+  size_t buffer_size;
+} ffindex_writer_t;
+
+/* Writes to open file descriptors at their current positions, the data file position being offset.
+ * ffindex_writer_close does not close them.
+ */
+ffindex_writer_t* ffindex_writer_new(int data_fd, int index_fd, size_t offset);
+
+/* Like ffindex_index_open: mode "a" appends to existing files, otherwise the files must not exist */
+ffindex_writer_t* ffindex_writer_open(char* data_filename, char* index_filename, char* mode);
+
+int ffindex_writer_flush(ffindex_writer_t* writer);
+
+/* Flushes, closes the files if opened by ffindex_writer_open and frees the writer */
+int ffindex_writer_close(ffindex_writer_t* writer);
+
+/* Adds data to the current entry, ffindex_writer_end finishes it */
+int ffindex_writer_add(ffindex_writer_t* writer, const char* data, size_t length);
+
+int ffindex_writer_end(ffindex_writer_t* writer, const char* name);
+
+int ffindex_writer_insert_memory(ffindex_writer_t* writer, const char* data, size_t length, const char* name);
+
+int ffindex_writer_insert_fd(ffindex_writer_t* writer, int fd, const char* name);
+
+int ffindex_writer_insert_filestream(ffindex_writer_t* writer, FILE* file, const char* name);
+
+int ffindex_writer_insert_file(ffindex_writer_t* writer, const char* path, const char* name);
+
+/* Paths of files to insert and their entry names */
+typedef struct ffindex_file_list {
+  char** paths;
+  char** names;
+  size_t n_files;
+  size_t max_files;
+} ffindex_file_list_t;
+
+/* Makes room for n_more files */
+int ffindex_file_list_reserve(ffindex_file_list_t* list, size_t n_more);
+
+/* Adds copies of path and name to a zeroed or freed list */
+int ffindex_file_list_add(ffindex_file_list_t* list, const char* path, const char* name);
+
+/* One path per line, named by its basename */
+int ffindex_file_list_add_list_file(ffindex_file_list_t* list, FILE* list_file);
+
+/* The regular files in a directory, except hidden ones, sorted by name */
+int ffindex_file_list_add_dir(ffindex_file_list_t* list, char* input_dir_name);
+
+/* The regular files in a directory and, if recursive, all its subdirectories, found by
+ * n_threads threads (ffwalk.c). Hidden files and directories are left out, symbolic links
+ * are followed to files but not to directories. Entries are named by the path below
+ * input_dir_name if relative_names, else by their file name. The files are grouped by
+ * directory, directories sorted by path and files by name.
+ */
+int ffindex_file_list_add_tree(ffindex_file_list_t* list, char* input_dir_name, int recursive, int relative_names, int n_threads);
+
+void ffindex_file_list_free(ffindex_file_list_t* list);
+
+/* Inserts the files of the list. With n_threads > 1 as many threads open and read the
+ * files ahead into a bounded queue, while the calling thread writes them in the order
+ * they are read, or in list order if ordered. Files that can not be read are skipped.
+ */
+int ffindex_writer_insert_files(ffindex_writer_t* writer, ffindex_file_list_t* files, int n_threads, int ordered);
+
+/* The same with the files opened and read through io_uring, hundreds at a time, by the
+ * calling thread alone (ffuring.c). Falls back to ffindex_writer_insert_files with
+ * n_threads where io_uring is not available at build or run time.
+ */
+int ffindex_writer_insert_files_uring(ffindex_writer_t* writer, ffindex_file_list_t* files, int n_threads, int ordered);
+
+int ffindex_writer_insert_list_file(ffindex_writer_t* writer, FILE* list_file);
+
+int ffindex_writer_insert_dir(ffindex_writer_t* writer, char* input_dir_name);
+
+int ffindex_writer_insert_ffindex(ffindex_writer_t* writer, char* data_to_add, ffindex_index_t* index_to_add);
+
 FILE* ffindex_fopen_by_entry(char *data, ffindex_entry_t* entry);
 
 FILE* ffindex_fopen_by_name(char *data, ffindex_index_t *index, char *name);
@@ -84,28 +229,240 @@ ffindex_entry_t* ffindex_get_entry_by_index(ffindex_index_t *index, size_t entry
 
 ffindex_entry_t* ffindex_get_entry_by_name(ffindex_index_t *index, char *name);
 
+/* num_max_entries == 0 allocates exactly as many entries as the index has lines */
 ffindex_index_t* ffindex_index_parse(FILE *index_file, size_t num_max_entries);
 
+/* Splits the index at line boundaries and parses the parts with n_threads threads.
+ * ffindex_index_parse uses ffget_num_threads() threads.
+ */
+ffindex_index_t* ffindex_index_parse_threaded(FILE *index_file, size_t num_max_entries, int n_threads);
+
+/* Binary index: a copy of the entries array next to the text index (index_filename FFINDEX_BINARY_SUFFIX).
+ * It is only used as long as size, mtime and inode of the text index match the ones recorded when it was written.
+ */
+int ffindex_write_binary(ffindex_index_t* index, const char* index_filename);
+
+ffindex_index_t* ffindex_index_parse_binary(const char* index_filename);
+
+/* Hash index: O(1) lookups by name in sorted or unsorted indexes. Persisted next to the
+ * text index (index_filename FFINDEX_HASH_SUFFIX) and validated like the binary index.
+ * Dropped when the entries are sorted or unlinked.
+ */
+int ffindex_index_build_hash(ffindex_index_t* index);
+
+int ffindex_write_hash(ffindex_index_t* index, const char* index_filename);
+
+int ffindex_index_attach_hash(ffindex_index_t* index, const char* index_filename);
+
+void ffindex_index_drop_hash(ffindex_index_t* index);
+
+/* Blocked index: the sorted entries in page aligned blocks of about block_size bytes and the
+ * first name of each block, persisted next to the text index (index_filename FFINDEX_BLOCKS_SUFFIX)
+ * and validated like the binary index. The entries stay mmapped and only the summary is read,
+ * so a lookup searches the summary and touches one block.
+ */
+int ffindex_write_blocks(ffindex_index_t* index, const char* index_filename, size_t block_size);
+
+ffindex_index_t* ffindex_index_parse_blocks(const char* index_filename);
+
+ffindex_entry_t* ffindex_blocks_get_entry(ffindex_index_t* index, char* name);
+
+void ffindex_index_drop_blocks(ffindex_index_t* index);
+
+/* Search accelerator for sorted indexes: 8 byte keys of the names in a cache friendly
+ * layout (FFINDEX_SEARCH_EYTZINGER) or parallel to entries and searched without branches
+ * (FFINDEX_SEARCH_PREFIX), used by ffindex_bsearch_get_entry. Built in memory, dropped
+ * like the hash index.
+ */
+int ffindex_index_build_search(ffindex_index_t* index, enum ffindex_search_mode mode);
+
+void ffindex_index_drop_search(ffindex_index_t* index);
+
+ffindex_entry_t* ffindex_search_get_entry(ffindex_index_t* index, char* name);
+
+/* 8 bytes of name starting at offset as big-endian integer, zero-padded. Keys of
+ * names with the same first offset bytes order like strncmp on the names.
+ */
+uint64_t ffindex_name_key(const char* name, size_t offset);
+
+/* Numeric keys: for indexes whose names are all decimal integers without leading zeros
+ * (at most FFINDEX_NUMERIC_MAX_DIGITS digits), e.g. from ffindex_from_fasta. Lookups by
+ * name parse the name and search the integer values, independent of the order of entries.
+ */
+int ffindex_parse_numeric_name(const char* name, uint64_t* key);
+
+/* 1 if all names are numeric */
+int ffindex_index_numeric(ffindex_index_t* index);
+
+/* EXIT_FAILURE if not all names are numeric */
+int ffindex_index_build_numeric(ffindex_index_t* index);
+
+void ffindex_index_drop_numeric(ffindex_index_t* index);
+
+ffindex_entry_t* ffindex_numeric_get_entry(ffindex_index_t* index, char* name);
+
+/* Sorts by integer value ("2" before "10") with a radix sort and keeps the numeric keys.
+ * EXIT_FAILURE and unchanged entries if not all names are numeric.
+ */
+int ffindex_sort_index_file_numeric(ffindex_index_t* index);
+
+/* Uses the binary index if it is up to date, otherwise parses the text index.
+ * Attaches the hash index if it is up to date. Builds the search accelerator
+ * named by the environment variable FFINDEX_SEARCH (bsearch, eytzinger, prefix).
+ */
+ffindex_index_t* ffindex_index_load(FILE *index_file, const char* index_filename);
+
+/* For tools that look names up: without a hash index, builds numeric keys if all names
+ * are numeric, unless the environment variable FFINDEX_NUMERIC_KEYS is 0. Lookups by name
+ * never change the index, so they may run concurrently after this.
+ */
+void ffindex_index_prepare_lookups(ffindex_index_t* index);
+
+void ffindex_index_free(ffindex_index_t* index);
+
+/* An empty in-memory index with room for num_max_entries */
+ffindex_index_t* ffindex_index_new(size_t num_max_entries);
+
+/* Grow the entries array, entries of a binary index are copied into memory */
+int ffindex_index_reserve(ffindex_index_t* index, size_t num_max_entries);
+
+/* Appends an entry, growing the entries array geometrically. Invalidates pointers to entries. */
+ffindex_entry_t* ffindex_index_add_entry(ffindex_index_t* index, const char* name, size_t offset, size_t length);
+
 ffindex_entry_t* ffindex_bsearch_get_entry(ffindex_index_t *index, char *name);
 
+/* Looks up n_names names at once, entries[i] is the entry of names[i] or NULL if not found.
+ * Faster than one ffindex_get_entry_by_name per name for many names. With a hash, blocked
+ * or numeric index it looks up one name at a time through it.
+ */
+int ffindex_get_entries_by_names(ffindex_index_t* index, char** names, size_t n_names, ffindex_entry_t** entries);
+
+/* Looks up name by a binary search directly in the mmapped sorted text index, parsing only
+ * the lines it probes. Fills entry and returns it, or NULL if not found. For a few lookups
+ * in a large index, nothing has to be parsed or allocated up front.
+ */
+ffindex_entry_t* ffindex_lazy_get_entry(char* index_data, size_t index_data_size, const char* name, ffindex_entry_t* entry);
+
+/* Sorts by name with a radix sort in ffget_num_threads() threads, see ffsort_entries_by_name.
+ * If entries were appended to a sorted index, only the appended ones are sorted and merged in. */
 void ffindex_sort_index_file(ffindex_index_t *index);
 
+/* Radix sorts in ffsort.c. Names are compared like strncmp over FFINDEX_MAX_ENTRY_NAME_CHARS bytes. */
+
+/* Sorts (key, position) pairs by key */
+int ffsort_radix_keys(uint64_t* keys, size_t* positions, size_t n);
+
+/* positions[i] is the position in names of the i-th name in sorted order */
+int ffsort_names(char** names, size_t n, size_t* positions);
+
+/* Moves entries[positions[i]] to entries[i], positions may be overwritten */
+void ffsort_permute_entries(ffindex_entry_t* entries, size_t* positions, size_t n);
+
+/* With n_threads > 1 chunks are sorted concurrently and merged concurrently */
+int ffsort_entries_by_name(ffindex_entry_t* entries, size_t n, int n_threads);
+
+/* Number of entries at the start that are already sorted */
+size_t ffsort_sorted_prefix(ffindex_entry_t* entries, size_t n);
+
+/* Sorts entries[n_sorted..n) and merges them into the sorted entries[0..n_sorted),
+ * needs memory for n - n_sorted entries */
+int ffsort_merge_tail(ffindex_entry_t* entries, size_t n, size_t n_sorted, int n_threads);
+
 int ffindex_write(ffindex_index_t* index, FILE* index_file);
 
 ffindex_index_t* ffindex_unlink(ffindex_index_t* index, char *entry_name);
 
+/* Tree mode: the entries in a B+-tree (ffbtree.c) for many inserts and unlinks,
+ * written back in order by ffindex_write. The entries array is freed, so entries
+ * can not be accessed by index in tree mode.
+ */
 ffindex_index_t*  ffindex_index_as_tree(ffindex_index_t* index);
 
+ffindex_entry_t* ffindex_tree_get_entry(ffindex_index_t* index, char* name);
+
 ffindex_index_t* ffindex_tree_unlink(ffindex_index_t* index, char* name_to_unlink);
 
+/* Unlinks one entry per name in O(n + k log k): the names are sorted, merge joined with the
+ * entries and the kept entries compacted in one pass. Names may be unsorted. An index not
+ * sorted by name, e.g. in numeric order, keeps its order, each entry is looked up among the
+ * names in O(n log k).
+ * If unlinked is not NULL, it gets a malloced copy of the n_unlinked unlinked entries.
+ */
+int ffindex_unlink_names(ffindex_index_t* index, char** names, size_t n_names, ffindex_entry_t** unlinked, size_t* n_unlinked);
+
+/* Returns the disk space of the data of unlinked entries to the file system by punching
+ * holes into the data file, except for bytes entries left in index still refer to.
+ * Offsets do not change and no data is moved, the holes read as zeros.
+ * Sets punched to the number of bytes punched. Fails with EOPNOTSUPP where the
+ * platform or file system can not punch holes.
+ */
+int ffindex_punch_holes(int data_fd, ffindex_index_t* index, ffindex_entry_t* unlinked, size_t n_unlinked, size_t* punched);
+
 ffindex_index_t* ffindex_unlink_entries(ffindex_index_t* index, char** sorted_names_to_unlink, int n_names);
 
 int ffindex_tree_write(ffindex_index_t* index, FILE* index_file);
 
+/* B+-tree of entries ordered by name. Equal names are kept in insertion order,
+ * ffbtree_find and ffbtree_delete take the first one. Entry pointers are valid
+ * until the next insert or delete.
+ */
+typedef struct ffbtree ffbtree_t;
+
+typedef struct ffbtree_cursor {
+  void* leaf;
+  int position;
+} ffbtree_cursor_t;
+
+ffbtree_t* ffbtree_new(void);
+
+/* Builds the tree from entries sorted by name, faster than inserting them */
+ffbtree_t* ffbtree_from_sorted(ffindex_entry_t* entries, size_t n);
+
+void ffbtree_free(ffbtree_t* tree);
+
+size_t ffbtree_size(ffbtree_t* tree);
+
+int ffbtree_insert(ffbtree_t* tree, ffindex_entry_t* entry);
+
+ffindex_entry_t* ffbtree_find(ffbtree_t* tree, const char* name);
+
+/* Returns 1 if an entry was deleted, 0 if there was none named name */
+int ffbtree_delete(ffbtree_t* tree, const char* name);
+
+/* In-order iteration, ffbtree_cursor_next returns NULL after the last entry */
+void ffbtree_cursor_first(ffbtree_t* tree, ffbtree_cursor_t* cursor);
+
+ffindex_entry_t* ffbtree_cursor_next(ffbtree_cursor_t* cursor);
+
 int ffindex_insert_filestream(FILE *data_file, FILE *index_file, size_t *offset, FILE* file, char *name);
 
+ffindex_packed_index_t* ffindex_packed_index_parse(FILE *index_file);
+
+void ffindex_packed_index_free(ffindex_packed_index_t* index);
+
+const char* ffindex_packed_get_name(ffindex_packed_index_t* index, size_t entry_index, size_t* name_length);
+
+/* Returns the position of the entry or FFINDEX_PACKED_NOT_FOUND. Names are compared in full,
+ * a name longer than FFINDEX_MAX_ENTRY_NAME_CHARS also finds the entry of its cut part. */
+size_t ffindex_packed_bsearch(ffindex_packed_index_t* index, const char* name);
+
+/* 1 if sorted by name, as ffindex_packed_bsearch needs */
+int ffindex_packed_sorted(ffindex_packed_index_t* index);
+
+char* ffindex_packed_get_data_by_name(char* data, ffindex_packed_index_t* index, const char* name, size_t* length);
+
+int ffindex_packed_sort(ffindex_packed_index_t* index);
+
+/* The names point into the mmapped index, so do not write back into the same file directly */
+int ffindex_packed_write(ffindex_packed_index_t* index, FILE* index_file);
+
 void ffsort_index(const char* index_filename);
 
+/* Sorts the index file in place using about memory_size bytes: sorted runs of entries are
+ * spilled next to the index file and k-way merged. Names are truncated like by ffindex_index_parse.
+ */
+int ffsort_index_external(const char* index_filename, size_t memory_size);
+
 void ffmerge_splits(const char* data_filename, const char* index_filename,
                     int first_split_index, int last_split_index, int remove_temporary);
 
@@ -327,7 +327,7 @@ void ignore_signal(int signal) {
 
 void usage() {
     fprintf(stderr,
-            "USAGE: ffindex_apply_mpi [-q] [-k] "
+            "USAGE: ffindex_apply_mpi [-q] [-k] [-j THREADS] "
 #ifdef HAVE_MPI
                     "[-p PARTS] [-l LOG_FILENAME_PREFIX] "
 #endif
@@ -339,6 +339,7 @@ void usage() {
 #endif
                     "\t[-q]\t\t\tSilence the logging of every processed entry.\n"
                     "\t[-k]\t\t\tKeep unmerged ffindex splits.\n"
+                    "\t[-j THREADS]\t\tThreads for parsing the index (default: FFINDEX_THREADS or 1).\n"
                     "\t[-d DATA_FILENAME_OUT]\tFFindex data file where the results will be saved to.\n"
                     "\t[-i INDEX_FILENAME_OUT]\tFFindex index file where the results will be saved to.\n"
                     "\tDATA_FILENAME\t\tInput ffindex data file.\n"
@@ -405,6 +406,7 @@ int main(int argn, char **argv) {
                     {"index", required_argument, NULL, 'i'},
                     {"quiet", no_argument, NULL, 'q'},
                     {"keep-tmp", no_argument, NULL, 'k'},
+                    {"threads", required_argument, NULL, 'j'},
                     {NULL, 0, NULL, 0}
             };
 
@@ -412,9 +414,9 @@ int main(int argn, char **argv) {
     while (1) {
         int option_index = 0;
 #ifdef HAVE_MPI
-        const char *short_options = "kql:p:d:i:";
+        const char *short_options = "kqj:l:p:d:i:";
 #else
-        const char* short_options = "kqd:i:";
+        const char* short_options = "kqj:d:i:";
 #endif
         opt = getopt_long(argn, argv, short_options, long_options, &option_index);
 
@@ -442,6 +444,9 @@ int main(int argn, char **argv) {
             case 'k':
                 keepTmp = 1;
                 break;
+            case 'j':
+                ffset_num_threads(atoi(optarg));
+                break;
             default:
                 break;
         }
@@ -494,8 +499,7 @@ int main(int argn, char **argv) {
         goto cleanup_2;
     }
 
-    size_t entries = ffcount_lines(index_filename);
-    ffindex_index_t *index = ffindex_index_parse(index_file, entries);
+    ffindex_index_t *index = ffindex_index_load(index_file, index_filename);
     if (index == NULL) {
         fferror_print(__FILE__, __LINE__, "ffindex_index_parse", index_filename);
         exit_status = EXIT_FAILURE;
@@ -663,8 +667,7 @@ int main(int argn, char **argv) {
     }
 #endif
 
-    munmap(index->index_data, index->index_data_size);
-    free(index);
+    ffindex_index_free(index);
 
     cleanup_3:
     munmap(data, data_size);
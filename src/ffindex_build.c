@@ -17,6 +17,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -30,14 +31,25 @@
 
 void usage(char *program_name)
 {
-    fprintf(stderr, "USAGE: %s [-a|-v] [-s] [-f file]* OUT_DATA_FILE OUT_INDEX_FILE [-d 2ND_DATA_FILE -i 2ND_INDEX_FILE] [DIR_TO_INDEX|FILE]*\n"
+    fprintf(stderr, "USAGE: %s [-a|-v] [-s [-N]] [-b] [-B] [-H] [-j THREADS] [-U] [-O] [-r [-p]] [-f file]* OUT_DATA_FILE OUT_INDEX_FILE [-d 2ND_DATA_FILE -i 2ND_INDEX_FILE] [DIR_TO_INDEX|FILE]*\n"
                     "\t-a\t\tappend files/indexes, also needed for sorting an already existing ffindex\n"
+                    "\t-b\t\talso write a binary index OUT_INDEX_FILE%s for faster loading\n"
+                    "\t-B\t\talso write a blocked index OUT_INDEX_FILE%s for lookups in indexes larger than memory\n"
+                    "\t-H\t\talso write a hash index OUT_INDEX_FILE%s for faster lookups\n"
                     "\t-d FFDATA_FILE\ta second ffindex data file for inserting/appending\n"
                     "\t-i FFINDEX_FILE\ta second ffindex index file for inserting/appending\n"
                     "\t-f FILE\t\tfile containing a list of file names, one per line\n"
                     "\t\t\t-f can be specified up to %d times\n"
+                    "\t-j THREADS\tread input files, parse and sort with THREADS threads (default: FFINDEX_THREADS or 1),\n"
+                    "\t\t\tinput files are inserted in the order they are read, in the given order without -j and -U\n"
+                    "\t-N\t\twith -s, sort numeric names by value (\"2\" before \"10\")\n"
+                    "\t-O\t\twith -j or -U, insert input files in the given order, as with one thread\n"
+                    "\t-p\t\twith -r, name entries by their path below DIR_TO_INDEX instead of the file name\n"
+                    "\t-r\t\talso index the files in all subdirectories of DIR_TO_INDEX, walked with THREADS threads\n"
                     "\t-s\t\tsort index file, so that the index can queried.\n"
                     "\t\t\tAnother append operations can be done without sorting.\n"
+                    "\t-U\t\topen and read input files through io_uring, many at a time, where available,\n"
+                    "\t\t\telse with THREADS threads as with -j\n"
                     "\t-v\t\tprint version and other info then exit\n"
                     "\nEXAMPLES:\n"
                     "\tCreate a new ffindex containing all files from the \"bar/\" directory containing\n"
@@ -47,16 +59,26 @@ void usage(char *program_name)
                     "\t\t$ ffindex_build -a foo.ffdata foo.ffindex myfile3.txt myfile4.txt\n"
                     "\n\tOops, forgot to sort it (-s) so do it afterwards:\n"
                     "\t\t$ ffindex_build -as foo.ffdata foo.ffindex\n"
+                    "\n\tIndex a whole directory tree, entries named like \"sub/dir/myfile5.txt\".\n"
+                    "\t\t$ ffindex_build -j 8 -rp -s foo.ffdata foo.ffindex bar/\n"
                     "\nNOTE:\n"
-                    "\tMaximum key/filename length is %d and maximum entries are by default %d\n"
+                    "\tMaximum key/filename length is %d\n"
                     "\tThis can be changed in the sources.\n"
                     "\nDesigned and implemented by Andreas W. Hauser <hauser@genzentrum.lmu.de>.\n",
-                    program_name, MAX_FILENAME_LIST_FILES, FFINDEX_MAX_ENTRY_NAME_LENTH, FFINDEX_MAX_INDEX_ENTRIES_DEFAULT);
+                    program_name, FFINDEX_BINARY_SUFFIX, FFINDEX_BLOCKS_SUFFIX, FFINDEX_HASH_SUFFIX, MAX_FILENAME_LIST_FILES, FFINDEX_MAX_ENTRY_NAME_LENTH);
+}
+
+/* Exits with the entries inserted so far written, so that no index line points past the data */
+static int close_and_fail(ffindex_writer_t* writer)
+{
+  ffindex_writer_close(writer);
+  return EXIT_FAILURE;
 }
 
 int main(int argn, char** argv)
 {
-  int append = 0, sort = 0, version = 0;
+  int append = 0, sort = 0, numeric = 0, binary = 0, blocks = 0, hash = 0, version = 0, ordered = 0, threads_given = 0;
+  int recursive = 0, relative_names = 0, uring = 0;
   int err = EXIT_SUCCESS;
   char* list_filenames[MAX_FILENAME_LIST_FILES];
   char* list_ffindex_data[MAX_FILENAME_LIST_FILES];
@@ -68,10 +90,19 @@ int main(int argn, char** argv)
   static struct option long_options[] =
   {
     { "append",  no_argument, NULL, 'a' },
+    { "binary",  no_argument, NULL, 'b' },
+    { "blocks",  no_argument, NULL, 'B' },
     { "data",    required_argument, NULL, 'd' },
     { "index",   required_argument, NULL, 'i' },
     { "file",    required_argument, NULL, 'f' },
+    { "hash",    no_argument, NULL, 'H' },
+    { "threads", required_argument, NULL, 'j' },
+    { "numeric", no_argument, NULL, 'N' },
+    { "ordered", no_argument, NULL, 'O' },
+    { "path-names", no_argument, NULL, 'p' },
+    { "recursive", no_argument, NULL, 'r' },
     { "sort",    no_argument, NULL, 's' },
+    { "io-uring", no_argument, NULL, 'U' },
     { "version", no_argument, NULL, 'v' },
     { NULL,      0,           NULL,  0  }
   };
@@ -80,7 +111,7 @@ int main(int argn, char** argv)
   while (1)
   {
     int option_index = 0;
-    opt = getopt_long(argn, argv, "ad:i:f:sv", long_options, &option_index);
+    opt = getopt_long(argn, argv, "abBd:i:f:Hj:NOprsUv", long_options, &option_index);
     if (opt == -1)
       break;
 
@@ -89,6 +120,12 @@ int main(int argn, char** argv)
       case 'a':
         append = 1;
         break;
+      case 'b':
+        binary = 1;
+        break;
+      case 'B':
+        blocks = 1;
+        break;
       case 'd':
         list_ffindex_data[list_ffindex_data_index++] = optarg;
         break;
@@ -98,9 +135,31 @@ int main(int argn, char** argv)
       case 'f':
         list_filenames[list_filenames_index++] = optarg;
         break;
+      case 'H':
+        hash = 1;
+        break;
+      case 'j':
+        ffset_num_threads(atoi(optarg));
+        threads_given = 1;
+        break;
+      case 'N':
+        numeric = 1;
+        break;
+      case 'O':
+        ordered = 1;
+        break;
+      case 'p':
+        relative_names = 1;
+        break;
+      case 'r':
+        recursive = 1;
+        break;
       case 's':
         sort = 1;
         break;
+      case 'U':
+        uring = 1;
+        break;
       case 'v':
         version = 1;
         break;
@@ -131,61 +190,45 @@ int main(int argn, char** argv)
 
   char *data_filename  = argv[optind++];
   char *index_filename = argv[optind++];
-  FILE *data_file, *index_file;
-
-  size_t offset = 0;
+  FILE *index_file;
 
   /* open index and data file, seek to end if needed */
-  if(append)
-  {
-    data_file  = fopen(data_filename, "a");
-    if( data_file == NULL) { perror(data_filename); return EXIT_FAILURE; }
+  ffindex_writer_t* writer = ffindex_writer_open(data_filename, index_filename, append ? "a" : "w");
+  if(writer == NULL) { return EXIT_FAILURE; }
 
-    index_file = fopen(index_filename, "a+");
-    if(index_file == NULL) { perror(index_filename); return EXIT_FAILURE; }
 
-    struct stat sb;
-    fstat(fileno(data_file), &sb);
-    fseek(data_file, sb.st_size, SEEK_SET);
-    offset = sb.st_size;
+  /* Files are inserted in batches, read ahead by several threads with -j or through io_uring with -U */
+  int n_threads = ffget_num_threads();
+  /* FFINDEX_THREADS alone reads ahead in the given order, only -j or -U trade it for speed */
+  if(!threads_given && !uring)
+    ordered = 1;
+  ffindex_file_list_t files;
+  memset(&files, 0, sizeof(files));
 
-    fstat(fileno(index_file), &sb);
-    fseek(index_file, sb.st_size, SEEK_SET);
+  /* For each list_file insert */
+  for(int i = 0; i < list_filenames_index; i++)
+  {
+    FILE *list_file = fopen(list_filenames[i], "r");
+    if( list_file == NULL) { perror(list_filenames[i]); return close_and_fail(writer); }
+    if(ffindex_file_list_add_list_file(&files, list_file) != EXIT_SUCCESS)
+      return close_and_fail(writer);
+    fclose(list_file);
   }
-  else
+  if((uring ? ffindex_writer_insert_files_uring(writer, &files, n_threads, ordered)
+             : ffindex_writer_insert_files(writer, &files, n_threads, ordered)) != EXIT_SUCCESS)
   {
-    struct stat st;
-
-    if(stat(data_filename, &st) == 0) { errno = EEXIST; perror(data_filename); return EXIT_FAILURE; }
-    data_file  = fopen(data_filename, "w");
-    if( data_file == NULL) { perror(data_filename); return EXIT_FAILURE; }
-
-    if(stat(index_filename, &st) == 0) { errno = EEXIST; perror(index_filename); return EXIT_FAILURE; }
-    index_file = fopen(index_filename, "w+");
-    if(index_file == NULL) { perror(index_filename); return EXIT_FAILURE; }
+    fprintf(stderr, "%s: not all files could be inserted\n", argv[0]);
+    err = -1;
   }
-
-
-  /* For each list_file insert */
-  if(list_filenames_index > 0)
-    for(int i = 0; i < list_filenames_index; i++)
-    {
-      FILE *list_file = fopen(list_filenames[i], "r");
-      if( list_file == NULL) { perror(list_filenames[i]); return EXIT_FAILURE; }
-      if(ffindex_insert_list_file(data_file, index_file, &offset, list_file) < 0)
-      {
-        perror(list_filenames[i]);
-        err = -1;
-      }
-    }
+  ffindex_file_list_free(&files);
 
   /* Append other ffindexes */
   if(list_ffindex_data_index > 0)
   {
     for(int i = 0; i < list_ffindex_data_index; i++)
     {
-      FILE* data_file_to_add  = fopen(list_ffindex_data[i], "r");  if(  data_file_to_add == NULL) { perror(list_ffindex_data[i]); return EXIT_FAILURE; }
-      FILE* index_file_to_add = fopen(list_ffindex_index[i], "r"); if( index_file_to_add == NULL) { perror(list_ffindex_index[i]); return EXIT_FAILURE; }
+      FILE* data_file_to_add  = fopen(list_ffindex_data[i], "r");  if(  data_file_to_add == NULL) { perror(list_ffindex_data[i]); return close_and_fail(writer); }
+      FILE* index_file_to_add = fopen(list_ffindex_index[i], "r"); if( index_file_to_add == NULL) { perror(list_ffindex_index[i]); return close_and_fail(writer); }
 
       // ignore empty files
       struct stat sb;
@@ -200,12 +243,11 @@ int main(int argn, char** argv)
       size_t data_size;
       char *data_to_add = ffindex_mmap_data(data_file_to_add, &data_size);
 
-      size_t entries = ffcount_lines(list_ffindex_index[i]);
-      ffindex_index_t* index_to_add = ffindex_index_parse(index_file_to_add, entries);
-      for(size_t entry_i = 0; entry_i < index_to_add->n_entries; entry_i++)
+      ffindex_index_t* index_to_add = ffindex_index_load(index_file_to_add, list_ffindex_index[i]);
+      if(index_to_add == NULL || ffindex_writer_insert_ffindex(writer, data_to_add, index_to_add) != EXIT_SUCCESS)
       {
-        ffindex_entry_t *entry = ffindex_get_entry_by_index(index_to_add, entry_i);
-        ffindex_insert_memory(data_file, index_file, &offset, ffindex_get_data_by_entry(data_to_add, entry), entry->length - 1, entry->name); // skip \0 suffix
+        fferror_print(__FILE__, __LINE__, __func__, list_ffindex_index[i]);
+        return close_and_fail(writer);
       }
     }
   }
@@ -224,33 +266,61 @@ int main(int argn, char** argv)
 
     if(S_ISDIR(sb.st_mode))
     {
-      err = ffindex_insert_dir(data_file, index_file, &offset, path);
-      if(err < 0)fferror_print(__FILE__, __LINE__, __func__, path);
+      if(ffindex_file_list_add_tree(&files, path, recursive, relative_names, n_threads) != EXIT_SUCCESS)
+      {
+        fferror_print(__FILE__, __LINE__, __func__, path);
+        err = -1;
+      }
     }
     else if(S_ISREG(sb.st_mode))
     {
-      ffindex_insert_file(data_file, index_file, &offset, path, path);
+      if(ffindex_file_list_add(&files, path, path) != EXIT_SUCCESS)
+        return close_and_fail(writer);
     }
   }
-  fclose(data_file);
+  if((uring ? ffindex_writer_insert_files_uring(writer, &files, n_threads, ordered)
+             : ffindex_writer_insert_files(writer, &files, n_threads, ordered)) != EXIT_SUCCESS)
+  {
+    fprintf(stderr, "%s: not all files could be inserted\n", argv[0]);
+    err = -1;
+  }
+  ffindex_file_list_free(&files);
+  if(ffindex_writer_close(writer) != EXIT_SUCCESS)
+    return EXIT_FAILURE;
 
   /* Sort the index entries and write back */
-  if(sort)
+  if(sort || binary || blocks || hash)
   {
-    fclose(index_file);
-    size_t entries = ffcount_lines(index_filename);
     index_file = fopen(index_filename, "r+");
-    ffindex_index_t* index = ffindex_index_parse(index_file, entries);
+    ffindex_index_t* index = ffindex_index_parse(index_file, 0);
     if(index == NULL)
     {
       fferror_print(__FILE__, __LINE__, __func__, index_filename);
       exit(EXIT_FAILURE);
     }
     fclose(index_file);
-    ffindex_sort_index_file(index);
-    index_file = fopen(index_filename, "w");
-    if(index_file == NULL) { perror(index_filename); return EXIT_FAILURE; }
-    err += ffindex_write(index, index_file);
+    if(sort)
+    {
+      if(!numeric)
+        ffindex_sort_index_file(index);
+      else if(ffindex_sort_index_file_numeric(index) != EXIT_SUCCESS)
+      {
+        fprintf(stderr, "%s: not all names in %s are numeric\n", argv[0], index_filename);
+        return EXIT_FAILURE;
+      }
+      index_file = fopen(index_filename, "w");
+      if(index_file == NULL) { perror(index_filename); return EXIT_FAILURE; }
+      err += ffindex_write(index, index_file);
+      fclose(index_file);
+    }
+
+    /* Written last, they record size, mtime and inode of the final text index */
+    if(binary)
+      err += ffindex_write_binary(index, index_filename);
+    if(blocks)
+      err += ffindex_write_blocks(index, index_filename, FFINDEX_BLOCK_SIZE_DEFAULT);
+    if(hash)
+      err += ffindex_write_hash(index, index_filename);
   }
 
   return err;
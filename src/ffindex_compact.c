@@ -0,0 +1,272 @@
+/*
+ * Ffindex
+ * written by Andy Hauser <hauser@genzentrum.lmu.de>.
+ * Please add your name here if you distribute modified versions.
+ *
+ * Ffindex is provided under the Create Commons license "Attribution-ShareAlike
+ * 3.0", which basically captures the spirit of the Gnu Public License (GPL).
+ *
+ * See:
+ * http://creativecommons.org/licenses/by-sa/3.0/
+ *
+ * ffindex_compact
+ * Rewrites a data file without the bytes no index entry refers to anymore, e.g. after
+ * ffindex_modify -u, and writes the index with the new offsets. Entries that are
+ * adjacent in the old data file are copied as one range, entries sharing data keep
+ * sharing one copy of it.
+*/
+
+#define _GNU_SOURCE 1
+#define _LARGEFILE64_SOURCE 1
+#define _FILE_OFFSET_BITS 64
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <getopt.h>
+
+#include "ffindex.h"
+#include "ffutil.h"
+
+void usage(char *program_name)
+{
+    fprintf(stderr, "USAGE: %s [-O] [-b] [-H] [-j THREADS] DATA_FILENAME INDEX_FILENAME [OUT_DATA_FILENAME OUT_INDEX_FILENAME]\n"
+                    "\t-O\t\tkeep the order of the data file (offset order) instead of the index order\n"
+                    "\t-b\t\talso write a binary index OUT_INDEX_FILENAME%s\n"
+                    "\t-H\t\talso write a hash index OUT_INDEX_FILENAME%s\n"
+                    "\t-j THREADS\tparse and sort with THREADS threads (default: FFINDEX_THREADS or 1)\n"
+                    "\tWithout OUT_DATA_FILENAME and OUT_INDEX_FILENAME the files are compacted in place.\n"
+                    "\nDesigned and implemented by Andreas W. Hauser <hauser@genzentrum.lmu.de>.\n",
+                    program_name, FFINDEX_BINARY_SUFFIX, FFINDEX_HASH_SUFFIX);
+}
+
+/* A range of the old data file that entries refer to, overlapping ranges are merged */
+typedef struct compact_block {
+  size_t offset;
+  size_t length;
+  size_t new_offset;
+  int copied;
+} compact_block_t;
+
+/* Merges the ranges of the entries, visited in offset order, into blocks and sets
+ * block[i] to the block of entry i. Returns the number of blocks.
+ */
+static size_t find_blocks(ffindex_index_t* index, size_t* by_offset, size_t* block, compact_block_t* blocks)
+{
+  size_t n_blocks = 0;
+  for(size_t i = 0; i < index->n_entries; i++)
+  {
+    ffindex_entry_t* entry = &index->entries[by_offset[i]];
+    compact_block_t* last = n_blocks > 0 ? &blocks[n_blocks - 1] : NULL;
+    if(last != NULL && entry->offset < last->offset + last->length)
+    {
+      if(entry->offset + entry->length > last->offset + last->length)
+        last->length = entry->offset + entry->length - last->offset;
+    }
+    else
+    {
+      last = &blocks[n_blocks++];
+      last->offset = entry->offset;
+      last->length = entry->length;
+      last->copied = 0;
+    }
+    block[by_offset[i]] = last - blocks;
+  }
+  return n_blocks;
+}
+
+/* Copies each block once, in offset order or in the index order of the first entry in it,
+ * and sets the new offsets of the entries. Blocks that follow each other in the old data
+ * file are copied with one ffcopy_range.
+ */
+static int compact(ffindex_index_t* index, size_t* block, compact_block_t* blocks, size_t n_blocks, int offset_order,
+                   int data_fd, int out_fd, size_t* out_size)
+{
+  size_t run_offset = 0, run_length = 0, out_offset = 0;
+  size_t n = offset_order ? n_blocks : index->n_entries;
+  for(size_t i = 0; i < n; i++)
+  {
+    compact_block_t* b = &blocks[offset_order ? i : block[i]];
+    if(b->copied)
+      continue;
+
+    if(run_length > 0 && b->offset != run_offset + run_length)
+    {
+      if(ffcopy_range(data_fd, run_offset, out_fd, run_length) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+      run_length = 0;
+    }
+    if(run_length == 0)
+      run_offset = b->offset;
+    run_length += b->length;
+
+    b->new_offset = out_offset;
+    b->copied = 1;
+    out_offset += b->length;
+  }
+  if(run_length > 0 && ffcopy_range(data_fd, run_offset, out_fd, run_length) != EXIT_SUCCESS)
+    return EXIT_FAILURE;
+
+  for(size_t i = 0; i < index->n_entries; i++)
+  {
+    compact_block_t* b = &blocks[block[i]];
+    index->entries[i].offset = b->new_offset + (index->entries[i].offset - b->offset);
+  }
+  *out_size = out_offset;
+  return EXIT_SUCCESS;
+}
+
+int main(int argn, char **argv)
+{
+  int offset_order = 0, binary = 0, hash = 0;
+
+  static struct option long_options[] =
+  {
+    { "offset-order", no_argument, NULL, 'O' },
+    { "binary",       no_argument, NULL, 'b' },
+    { "hash",         no_argument, NULL, 'H' },
+    { "threads",      required_argument, NULL, 'j' },
+    { NULL,           0,           NULL,  0  }
+  };
+
+  int opt;
+  while (1)
+  {
+    int option_index = 0;
+    opt = getopt_long(argn, argv, "ObHj:", long_options, &option_index);
+    if (opt == -1)
+      break;
+
+    switch (opt)
+    {
+      case 'O':
+        offset_order = 1;
+        break;
+      case 'b':
+        binary = 1;
+        break;
+      case 'H':
+        hash = 1;
+        break;
+      case 'j':
+        ffset_num_threads(atoi(optarg));
+        break;
+      default:
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+
+  if(argn - optind != 2 && argn - optind != 4)
+  {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  char *data_filename  = argv[optind];
+  char *index_filename = argv[optind + 1];
+  int in_place = argn - optind == 2;
+
+  /* In place, the new files are renamed over the old ones at the end */
+  char out_data_filename[FILENAME_MAX], out_index_filename[FILENAME_MAX];
+  if(in_place)
+  {
+    snprintf(out_data_filename, FILENAME_MAX, "%s.%d", data_filename, (int)getpid());
+    snprintf(out_index_filename, FILENAME_MAX, "%s.%d", index_filename, (int)getpid());
+  }
+  else
+  {
+    snprintf(out_data_filename, FILENAME_MAX, "%s", argv[optind + 2]);
+    snprintf(out_index_filename, FILENAME_MAX, "%s", argv[optind + 3]);
+  }
+
+  int data_fd = open(data_filename, O_RDONLY);
+  if(data_fd < 0) { fferror_print(__FILE__, __LINE__, argv[0], data_filename); return EXIT_FAILURE; }
+  struct stat sb;
+  if(fstat(data_fd, &sb) == -1) { fferror_print(__FILE__, __LINE__, argv[0], data_filename); return EXIT_FAILURE; }
+  size_t data_size = sb.st_size;
+
+  FILE *index_file = fopen(index_filename, "r");
+  if(index_file == NULL) { fferror_print(__FILE__, __LINE__, argv[0], index_filename); return EXIT_FAILURE; }
+  ffindex_index_t* index = ffindex_index_load(index_file, index_filename);
+  if(index == NULL) { fferror_print(__FILE__, __LINE__, "ffindex_index_load", index_filename); return EXIT_FAILURE; }
+  fclose(index_file);
+
+  for(size_t i = 0; i < index->n_entries; i++)
+    if(index->entries[i].offset + index->entries[i].length > data_size)
+    {
+      fprintf(stderr, "%s: entry '%s' is beyond the end of %s\n", argv[0], index->entries[i].name, data_filename);
+      return EXIT_FAILURE;
+    }
+
+  /* Entries that share data, fully or in part, keep sharing one copy of it */
+  size_t n_entries = index->n_entries;
+  size_t* by_offset = (size_t*)malloc(sizeof(size_t) * (n_entries + 1));
+  size_t* block = (size_t*)malloc(sizeof(size_t) * (n_entries + 1));
+  uint64_t* keys = (uint64_t*)malloc(sizeof(uint64_t) * (n_entries + 1));
+  compact_block_t* blocks = (compact_block_t*)malloc(sizeof(compact_block_t) * (n_entries + 1));
+  if(by_offset == NULL || block == NULL || keys == NULL || blocks == NULL) { fferror_print(__FILE__, __LINE__, argv[0], "malloc failed"); return EXIT_FAILURE; }
+  for(size_t i = 0; i < n_entries; i++)
+  {
+    by_offset[i] = i;
+    keys[i] = index->entries[i].offset;
+  }
+  if(ffsort_radix_keys(keys, by_offset, n_entries) != EXIT_SUCCESS)
+    return EXIT_FAILURE;
+  free(keys);
+  size_t n_blocks = find_blocks(index, by_offset, block, blocks);
+  free(by_offset);
+
+  int out_fd = open(out_data_filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if(out_fd < 0) { fferror_print(__FILE__, __LINE__, argv[0], out_data_filename); return EXIT_FAILURE; }
+
+  size_t out_size = 0;
+  if(compact(index, block, blocks, n_blocks, offset_order, data_fd, out_fd, &out_size) != EXIT_SUCCESS
+     || fsync(out_fd) != 0 || close(out_fd) != 0)
+  {
+    fferror_print(__FILE__, __LINE__, argv[0], out_data_filename);
+    unlink(out_data_filename);
+    return EXIT_FAILURE;
+  }
+  close(data_fd);
+  free(block);
+  free(blocks);
+
+  FILE *out_index_file = fopen(out_index_filename, "w");
+  if(out_index_file == NULL) { fferror_print(__FILE__, __LINE__, argv[0], out_index_filename); return EXIT_FAILURE; }
+  if(ffindex_write(index, out_index_file) != EXIT_SUCCESS || fflush(out_index_file) != 0
+     || fsync(fileno(out_index_file)) != 0 || fclose(out_index_file) != 0)
+  {
+    fferror_print(__FILE__, __LINE__, argv[0], out_index_filename);
+    return EXIT_FAILURE;
+  }
+
+  /* Both files are on disk before either replaces the old one. Readers that opened the old
+   * files keep them, new readers may still see the new data with the old index in between.
+   */
+  if(in_place)
+  {
+    if(rename(out_data_filename, data_filename) == -1) { fferror_print(__FILE__, __LINE__, argv[0], data_filename); return EXIT_FAILURE; }
+    if(rename(out_index_filename, index_filename) == -1) { fferror_print(__FILE__, __LINE__, argv[0], index_filename); return EXIT_FAILURE; }
+  }
+
+  /* Written last, they record size and mtime of the final text index */
+  char* final_index_filename = in_place ? index_filename : out_index_filename;
+  int err = EXIT_SUCCESS;
+  if(binary)
+    err += ffindex_write_binary(index, final_index_filename);
+  if(hash)
+    err += ffindex_write_hash(index, final_index_filename);
+
+  printf("%zu entries, %zu bytes of data before, %zu after, %lld bytes reclaimed\n",
+         index->n_entries, data_size, out_size, (long long)data_size - (long long)out_size);
+  return err;
+}
+
+/* vim: ts=2 sw=2 et
+*/
@@ -33,17 +33,21 @@
 
 void usage(char *program_name)
 {
-    fprintf(stderr, "USAGE: %s -v | [-s] data_filename index_filename fasta_filename\n"
+    fprintf(stderr, "USAGE: %s -v | [-s [-N]] [-j THREADS] data_filename index_filename fasta_filename\n"
+                    "\t-j N\tsort with N threads (default: FFINDEX_THREADS or 1)\n"
+                    "\t-N\tsort by the numeric entry names (\"2\" before \"10\")\n"
                     "\t-s\tsort index file\n"
                     "\nBases on a Design and Implementation of Andreas W. Hauser <hauser@genzentrum.lmu.de>.\n", program_name);
 }
 
 int main(int argn, char **argv)
 {
-  int sort = 0, version = 0;
+  int sort = 0, numeric = 0, version = 0;
   int err = EXIT_SUCCESS;
   static struct option long_options[] =
   {
+    { "threads", required_argument, NULL, 'j' },
+    { "numeric", no_argument, NULL, 'N' },
     { "sort",    no_argument, NULL, 's' },
     { "version", no_argument, NULL, 'v' },
     { NULL,      0,           NULL,  0  }
@@ -53,12 +57,18 @@ int main(int argn, char **argv)
   while (1)
   {
     int option_index = 0;
-    opt = getopt_long(argn, argv, "sv", long_options, &option_index);
+    opt = getopt_long(argn, argv, "j:Nsv", long_options, &option_index);
     if (opt == -1)
       break;
 
     switch (opt)
     {
+      case 'j':
+        ffset_num_threads(atoi(optarg));
+        break;
+      case 'N':
+        numeric = 1;
+        break;
       case 's':
         sort = 1;
         break;
@@ -95,19 +105,11 @@ int main(int argn, char **argv)
   printf("fasta file: %s\n", fasta_filename);
 
 
-  FILE *data_file, *index_file, *fasta_file;
-  size_t offset = 0;
+  FILE *index_file, *fasta_file;
 
   //open output ffindex
-  struct stat st;
-
-  if(stat(data_filename, &st) == 0) { errno = EEXIST; perror(data_filename); return EXIT_FAILURE; }
-  data_file  = fopen(data_filename, "w");
-  if( data_file == NULL) { perror(data_filename); return EXIT_FAILURE; }
-
-  if(stat(index_filename, &st) == 0) { errno = EEXIST; perror(index_filename); return EXIT_FAILURE; }
-  index_file = fopen(index_filename, "w+");
-  if(index_file == NULL) { perror(index_filename); return EXIT_FAILURE; }
+  ffindex_writer_t* writer = ffindex_writer_open(data_filename, index_filename, "w");
+  if(writer == NULL) { return EXIT_FAILURE; }
 
 
   fasta_file = fopen(fasta_filename, "r");
@@ -158,25 +160,30 @@ int main(int argn, char **argv)
     }
     seq_id++;
 
-    ffindex_insert_memory(data_file, index_file, &offset, entry, entry_length, name);
+    if(ffindex_writer_insert_memory(writer, entry, entry_length, name) != EXIT_SUCCESS)
+      return EXIT_FAILURE;
   }
-  fclose(data_file);
+  if(ffindex_writer_close(writer) != EXIT_SUCCESS)
+    return EXIT_FAILURE;
 
   /* Sort the index entries and write back */
   if(sort)
   {
-    fclose(index_file);
-
-    size_t entries = ffcount_lines(index_filename);
     index_file = fopen(index_filename, "r+");
-    ffindex_index_t* index = ffindex_index_parse(index_file, entries);
+    ffindex_index_t* index = ffindex_index_parse(index_file, 0);
     if(index == NULL)
     {
       perror("ffindex_index_parse failed");
       exit(EXIT_FAILURE);
     }
     fclose(index_file);
-    ffindex_sort_index_file(index);
+    if(!numeric)
+      ffindex_sort_index_file(index);
+    else if(ffindex_sort_index_file_numeric(index) != EXIT_SUCCESS)
+    {
+      fprintf(stderr, "%s: not all names in %s are numeric\n", argv[0], index_filename);
+      return EXIT_FAILURE;
+    }
     index_file = fopen(index_filename, "w");
     if(index_file == NULL) { perror(index_filename); return EXIT_FAILURE; }
     err += ffindex_write(index, index_file);
@@ -122,29 +122,15 @@ int main(int argn, char **argv)
   printf("fasta file: %s\n", fasta_filename);
 
 
-  FILE *data_header_file, *index_header_file, *data_sequence_file, *index_sequence_file, *fasta_file;
-  size_t header_offset = 0;
-  size_t sequence_offset = 0;
-
-  struct stat st;
+  FILE *fasta_file;
 
   // open header ffindex
-  if(stat(data_header_filename, &st) == 0) { errno = EEXIST; perror(data_header_filename); return EXIT_FAILURE; }
-  data_header_file  = fopen(data_header_filename, "w");
-  if( data_header_file == NULL) { perror(data_header_filename); return EXIT_FAILURE; }
-
-  if(stat(index_header_filename, &st) == 0) { errno = EEXIST; perror(index_header_filename); return EXIT_FAILURE; }
-  index_header_file = fopen(index_header_filename, "w+");
-  if(index_header_file == NULL) { perror(index_header_filename); return EXIT_FAILURE; }
+  ffindex_writer_t* header_writer = ffindex_writer_open(data_header_filename, index_header_filename, "w");
+  if(header_writer == NULL) { return EXIT_FAILURE; }
 
   //open sequence ffindex
-  if(stat(data_sequence_filename, &st) == 0) { errno = EEXIST; perror(data_sequence_filename); return EXIT_FAILURE; }
-  data_sequence_file  = fopen(data_sequence_filename, "w");
-  if( data_sequence_file == NULL) { perror(data_sequence_filename); return EXIT_FAILURE; }
-
-  if(stat(index_sequence_filename, &st) == 0) { errno = EEXIST; perror(index_sequence_filename); return EXIT_FAILURE; }
-  index_sequence_file = fopen(index_sequence_filename, "w+");
-  if(index_sequence_file == NULL) { perror(index_sequence_filename); return EXIT_FAILURE; }
+  ffindex_writer_t* sequence_writer = ffindex_writer_open(data_sequence_filename, index_sequence_filename, "w");
+  if(sequence_writer == NULL) { return EXIT_FAILURE; }
 
   fasta_file = fopen(fasta_filename, "r");
   if(fasta_file == NULL) { perror(fasta_filename); return EXIT_FAILURE; }
@@ -215,14 +201,12 @@ int main(int argn, char **argv)
 
     get_short_id(name, '|', 2);
 
-    ffindex_insert_memory(data_header_file, index_header_file, &header_offset, header, header_length, name);
-    ffindex_insert_memory(data_sequence_file, index_sequence_file, &sequence_offset, sequence, sequence_length, name);
+    if(ffindex_writer_insert_memory(header_writer, header, header_length, name) != EXIT_SUCCESS
+       || ffindex_writer_insert_memory(sequence_writer, sequence, sequence_length, name) != EXIT_SUCCESS)
+      return EXIT_FAILURE;
   }
-  fclose(data_header_file);
-  fclose(data_sequence_file);
-
-  fclose(index_header_file);
-  fclose(index_sequence_file);
+  if(ffindex_writer_close(header_writer) != EXIT_SUCCESS || ffindex_writer_close(sequence_writer) != EXIT_SUCCESS)
+    return EXIT_FAILURE;
 
   /* Sort the index entries and write back */
   if(sort) {
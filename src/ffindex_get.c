@@ -14,6 +14,8 @@
 #define _LARGEFILE64_SOURCE 1
 #define _FILE_OFFSET_BITS 64
 
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -23,20 +25,82 @@
 #include "ffindex.h"
 #include "ffutil.h"
 
+/* Lazy lookups pay off up to about one name per this many bytes of index */
+#define LAZY_MIN_BYTES_PER_NAME 1024
+
 void usage(char* program_name)
 {
     fprintf(stderr, "USAGE: %s data_filename index_filename entry name(s)\n"
                     "-n\tuse index of entry instead of entry name\n"
+                    "-c\tuse the packed index: less memory and no name length limit\n"
                     "\nDesigned and implemented by Andy Hauser <hauser@genzentrum.lmu.de>.\n",
                     program_name);
 }
 
+/* A binary, blocked or hash index next to the text index makes loading it cheap */
+static int has_sidecar(const char* index_filename)
+{
+  const char* suffixes[] = { FFINDEX_BINARY_SUFFIX, FFINDEX_BLOCKS_SUFFIX, FFINDEX_HASH_SUFFIX };
+  char sidecar_filename[FILENAME_MAX];
+  struct stat sb;
+  for(size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++)
+  {
+    snprintf(sidecar_filename, FILENAME_MAX, "%s%s", index_filename, suffixes[i]);
+    if(stat(sidecar_filename, &sb) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+/* Look the names up in the packed index, sorting it in memory first if the file is not sorted */
+static int get_packed(char* data, FILE* index_file, char* index_filename, int by_index, char** names, size_t n_names)
+{
+  ffindex_packed_index_t* index = ffindex_packed_index_parse(index_file);
+  if(index == NULL)
+  {
+    fferror_print(__FILE__, __LINE__, "ffindex_packed_index_parse", index_filename);
+    return EXIT_FAILURE;
+  }
+  if(!by_index && !ffindex_packed_sorted(index) && ffindex_packed_sort(index) != EXIT_SUCCESS)
+  {
+    ffindex_packed_index_free(index);
+    return EXIT_FAILURE;
+  }
+
+  for(size_t i = 0; i < n_names; i++)
+  {
+    size_t entry_index;
+    if(by_index)
+    {
+      entry_index = atol(names[i]) - 1; // offset from 0 but specify from 1
+      if(entry_index >= index->n_entries)
+        entry_index = FFINDEX_PACKED_NOT_FOUND;
+    }
+    else
+      entry_index = ffindex_packed_bsearch(index, names[i]);
+
+    char *filedata = entry_index == FFINDEX_PACKED_NOT_FOUND ? NULL : ffindex_get_data_by_offset(data, index->offsets[entry_index]);
+    if(filedata == NULL)
+    {
+      errno = ENOENT;
+      fferror_print(__FILE__, __LINE__, by_index ? "ffindex_get entry index out of range" : "ffindex_get key not found in index", names[i]);
+    }
+    else
+      fwrite(filedata, index->lengths[entry_index] - 1, 1, stdout);
+  }
+
+  ffindex_packed_index_free(index);
+  return EXIT_SUCCESS;
+}
+
 int main(int argn, char **argv)
 {
   int by_index = 0;
+  int packed = 0;
   static struct option long_options[] =
   {
     { "byindex", no_argument, NULL, 'n' },
+    { "packed",  no_argument, NULL, 'c' },
     { NULL,      0,           NULL,  0  }
   };
 
@@ -44,7 +108,7 @@ int main(int argn, char **argv)
   while (1)
   {
     int option_index = 0;
-    opt = getopt_long(argn, argv, "n", long_options, &option_index);
+    opt = getopt_long(argn, argv, "nc", long_options, &option_index);
     if (opt == -1)
       break;
 
@@ -53,6 +117,9 @@ int main(int argn, char **argv)
       case 'n':
         by_index = 1;
         break;
+      case 'c':
+        packed = 1;
+        break;
       default:
         usage(argv[0]);
         return EXIT_FAILURE;
@@ -76,12 +143,36 @@ int main(int argn, char **argv)
   size_t data_size;
   char *data = ffindex_mmap_data(data_file, &data_size);
 
-  size_t entries = ffcount_lines(index_filename);
-  ffindex_index_t* index = ffindex_index_parse(index_file, entries);
-  if(index == NULL)
+  if(packed)
+    return get_packed(data, index_file, index_filename, by_index, argv + optind, argn - optind);
+
+  /* Without sidecars, look a few names up directly in the mmapped text index instead of parsing
+   * all of it. Each lookup probes about log2(size) lines, so many names are faster in bulk. */
+  struct stat sb;
+  int lazy = !by_index && !has_sidecar(index_filename) && fstat(fileno(index_file), &sb) == 0
+             && (size_t)(argn - optind) < (size_t)sb.st_size / LAZY_MIN_BYTES_PER_NAME;
+  ffindex_index_t* index = NULL;
+  char* index_data = NULL;
+  size_t index_data_size = 0;
+  if(lazy)
+  {
+    index_data = ffindex_mmap_data(index_file, &index_data_size);
+    if(index_data == MAP_FAILED && index_data_size > 0)
+    {
+      fferror_print(__FILE__, __LINE__, "ffindex_mmap_data", index_filename);
+      exit(EXIT_FAILURE);
+    }
+  }
+  else
   {
-    fferror_print(__FILE__, __LINE__, "ffindex_index_parse", index_filename);
-    exit(EXIT_FAILURE);
+    index = ffindex_index_load(index_file, index_filename);
+    if(index == NULL)
+    {
+      fferror_print(__FILE__, __LINE__, "ffindex_index_parse", index_filename);
+      exit(EXIT_FAILURE);
+    }
+    if(!by_index)
+      ffindex_index_prepare_lookups(index);
   }
 
   if(by_index)
@@ -111,11 +202,27 @@ int main(int argn, char **argv)
   }
   else // by name
   {
+    size_t n_names = argn - optind;
+    ffindex_entry_t** entries = (ffindex_entry_t**)malloc(sizeof(ffindex_entry_t*) * n_names);
+    ffindex_entry_t* lazy_entries = lazy ? (ffindex_entry_t*)malloc(sizeof(ffindex_entry_t) * n_names) : NULL;
+    if((entries == NULL || (lazy && lazy_entries == NULL)) && n_names > 0)
+    {
+      fferror_print(__FILE__, __LINE__, "ffindex_get", "malloc failed");
+      exit(EXIT_FAILURE);
+    }
+    if(lazy)
+    {
+      for(size_t i = 0; i < n_names; i++)
+        entries[i] = ffindex_lazy_get_entry(index_data, index_data_size, argv[optind + i], &lazy_entries[i]);
+    }
+    else if(ffindex_get_entries_by_names(index, argv + optind, n_names, entries) != EXIT_SUCCESS)
+      exit(EXIT_FAILURE);
+
     for(int i = optind; i < argn; i++)
     {
       char *filename = argv[i];
 
-      ffindex_entry_t* entry = ffindex_get_entry_by_name(index, filename);
+      ffindex_entry_t* entry = entries[i - optind];
       if(entry == NULL)
       {
         errno = ENOENT; 
@@ -133,6 +240,8 @@ int main(int argn, char **argv)
           fwrite(filedata, entry->length - 1, 1, stdout);
       }
     }
+    free(entries);
+    free(lazy_entries);
 
       /* Alternative code using (slower) ffindex_fopen */
       /*
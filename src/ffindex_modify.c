@@ -16,6 +16,7 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -30,26 +31,128 @@
 
 void usage(char *program_name)
 {
-    fprintf(stderr, "USAGE: %s [-s|-u|-v] [-t] [-f file]* index_filename [filename]*\n"
+    fprintf(stderr, "USAGE: %s [-s [-M SIZE]|-u [-p DATA]|-v] [-t] [-b] [-B] [-H] [-c] [-j THREADS] [-f file]* index_filename [filename]*\n"
+                    "\t-b\talso write a binary index index_filename%s for faster loading\n"
+                    "\t-B\talso write a blocked index index_filename%s for lookups in indexes larger than memory\n"
+                    "\t-H\talso write a hash index index_filename%s for faster lookups\n"
+                    "\t-c\tuse the packed index: less memory and no name length limit, not with -u\n"
                     "\t-f file\tfile each line containing a filename\n"
+                    "\t-j N\tparse and sort with N threads (default: FFINDEX_THREADS or 1)\n"
                     "\t\t-f can be specified up to %d times\n"
+                    "\t-p DATA\twith -u, punch holes into data file DATA where only unlinked entries had data,\n"
+                    "\t\treturning the space to the file system without moving data, not with -t\n"
+                    "\t-M SIZE\twith -s, sort in at most about SIZE bytes of memory (suffixes K, M, G),\n"
+                    "\t\tspilling sorted runs next to the index file, for indexes larger than memory\n"
                     "\t-s\tsort index file\n"
+                    "\t-t\twith -u, unlink one name at a time from a tree instead of all names in one pass\n"
                     "\t-u\tunlink entry (remove from index only)\n"
                     "\t-v\tprint version and other info then exit\n"
                     "\nDesigned and implemented by Andreas W. Hauser <hauser@genzentrum.lmu.de>.\n",
-                    program_name, MAX_FILENAME_LIST_FILES);
+                    program_name, FFINDEX_BINARY_SUFFIX, FFINDEX_BLOCKS_SUFFIX, FFINDEX_HASH_SUFFIX, MAX_FILENAME_LIST_FILES);
+}
+
+/* Bytes with an optional K, M or G suffix, 0 if invalid */
+static size_t parse_size(const char* size_string)
+{
+  char* suffix;
+  size_t size = strtoull(size_string, &suffix, 10);
+  switch(*suffix)
+  {
+    case 'G': case 'g':
+      size *= 1024;
+      /* fall through */
+    case 'M': case 'm':
+      size *= 1024;
+      /* fall through */
+    case 'K': case 'k':
+      size *= 1024;
+      suffix++;
+  }
+  return *suffix == '\0' ? size : 0;
+}
+
+/* Sort and write back the packed index, without truncating long names */
+static int modify_packed(FILE *index_file, char *index_filename, int sort)
+{
+  /* The names still point into the old index file, so write a new one and rename it */
+  char tmp_filename[FILENAME_MAX];
+  if(snprintf(tmp_filename, FILENAME_MAX, "%s.%d", index_filename, (int)getpid()) >= FILENAME_MAX)
+  {
+    fprintf(stderr, "%s: file name too long\n", index_filename);
+    return EXIT_FAILURE;
+  }
+
+  ffindex_packed_index_t* packed_index = ffindex_packed_index_parse(index_file);
+  if(packed_index == NULL) { perror("ffindex_packed_index_parse failed"); return EXIT_FAILURE; }
+
+  int err = EXIT_SUCCESS;
+  if(sort)
+    err = ffindex_packed_sort(packed_index);
+
+  FILE *tmp_file = NULL;
+  if(err == EXIT_SUCCESS && (tmp_file = fopen(tmp_filename, "w")) == NULL)
+  {
+    perror(tmp_filename);
+    err = EXIT_FAILURE;
+  }
+  if(tmp_file != NULL)
+  {
+    err = ffindex_packed_write(packed_index, tmp_file);
+    if(fclose(tmp_file) != 0)
+      err = EXIT_FAILURE;
+    if(err == EXIT_SUCCESS && rename(tmp_filename, index_filename) == -1)
+      err = EXIT_FAILURE;
+    if(err != EXIT_SUCCESS)
+    {
+      perror(index_filename);
+      unlink(tmp_filename);
+    }
+  }
+
+  ffindex_packed_index_free(packed_index);
+  return err;
+}
+
+/* Written last, they record size, mtime and inode of the final text index */
+static int write_sidecars(ffindex_index_t* index, char *index_filename, int binary, int blocks, int hash)
+{
+  if(index == NULL || index->type == TREE)
+  {
+    FILE *index_file = fopen(index_filename, "r");
+    if(index_file == NULL) { perror(index_filename); return EXIT_FAILURE; }
+    index = ffindex_index_parse(index_file, 0);
+    if(index == NULL) { perror("ffindex_index_parse failed"); return (EXIT_FAILURE); }
+    fclose(index_file);
+  }
+  int err = EXIT_SUCCESS;
+  if(binary)
+    err += ffindex_write_binary(index, index_filename);
+  if(blocks)
+    err += ffindex_write_blocks(index, index_filename, FFINDEX_BLOCK_SIZE_DEFAULT);
+  if(hash)
+    err += ffindex_write_hash(index, index_filename);
+  return err;
 }
 
 int main(int argn, char **argv)
 {
-  int sort = 0, unlink = 0, version = 0, use_tree = 1;
+  int sort = 0, unlink = 0, binary = 0, blocks = 0, hash = 0, packed = 0, version = 0, use_tree = 0;
+  size_t memory_size = 0;
+  char* punch_filename = NULL;
   int err = EXIT_SUCCESS;
   char* list_filenames[MAX_FILENAME_LIST_FILES];
   size_t list_filenames_index = 0;
 
   static struct option long_options[] =
   {
+    { "binary",  no_argument, NULL, 'b' },
+    { "blocks",  no_argument, NULL, 'B' },
+    { "packed",  no_argument, NULL, 'c' },
     { "file",    required_argument, NULL, 'f' },
+    { "hash",    no_argument, NULL, 'H' },
+    { "memory",  required_argument, NULL, 'M' },
+    { "punch",   required_argument, NULL, 'p' },
+    { "threads", required_argument, NULL, 'j' },
     { "sort",    no_argument, NULL, 's' },
     { "tree",    no_argument, NULL, 't' },
     { "unlink",  no_argument, NULL, 'u' },
@@ -61,15 +164,37 @@ int main(int argn, char **argv)
   while (1)
   {
     int option_index = 0;
-    opt = getopt_long(argn, argv, "stuvf:", long_options, &option_index);
+    opt = getopt_long(argn, argv, "bBcHj:M:p:stuvf:", long_options, &option_index);
     if (opt == -1)
       break;  
 
     switch (opt)
     {
+      case 'b':
+        binary = 1;
+        break;
+      case 'B':
+        blocks = 1;
+        break;
+      case 'c':
+        packed = 1;
+        break;
+      case 'H':
+        hash = 1;
+        break;
       case 'f':
         list_filenames[list_filenames_index++] = optarg;
         break;
+      case 'j':
+        ffset_num_threads(atoi(optarg));
+        break;
+      case 'M':
+        memory_size = parse_size(optarg);
+        if(memory_size == 0) { fprintf(stderr, "ERROR: invalid memory size '%s'\n", optarg); return EXIT_FAILURE; }
+        break;
+      case 'p':
+        punch_filename = optarg;
+        break;
       case 's':
         sort = 1;
         break;
@@ -101,18 +226,48 @@ int main(int argn, char **argv)
     return EXIT_FAILURE;
   }
 
+  if(punch_filename != NULL && (!unlink || use_tree))
+  {
+    fprintf(stderr, "ERROR: -p needs -u and can not be combined with -t\n");
+    return EXIT_FAILURE;
+  }
+
   char *index_filename = argv[optind++];
   FILE *index_file;
 
   index_file = fopen(index_filename, "r+");
   if(index_file == NULL) { perror(index_filename); return EXIT_FAILURE; }
 
-  size_t entries = ffcount_lines(index_filename);
-  ffindex_index_t* index = ffindex_index_parse(index_file, entries);
+  if(packed)
+  {
+    if(unlink) { fprintf(stderr, "ERROR: -c can not be combined with -u\n"); return EXIT_FAILURE; }
+    err = modify_packed(index_file, index_filename, sort);
+    fclose(index_file);
+    if((binary || blocks || hash) && err == EXIT_SUCCESS)
+      err += write_sidecars(NULL, index_filename, binary, blocks, hash);
+    return err;
+  }
+
+  /* External sort, the index is never completely in memory */
+  if(memory_size > 0)
+  {
+    if(!sort || unlink) { fprintf(stderr, "ERROR: -M needs -s and can not be combined with -u\n"); return EXIT_FAILURE; }
+    fclose(index_file);
+    err = ffsort_index_external(index_filename, memory_size);
+    if((binary || blocks || hash) && err == EXIT_SUCCESS)
+      err += write_sidecars(NULL, index_filename, binary, blocks, hash);
+    return err;
+  }
+
+  ffindex_index_t* index = ffindex_index_load(index_file, index_filename);
   if(index == NULL) { perror("ffindex_index_parse failed"); return (EXIT_FAILURE); }
 
   fclose(index_file);
 
+  /* Entries unlinked with -p, their data is punched after the index is written */
+  ffindex_entry_t* unlinked = NULL;
+  size_t n_unlinked = 0;
+
   /* Unlink entries */
   if(unlink)
   {
@@ -120,6 +275,7 @@ int main(int argn, char **argv)
     {
       /* Build tree */
       index = ffindex_index_as_tree(index);
+      if(index == NULL) { fferror_print(__FILE__, __LINE__, __func__, "ffindex_index_as_tree failed"); return EXIT_FAILURE; }
 
       /* For each list_file unlink all entries */
       if(list_filenames_index > 0)
@@ -141,45 +297,80 @@ int main(int argn, char **argv)
     }
     else
     {
-      char** sorted_names_to_unlink = malloc(FFINDEX_MAX_INDEX_ENTRIES_DEFAULT * sizeof(char *));
-      if(sorted_names_to_unlink == NULL)
-        fferror_print(__FILE__, __LINE__, __func__, "malloc failed");
-      /* For each list_file unlink all entries */
-      if(list_filenames_index > 0)
-        for(int i = 0; i < list_filenames_index; i++)
-        {
-          printf("Unlinking entries from '%s'\n", list_filenames[i]);
-          FILE *list_file = fopen(list_filenames[i], "r");
-          if( list_file == NULL) { perror(list_filenames[i]); return EXIT_FAILURE; }
+      /* Collect all names and unlink them in one pass over the index */
+      size_t n_names = 0, max_names = 1024;
+      char** names_to_unlink = (char**)malloc(max_names * sizeof(char *));
+      if(names_to_unlink == NULL) { fferror_print(__FILE__, __LINE__, __func__, "malloc failed"); return EXIT_FAILURE; }
 
-          /* unlink entries in file, one per line */
-          char path[PATH_MAX];
-          while(fgets(path, PATH_MAX, list_file) != NULL)
-            sorted_names_to_unlink[i++] = ffnchomp(strdup(path), strlen(path));
-          ffindex_unlink_entries(index, sorted_names_to_unlink, i);
+      for(int i = 0; i < list_filenames_index; i++)
+      {
+        printf("Unlinking entries from '%s'\n", list_filenames[i]);
+        FILE *list_file = fopen(list_filenames[i], "r");
+        if( list_file == NULL) { perror(list_filenames[i]); return EXIT_FAILURE; }
+
+        /* unlink entries in file, one per line */
+        char path[PATH_MAX];
+        while(fgets(path, PATH_MAX, list_file) != NULL)
+        {
+          if(n_names == max_names)
+          {
+            max_names *= 2;
+            names_to_unlink = (char**)realloc(names_to_unlink, max_names * sizeof(char *));
+            if(names_to_unlink == NULL) { fferror_print(__FILE__, __LINE__, __func__, "realloc failed"); return EXIT_FAILURE; }
+          }
+          names_to_unlink[n_names++] = ffnchomp(strdup(path), strlen(path));
         }
+        fclose(list_file);
+      }
 
       /* unlink entries specified by args */
-      int y = 0;
-      for(int i = optind; i < argn; i++, y++)
-        sorted_names_to_unlink[y] = argv[i];
-      ffindex_unlink_entries(index, sorted_names_to_unlink, y);
-
-      /* Sort the index entries and write back */
-      if(sort)
+      if(n_names + argn - optind > max_names)
       {
-        ffindex_sort_index_file(index);
-        index_file = fopen(index_filename, "w");
-        if(index_file == NULL) { perror(index_filename); return EXIT_FAILURE; }
-        err += ffindex_write(index, index_file);
+        max_names = n_names + argn - optind;
+        names_to_unlink = (char**)realloc(names_to_unlink, max_names * sizeof(char *));
+        if(names_to_unlink == NULL) { fferror_print(__FILE__, __LINE__, __func__, "realloc failed"); return EXIT_FAILURE; }
       }
+      for(int i = optind; i < argn; i++)
+        names_to_unlink[n_names++] = strdup(argv[i]);
+
+      if(ffindex_unlink_names(index, names_to_unlink, n_names,
+                              punch_filename != NULL ? &unlinked : NULL, &n_unlinked) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+
+      for(size_t i = 0; i < n_names; i++)
+        free(names_to_unlink[i]);
+      free(names_to_unlink);
     }
   }
 
+  /* Sort the index entries, a tree is always written in order */
+  if(sort && index->type != TREE)
+    ffindex_sort_index_file(index);
+
   /* Write index back */
   index_file = fopen(index_filename, "w");
   if(index_file == NULL) { perror(index_filename); return EXIT_FAILURE; }
   err += ffindex_write(index, index_file);
+  fclose(index_file);
+
+  if(binary || blocks || hash)
+    err += write_sidecars(index, index_filename, binary, blocks, hash);
+
+  /* After the index is written, so no reader finds an entry whose data is gone */
+  if(punch_filename != NULL && err == EXIT_SUCCESS)
+  {
+    int data_fd = open(punch_filename, O_WRONLY);
+    if(data_fd < 0) { perror(punch_filename); return EXIT_FAILURE; }
+    size_t punched = 0;
+    if(ffindex_punch_holes(data_fd, index, unlinked, n_unlinked, &punched) != EXIT_SUCCESS)
+    {
+      perror(punch_filename);
+      err = EXIT_FAILURE;
+    }
+    close(data_fd);
+    printf("%zu entries unlinked, %zu bytes punched in %s\n", n_unlinked, punched, punch_filename);
+    free(unlinked);
+  }
   return err;
 }
 
@@ -22,6 +22,7 @@
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 
@@ -31,21 +32,33 @@
 
 int main(int argc, char **argv)
 {
-  if(argc < 6)
+  int opt, bad_option = 0;
+  while ((opt = getopt(argc, argv, "j:")) != -1) {
+    switch (opt) {
+      case 'j':
+        ffset_num_threads(atoi(optarg));
+        break;
+      default:
+        bad_option = 1;
+    }
+  }
+
+  if(bad_option || argc - optind < 5)
   {
-    fprintf(stderr, "USAGE: %s ORDER_FILENAME DATA_FILENAME INDEX_FILENAME SORTED_DATA_OUT_FILE SORTED_INDEX_OUT_FILE\n"
+    fprintf(stderr, "USAGE: %s [-j THREADS] ORDER_FILENAME DATA_FILENAME INDEX_FILENAME SORTED_DATA_OUT_FILE SORTED_INDEX_OUT_FILE\n"
+                    "\t-j THREADS\tparse and sort with THREADS threads (default: FFINDEX_THREADS or 1)\n"
                     "\nDesigned and implemented by Milot Mirdita <milot@mirdita.de>.\n",
                     argv[0]);
     return -1;
   }
   
-  char *order_filename = argv[1];
+  char *order_filename = argv[optind];
   
-  char *data_filename  = argv[2];
-  char *index_filename = argv[3];
+  char *data_filename  = argv[optind + 1];
+  char *index_filename = argv[optind + 2];
   
-  char *sorted_data_filename  = argv[4];
-  char *sorted_index_filename = argv[5];
+  char *sorted_data_filename  = argv[optind + 3];
+  char *sorted_index_filename = argv[optind + 4];
 
   FILE *order_file = fopen(order_filename, "r");
 
@@ -66,39 +79,70 @@ int main(int argc, char **argv)
   size_t data_size;
   char *data = ffindex_mmap_data(data_file, &data_size);
 
-  size_t entries = ffcount_lines(index_filename);
-  ffindex_index_t* index = ffindex_index_parse(index_file, entries);
+  ffindex_index_t* index = ffindex_index_load(index_file, index_filename);
   if(index == NULL)  {   
     perror("ffindex_index_parse failed");
     exit(EXIT_FAILURE);
   }
 
-
   char message[LINE_MAX];
   char line[LINE_MAX];
-  int i = 0;
-  size_t offset = 0;
+  size_t n_names = 0, max_names = 0;
+  char** names = NULL;
   while (fgets(line, sizeof(line), order_file)) {
     size_t len = strlen(line);
     if (len && (line[len - 1] != '\n')) {
       // line is incomplete
-      snprintf(message, LINE_MAX, "Warning: Line %d of order file %s was too long and cut-off.", i, order_filename);
+      snprintf(message, LINE_MAX, "Warning: Line %zu of order file %s was too long and cut-off.", n_names, order_filename);
       fferror_print(__FILE__, __LINE__, argv[0], message);
     }
 
+    if (n_names == max_names) {
+      max_names = max_names < 1024 ? 1024 : max_names * 2;
+      names = (char**)realloc(names, sizeof(char*) * max_names);
+      if (names == NULL) {
+        fferror_print(__FILE__, __LINE__, argv[0], "realloc failed");
+        exit(EXIT_FAILURE);
+      }
+    }
+
     // remove new line
-    char *name = ffnchomp(line, len);
-    ffindex_entry_t* entry = ffindex_get_entry_by_name(index, name);
+    names[n_names] = strdup(ffnchomp(line, len));
+    if (names[n_names] == NULL) {
+      fferror_print(__FILE__, __LINE__, argv[0], "strdup failed");
+      exit(EXIT_FAILURE);
+    }
+    n_names++;
+  }
 
+  // look up all names at once, then copy the entries in order
+  ffindex_entry_t** entries = (ffindex_entry_t**)malloc(sizeof(ffindex_entry_t*) * n_names);
+  if (entries == NULL && n_names > 0) {
+    fferror_print(__FILE__, __LINE__, argv[0], "malloc failed");
+    exit(EXIT_FAILURE);
+  }
+  ffindex_index_prepare_lookups(index);
+  if (ffindex_get_entries_by_names(index, names, n_names, entries) != EXIT_SUCCESS)
+    exit(EXIT_FAILURE);
+
+  ffindex_writer_t* writer = ffindex_writer_new(fileno(sorted_data_file), fileno(sorted_index_file), 0);
+  if (writer == NULL)
+    exit(EXIT_FAILURE);
+  for (size_t i = 0; i < n_names; i++) {
+    ffindex_entry_t* entry = entries[i];
     if (entry != NULL) {
       char* filedata = ffindex_get_data_by_entry(data, entry);
       size_t entryLength = (entry->length == 0 ) ? 0 : entry->length - 1;
-      ffindex_insert_memory(sorted_data_file, sorted_index_file, &offset, filedata, entryLength, name);
+      if (ffindex_writer_insert_memory(writer, filedata, entryLength, names[i]) != EXIT_SUCCESS)
+        exit(EXIT_FAILURE);
     }
-
-    i++;
+    free(names[i]);
   }
-  
+  free(entries);
+  free(names);
+  if (ffindex_writer_close(writer) != EXIT_SUCCESS)
+    exit(EXIT_FAILURE);
+
   // cleanup
   fclose(sorted_data_file);
   fclose(index_file);
@@ -108,8 +152,7 @@ int main(int argc, char **argv)
   // sort FFindex index
   fclose(sorted_index_file);
   sorted_index_file = fopen(sorted_index_filename, "r+");
-  entries = ffcount_lines(index_filename);
-  index = ffindex_index_parse(sorted_index_file, entries);
+  index = ffindex_index_parse(sorted_index_file, 0);
   if(index == NULL)  {
     perror("ffindex_index_parse failed");
     exit(EXIT_FAILURE);
@@ -51,8 +51,7 @@ int main(int argn, char **argv)
   size_t data_size;
   char *data = ffindex_mmap_data(data_file, &data_size);
 
-  size_t entries = ffcount_lines(index_filename);
-  ffindex_index_t* index = ffindex_index_parse(index_file, entries);
+  ffindex_index_t* index = ffindex_index_load(index_file, index_filename);
   if(index == NULL)
   {
     fferror_print(__FILE__, __LINE__, "ffindex_index_parse", index_filename);
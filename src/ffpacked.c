@@ -0,0 +1,273 @@
+/*
+ * Ffindex
+ * written by Andy Hauser <hauser@genzentrum.lmu.de>.
+ * Please add your name here if you distribute modified versions.
+ *
+ * Ffindex is provided under the Create Commons license "Attribution-ShareAlike
+ * 3.0", which basically captures the spirit of the Gnu Public License (GPL).
+ *
+ * See:
+ * http://creativecommons.org/licenses/by-sa/3.0/
+ *
+ * Packed index: offsets and lengths in dense arrays, names referenced as
+ * (position, length) into the mmapped text index instead of being copied into
+ * fixed-size ffindex_entry_t. 20 instead of 48 bytes per entry and no limit
+ * on the name length.
+*/
+
+#define _GNU_SOURCE 1
+#define _LARGEFILE64_SOURCE 1
+#define _FILE_OFFSET_BITS 64
+
+#include "ffindex.h"
+#include "ffutil.h"
+
+#include <sys/mman.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FFINDEX_PACKED_NAME_LENGTH_BITS 24
+#define FFINDEX_PACKED_NAME_LENGTH_MASK ((UINT64_C(1) << FFINDEX_PACKED_NAME_LENGTH_BITS) - 1)
+#define FFINDEX_PACKED_MAX_POSITION (UINT64_C(1) << (64 - FFINDEX_PACKED_NAME_LENGTH_BITS))
+
+static void ffindex_packed_index_init(ffindex_packed_index_t* index)
+{
+  index->index_data = NULL;
+  index->index_data_size = 0;
+  index->n_entries = 0;
+  index->offsets = NULL;
+  index->lengths = NULL;
+  index->names = NULL;
+}
+
+void ffindex_packed_index_free(ffindex_packed_index_t* index)
+{
+  if(index == NULL)
+    return;
+  if(index->index_data != NULL)
+    munmap(index->index_data, index->index_data_size);
+  free(index->offsets);
+  free(index->lengths);
+  free(index->names);
+  free(index);
+}
+
+ffindex_packed_index_t* ffindex_packed_index_parse(FILE *index_file)
+{
+  ffindex_packed_index_t* index = (ffindex_packed_index_t*)malloc(sizeof(ffindex_packed_index_t));
+  if(index == NULL)
+  {
+    fferror_print(__FILE__, __LINE__, __func__, "malloc failed");
+    return NULL;
+  }
+  ffindex_packed_index_init(index);
+
+  index->index_data = ffindex_mmap_data(index_file, &index->index_data_size);
+  if(index->index_data == MAP_FAILED)
+  {
+    index->index_data = NULL;
+    ffindex_packed_index_free(index);
+    return NULL;
+  }
+  if(index->index_data_size >= FFINDEX_PACKED_MAX_POSITION)
+  {
+    fprintf(stderr, "ffindex_packed_index_parse: index file too large for a packed index\n");
+    ffindex_packed_index_free(index);
+    return NULL;
+  }
+
+  char* d = index->index_data;
+  char* end = index->index_data + index->index_data_size;
+
+  size_t n_lines = 0;
+  for(char* p = d; p < end && (p = memchr(p, '\n', end - p)) != NULL; p++)
+    n_lines++;
+  if(index->index_data_size > 0 && end[-1] != '\n')
+    n_lines++;
+
+  index->offsets = (uint64_t*)malloc(sizeof(uint64_t) * n_lines);
+  index->lengths = (uint32_t*)malloc(sizeof(uint32_t) * n_lines);
+  index->names = (uint64_t*)malloc(sizeof(uint64_t) * n_lines);
+  if(n_lines > 0 && (index->offsets == NULL || index->lengths == NULL || index->names == NULL))
+  {
+    fferror_print(__FILE__, __LINE__, __func__, "malloc failed");
+    ffindex_packed_index_free(index);
+    return NULL;
+  }
+
+  size_t i;
+  char* next;
+  for(i = 0; d < end && i < n_lines; i++)
+  {
+    char* tab = memchr(d, '\t', end - d);
+    if(tab == NULL)
+      break;
+
+    size_t name_length = tab - d;
+    if(name_length > FFINDEX_PACKED_NAME_LENGTH_MASK)
+    {
+      fprintf(stderr, "ffindex_packed_index_parse: name in line %zu too long\n", i + 1);
+      ffindex_packed_index_free(index);
+      return NULL;
+    }
+    index->names[i] = ((uint64_t)(d - index->index_data) << FFINDEX_PACKED_NAME_LENGTH_BITS) | name_length;
+
+    index->offsets[i] = strtoull(tab, &next, 10);
+    d = next;
+    unsigned long long length = strtoull(d, &next, 10);
+    if(length > UINT32_MAX)
+    {
+      fprintf(stderr, "ffindex_packed_index_parse: entry in line %zu too large for a packed index\n", i + 1);
+      ffindex_packed_index_free(index);
+      return NULL;
+    }
+    index->lengths[i] = length;
+    d = next + 1; /* +1 for newline */
+  }
+  index->n_entries = i;
+
+  return index;
+}
+
+const char* ffindex_packed_get_name(ffindex_packed_index_t* index, size_t entry_index, size_t* name_length)
+{
+  uint64_t name = index->names[entry_index];
+  *name_length = name & FFINDEX_PACKED_NAME_LENGTH_MASK;
+  return index->index_data + (name >> FFINDEX_PACKED_NAME_LENGTH_BITS);
+}
+
+static int ffindex_packed_compare_names(const char* name1, size_t length1, const char* name2, size_t length2)
+{
+  int cmp = memcmp(name1, name2, length1 < length2 ? length1 : length2);
+  if(cmp != 0)
+    return cmp;
+  return (length1 > length2) - (length1 < length2);
+}
+
+static size_t ffindex_packed_bsearch_length(ffindex_packed_index_t* index, const char* name, size_t length)
+{
+  size_t low = 0, high = index->n_entries;
+  while(low < high)
+  {
+    size_t mid = low + (high - low) / 2;
+    size_t mid_length;
+    const char* mid_name = ffindex_packed_get_name(index, mid, &mid_length);
+    int cmp = ffindex_packed_compare_names(mid_name, mid_length, name, length);
+    if(cmp == 0)
+      return mid;
+    else if(cmp < 0)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return FFINDEX_PACKED_NOT_FOUND;
+}
+
+size_t ffindex_packed_bsearch(ffindex_packed_index_t* index, const char* name)
+{
+  size_t length = strlen(name);
+  size_t entry_index = ffindex_packed_bsearch_length(index, name, length);
+
+  /* A long name written by ffindex_build or ffindex_modify is cut to the part an ffindex_entry_t keeps */
+  if(entry_index == FFINDEX_PACKED_NOT_FOUND && length > FFINDEX_MAX_ENTRY_NAME_CHARS)
+    entry_index = ffindex_packed_bsearch_length(index, name, FFINDEX_MAX_ENTRY_NAME_CHARS);
+  return entry_index;
+}
+
+int ffindex_packed_sorted(ffindex_packed_index_t* index)
+{
+  for(size_t i = 1; i < index->n_entries; i++)
+  {
+    size_t length1, length2;
+    const char* name1 = ffindex_packed_get_name(index, i - 1, &length1);
+    const char* name2 = ffindex_packed_get_name(index, i, &length2);
+    if(ffindex_packed_compare_names(name1, length1, name2, length2) > 0)
+      return 0;
+  }
+  return 1;
+}
+
+char* ffindex_packed_get_data_by_name(char* data, ffindex_packed_index_t* index, const char* name, size_t* length)
+{
+  size_t entry_index = ffindex_packed_bsearch(index, name);
+  if(entry_index == FFINDEX_PACKED_NOT_FOUND)
+    return NULL;
+
+  *length = index->lengths[entry_index];
+  return ffindex_get_data_by_offset(data, index->offsets[entry_index]);
+}
+
+typedef struct ffindex_packed_sort_key {
+  const char* name;
+  size_t length;
+  size_t entry_index;
+} ffindex_packed_sort_key_t;
+
+static int ffindex_packed_compare_sort_keys(const void* pkey1, const void* pkey2)
+{
+  const ffindex_packed_sort_key_t* key1 = (const ffindex_packed_sort_key_t*)pkey1;
+  const ffindex_packed_sort_key_t* key2 = (const ffindex_packed_sort_key_t*)pkey2;
+  return ffindex_packed_compare_names(key1->name, key1->length, key2->name, key2->length);
+}
+
+/* Sort by name: sort (name, position) keys, then permute each array in turn */
+int ffindex_packed_sort(ffindex_packed_index_t* index)
+{
+  size_t n = index->n_entries;
+  ffindex_packed_sort_key_t* keys = (ffindex_packed_sort_key_t*)malloc(sizeof(ffindex_packed_sort_key_t) * n);
+  if(keys == NULL && n > 0)
+  {
+    fferror_print(__FILE__, __LINE__, __func__, "malloc failed");
+    return EXIT_FAILURE;
+  }
+  for(size_t i = 0; i < n; i++)
+  {
+    keys[i].name = ffindex_packed_get_name(index, i, &keys[i].length);
+    keys[i].entry_index = i;
+  }
+  qsort(keys, n, sizeof(ffindex_packed_sort_key_t), ffindex_packed_compare_sort_keys);
+
+  uint64_t* permuted = (uint64_t*)malloc(sizeof(uint64_t) * n);
+  if(permuted == NULL && n > 0)
+  {
+    fferror_print(__FILE__, __LINE__, __func__, "malloc failed");
+    free(keys);
+    return EXIT_FAILURE;
+  }
+
+  for(size_t i = 0; i < n; i++)
+    permuted[i] = index->offsets[keys[i].entry_index];
+  memcpy(index->offsets, permuted, sizeof(uint64_t) * n);
+
+  for(size_t i = 0; i < n; i++)
+    permuted[i] = index->names[keys[i].entry_index];
+  memcpy(index->names, permuted, sizeof(uint64_t) * n);
+
+  uint32_t* permuted_lengths = (uint32_t*)permuted;
+  for(size_t i = 0; i < n; i++)
+    permuted_lengths[i] = index->lengths[keys[i].entry_index];
+  memcpy(index->lengths, permuted_lengths, sizeof(uint32_t) * n);
+
+  free(permuted);
+  free(keys);
+  return EXIT_SUCCESS;
+}
+
+int ffindex_packed_write(ffindex_packed_index_t* index, FILE* index_file)
+{
+  for(size_t i = 0; i < index->n_entries; i++)
+  {
+    size_t name_length;
+    const char* name = ffindex_packed_get_name(index, i, &name_length);
+    if(fwrite(name, sizeof(char), name_length, index_file) != name_length)
+      return EXIT_FAILURE;
+    if(fprintf(index_file, "\t%zu\t%u\n", (size_t)index->offsets[i], index->lengths[i]) < 0)
+      return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+/* vim: ts=2 sw=2 et
+*/
@@ -0,0 +1,384 @@
+/*
+ * Ffindex
+ * written by Andy Hauser <hauser@genzentrum.lmu.de>.
+ * Please add your name here if you distribute modified versions.
+ *
+ * Ffindex is provided under the Create Commons license "Attribution-ShareAlike
+ * 3.0", which basically captures the spirit of the Gnu Public License (GPL).
+ *
+ * See:
+ * http://creativecommons.org/licenses/by-sa/3.0/
+ *
+ * Search accelerators for sorted indexes. Names are reduced to 8 byte big-endian
+ * keys taken after the prefix all names share, so comparing keys as integers gives
+ * the same order as strncmp on the names. Only names with equal keys need a full
+ * comparison. The keys are either kept in Eytzinger order or in entries order,
+ * searched without branches.
+ *
+ * Numeric keys: indexes whose names are all decimal integers are looked up by the
+ * integer value with an interpolation search, and can be sorted numerically.
+*/
+
+#define _GNU_SOURCE 1
+#define _LARGEFILE64_SOURCE 1
+#define _FILE_OFFSET_BITS 64
+
+#include "ffindex.h"
+#include "ffutil.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Entries scanned linearly after the key search before switching to a binary search */
+#define FFINDEX_SEARCH_MAX_SCAN 16
+/* Keys probed on either side of an interpolation guess */
+#define FFINDEX_NUMERIC_WINDOW 8
+/* Keys checked to decide whether interpolation works for an index */
+#define FFINDEX_NUMERIC_SAMPLES 1024
+
+uint64_t ffindex_name_key(const char* name, size_t prefix_offset)
+{
+  uint64_t key = 0;
+  size_t i;
+  for(i = 0; i < 8 && prefix_offset + i < FFINDEX_MAX_ENTRY_NAME_CHARS && name[prefix_offset + i] != '\0'; i++)
+    key = (key << 8) | (unsigned char)name[prefix_offset + i];
+  if(i == 0)
+    return 0;
+  return key << (8 * (8 - i));
+}
+
+void ffindex_index_drop_search(ffindex_index_t* index)
+{
+  free(index->search_keys);
+  free(index->search_positions);
+  index->search_keys = NULL;
+  index->search_positions = NULL;
+  index->search_prefix_offset = 0;
+  index->search_mode = FFINDEX_SEARCH_BSEARCH;
+}
+
+/* In-order traversal of the implicit tree assigns the sorted keys to Eytzinger positions */
+static size_t ffindex_eytzinger_fill(ffindex_index_t* index, size_t i, size_t k)
+{
+  if(k <= index->n_entries)
+  {
+    i = ffindex_eytzinger_fill(index, i, 2 * k);
+    index->search_keys[k] = ffindex_name_key(index->entries[i].name, index->search_prefix_offset);
+    index->search_positions[k] = i++;
+    i = ffindex_eytzinger_fill(index, i, 2 * k + 1);
+  }
+  return i;
+}
+
+int ffindex_index_build_search(ffindex_index_t* index, enum ffindex_search_mode mode)
+{
+  ffindex_index_drop_search(index);
+  if(mode == FFINDEX_SEARCH_BSEARCH || index->n_entries == 0 || index->type == TREE)
+    return EXIT_SUCCESS;
+
+  /* Sorted, so the prefix of the first and the last name is shared by all */
+  const char* first = index->entries[0].name;
+  const char* last = index->entries[index->n_entries - 1].name;
+  size_t prefix_offset = 0;
+  while(prefix_offset < FFINDEX_MAX_ENTRY_NAME_CHARS && first[prefix_offset] != '\0' && first[prefix_offset] == last[prefix_offset])
+    prefix_offset++;
+  index->search_prefix_offset = prefix_offset;
+
+  if(mode == FFINDEX_SEARCH_PREFIX)
+  {
+    /* Keys parallel to entries */
+    index->search_keys = (uint64_t*)malloc(sizeof(uint64_t) * index->n_entries);
+    if(index->search_keys == NULL)
+    {
+      fferror_print(__FILE__, __LINE__, __func__, "malloc failed");
+      return EXIT_FAILURE;
+    }
+    for(size_t i = 0; i < index->n_entries; i++)
+      index->search_keys[i] = ffindex_name_key(index->entries[i].name, prefix_offset);
+  }
+  else
+  {
+    /* Eytzinger layout: 1-based, position 0 maps to "not found" */
+    size_t n_keys = index->n_entries + 1;
+    index->search_keys = (uint64_t*)malloc(sizeof(uint64_t) * n_keys);
+    index->search_positions = (size_t*)malloc(sizeof(size_t) * n_keys);
+    if(index->search_keys == NULL || index->search_positions == NULL)
+    {
+      fferror_print(__FILE__, __LINE__, __func__, "malloc failed");
+      ffindex_index_drop_search(index);
+      return EXIT_FAILURE;
+    }
+    index->search_keys[0] = 0;
+    index->search_positions[0] = index->n_entries;
+    ffindex_eytzinger_fill(index, 0, 1);
+  }
+
+  index->search_mode = mode;
+  return EXIT_SUCCESS;
+}
+
+/* Position of the first entry whose key is not less than key */
+static size_t ffindex_eytzinger_lower_bound(ffindex_index_t* index, uint64_t key)
+{
+  const uint64_t* keys = index->search_keys;
+  size_t n = index->n_entries;
+  size_t k = 1;
+  while(k <= n)
+  {
+    /* Four levels ahead, the 16 descendants share two cache lines */
+    __builtin_prefetch(keys + 16 * k);
+    k = 2 * k + (keys[k] < key);
+  }
+  k >>= __builtin_ffsll(~(unsigned long long)k);
+  return index->search_positions[k];
+}
+
+/* Position of the first entry whose key is not less than key, the comparison result
+ * selects the next base instead of a branch. */
+static size_t ffindex_prefix_lower_bound(ffindex_index_t* index, uint64_t key)
+{
+  const uint64_t* keys = index->search_keys;
+  const uint64_t* base = keys;
+  size_t n = index->n_entries;
+  while(n > 1)
+  {
+    size_t half = n / 2;
+    __builtin_prefetch(base + half / 2);
+    __builtin_prefetch(base + half + half / 2);
+    base = (base[half] < key) ? base + half : base;
+    n -= half;
+  }
+  return (base - keys) + (*base < key);
+}
+
+static size_t ffindex_search_lower_bound(ffindex_index_t* index, uint64_t key)
+{
+  if(index->search_mode == FFINDEX_SEARCH_PREFIX)
+    return ffindex_prefix_lower_bound(index, key);
+  return ffindex_eytzinger_lower_bound(index, key);
+}
+
+ffindex_entry_t* ffindex_search_get_entry(ffindex_index_t* index, char* name)
+{
+  size_t prefix_offset = index->search_prefix_offset;
+  if(strncmp(name, index->entries[0].name, prefix_offset) != 0)
+    return NULL;
+
+  uint64_t key = ffindex_name_key(name, prefix_offset);
+  size_t position = ffindex_search_lower_bound(index, key);
+
+  /* Names with the same key are compared completely, usually there are none or few */
+  size_t n = index->n_entries;
+  for(size_t i = 0; i < FFINDEX_SEARCH_MAX_SCAN && position < n; i++, position++)
+  {
+    int cmp = strncmp(index->entries[position].name, name, FFINDEX_MAX_ENTRY_NAME_CHARS);
+    if(cmp == 0)
+      return &index->entries[position];
+    else if(cmp > 0)
+      return NULL;
+  }
+  if(position >= n)
+    return NULL;
+
+  /* Many names with the same key, binary search up to the next key */
+  size_t end = key == UINT64_MAX ? n : ffindex_search_lower_bound(index, key + 1);
+  ffindex_index_t run = *index;
+  run.entries = index->entries + position;
+  run.n_entries = end - position;
+  run.search_mode = FFINDEX_SEARCH_BSEARCH;
+  return ffindex_bsearch_get_entry(&run, name);
+}
+
+/* Canonical decimal integers only (no sign, no leading zeros), so that the key maps back to the name */
+int ffindex_parse_numeric_name(const char* name, uint64_t* key)
+{
+  uint64_t value = 0;
+  size_t i;
+  for(i = 0; i < FFINDEX_NUMERIC_MAX_DIGITS && name[i] >= '0' && name[i] <= '9'; i++)
+    value = value * 10 + (name[i] - '0');
+  if(i == 0 || name[i] != '\0' || (name[0] == '0' && i > 1))
+    return 0;
+  *key = value;
+  return 1;
+}
+
+void ffindex_index_drop_numeric(ffindex_index_t* index)
+{
+  free(index->numeric_keys);
+  free(index->numeric_positions);
+  index->numeric_keys = NULL;
+  index->numeric_positions = NULL;
+  index->numeric_interpolate = 0;
+}
+
+static size_t ffindex_numeric_guess(const uint64_t* keys, size_t n, uint64_t key)
+{
+  return (size_t)((double)(key - keys[0]) / (double)(keys[n - 1] - keys[0]) * (double)(n - 1));
+}
+
+/* Interpolation only pays off if the guesses hit the probed window, e.g. for dense IDs.
+ * For skewed IDs the mispredicted branches cost more than the binary search steps saved.
+ */
+static int ffindex_numeric_interpolate(const uint64_t* keys, size_t n)
+{
+  if(n <= 2 * FFINDEX_NUMERIC_WINDOW || keys[n - 1] == keys[0])
+    return 0;
+  for(size_t sample = 0; sample < FFINDEX_NUMERIC_SAMPLES; sample++)
+  {
+    size_t i = sample * (n - 1) / (FFINDEX_NUMERIC_SAMPLES - 1);
+    size_t guess = ffindex_numeric_guess(keys, n, keys[i]);
+    if((guess > i ? guess - i : i - guess) >= FFINDEX_NUMERIC_WINDOW)
+      return 0;
+  }
+  return 1;
+}
+
+/* Position of the first key not less than key: an interpolation guess narrows the
+ * range to a window around it, then a branchless binary search.
+ */
+static size_t ffindex_numeric_lower_bound(ffindex_index_t* index, uint64_t key)
+{
+  const uint64_t* keys = index->numeric_keys;
+  size_t n = index->n_entries;
+  size_t low = 0, high = n;
+  if(index->numeric_interpolate)
+  {
+    if(key <= keys[0])
+      return 0;
+    if(key > keys[n - 1])
+      return n;
+    size_t mid = ffindex_numeric_guess(keys, n, key);
+    size_t window_low = mid > FFINDEX_NUMERIC_WINDOW ? mid - FFINDEX_NUMERIC_WINDOW : 0;
+    size_t window_high = mid + FFINDEX_NUMERIC_WINDOW < n - 1 ? mid + FFINDEX_NUMERIC_WINDOW : n - 1;
+    if(keys[window_low] >= key)
+      high = window_low;
+    else if(keys[window_high] < key)
+      low = window_high + 1;
+    else
+    {
+      low = window_low + 1;
+      high = window_high;
+    }
+  }
+
+  const uint64_t* base = keys + low;
+  size_t length = high - low;
+  if(length == 0)
+    return low;
+  while(length > 1)
+  {
+    size_t half = length / 2;
+    base = (base[half] < key) ? base + half : base;
+    length -= half;
+  }
+  return (base - keys) + (*base < key);
+}
+
+/* Parses all names, EXIT_FAILURE if one is not numeric. positions is NULL if the keys are already sorted. */
+static int ffindex_numeric_keys(ffindex_index_t* index, uint64_t** pkeys, size_t** ppositions)
+{
+  size_t n = index->n_entries;
+  uint64_t* keys = (uint64_t*)malloc(sizeof(uint64_t) * n);
+  if(keys == NULL && n > 0)
+  {
+    fferror_print(__FILE__, __LINE__, __func__, "malloc failed");
+    return EXIT_FAILURE;
+  }
+
+  int sorted = 1;
+  for(size_t i = 0; i < n; i++)
+  {
+    if(!ffindex_parse_numeric_name(index->entries[i].name, &keys[i]))
+    {
+      free(keys);
+      return EXIT_FAILURE;
+    }
+    if(i > 0 && keys[i] < keys[i - 1])
+      sorted = 0;
+  }
+
+  size_t* positions = NULL;
+  if(!sorted)
+  {
+    positions = (size_t*)malloc(sizeof(size_t) * n);
+    if(positions == NULL)
+    {
+      fferror_print(__FILE__, __LINE__, __func__, "malloc failed");
+      free(keys);
+      return EXIT_FAILURE;
+    }
+    for(size_t i = 0; i < n; i++)
+      positions[i] = i;
+    if(ffsort_radix_keys(keys, positions, n) != EXIT_SUCCESS)
+    {
+      free(keys);
+      free(positions);
+      return EXIT_FAILURE;
+    }
+  }
+
+  *pkeys = keys;
+  *ppositions = positions;
+  return EXIT_SUCCESS;
+}
+
+int ffindex_index_build_numeric(ffindex_index_t* index)
+{
+  ffindex_index_drop_numeric(index);
+  if(index->type == TREE)
+    return EXIT_FAILURE;
+  if(ffindex_numeric_keys(index, &index->numeric_keys, &index->numeric_positions) != EXIT_SUCCESS)
+    return EXIT_FAILURE;
+  index->numeric_interpolate = ffindex_numeric_interpolate(index->numeric_keys, index->n_entries);
+  return EXIT_SUCCESS;
+}
+
+int ffindex_index_numeric(ffindex_index_t* index)
+{
+  uint64_t key;
+  for(size_t i = 0; i < index->n_entries; i++)
+    if(!ffindex_parse_numeric_name(index->entries[i].name, &key))
+      return 0;
+  return 1;
+}
+
+int ffindex_sort_index_file_numeric(ffindex_index_t* index)
+{
+  uint64_t* keys;
+  size_t* positions;
+  ffindex_index_drop_numeric(index);
+  if(ffindex_numeric_keys(index, &keys, &positions) != EXIT_SUCCESS)
+    return EXIT_FAILURE;
+
+  if(positions != NULL)
+  {
+    ffsort_permute_entries(index->entries, positions, index->n_entries);
+    free(positions);
+
+    /* The other lookup structures refer to the old order */
+    ffindex_index_drop_hash(index);
+    ffindex_index_drop_search(index);
+  }
+
+  index->numeric_keys = keys;
+  index->numeric_interpolate = ffindex_numeric_interpolate(keys, index->n_entries);
+  return EXIT_SUCCESS;
+}
+
+ffindex_entry_t* ffindex_numeric_get_entry(ffindex_index_t* index, char* name)
+{
+  uint64_t key;
+  if(!ffindex_parse_numeric_name(name, &key))
+    return NULL;
+
+  size_t position = ffindex_numeric_lower_bound(index, key);
+  if(position >= index->n_entries || index->numeric_keys[position] != key)
+    return NULL;
+  if(index->numeric_positions != NULL)
+    position = index->numeric_positions[position];
+  return &index->entries[position];
+}
+
+/* vim: ts=2 sw=2 et
+*/
@@ -0,0 +1,827 @@
+/*
+ * Ffindex
+ * written by Andy Hauser <hauser@genzentrum.lmu.de>.
+ * Please add your name here if you distribute modified versions.
+ *
+ * Ffindex is provided under the Create Commons license "Attribution-ShareAlike
+ * 3.0", which basically captures the spirit of the Gnu Public License (GPL).
+ *
+ * See:
+ * http://creativecommons.org/licenses/by-sa/3.0/
+ *
+ * Radix sorts: names are sorted as (8 byte key, position) pairs, most significant
+ * 8 bytes first. Only runs of names with equal keys are sorted by the next 8 bytes,
+ * the entries themselves are moved once at the end.
+ *
+ * With several threads every thread sorts a chunk, the sorted chunks are cut at
+ * common splitter names and every thread merges one slice of all chunks.
+ *
+ * Appended entries: only the unsorted tail behind the sorted prefix is sorted and
+ * then merged into the prefix from the back.
+ *
+ * External sort: as many entries as fit into the memory budget are sorted at a time
+ * and spilled as binary runs next to the index, then the runs are k-way merged.
+*/
+
+#define _GNU_SOURCE 1
+#define _LARGEFILE64_SOURCE 1
+#define _FILE_OFFSET_BITS 64
+
+#include "ffindex.h"
+#include "ffutil.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Below this many names a run is sorted by insertion sort */
+#define FFSORT_INSERTION_SORT_MAX 32
+/* Entries fetched ahead when permuting */
+#define FFSORT_PREFETCH_DISTANCE 16
+/* Not worth a thread below this many entries per thread */
+#define FFSORT_THREAD_MIN_ENTRIES (64 * 1024)
+/* Names sampled from each sorted chunk to choose the splitters */
+#define FFSORT_SAMPLES_PER_CHUNK 64
+/* Bytes per entry while sorting in memory: the entries, the permutation copy and the radix sort arrays */
+#define FFSORT_BYTES_PER_ENTRY (2 * sizeof(ffindex_entry_t) + 5 * sizeof(size_t))
+/* Runs merged at once, more runs are merged in several passes */
+#define FFSORT_MAX_MERGE_RUNS 64
+
+/* LSD radix sort of (key, position) pairs, one byte per pass. Bytes that are the same
+ * in all keys are skipped. buffer_keys and buffer_positions have room for n pairs.
+ */
+static void ffsort_radix_keys_buffered(uint64_t* keys, size_t* positions, size_t n, uint64_t* buffer_keys, size_t* buffer_positions)
+{
+  size_t counts[8][256];
+  memset(counts, 0, sizeof(counts));
+  for(size_t i = 0; i < n; i++)
+    for(int byte = 0; byte < 8; byte++)
+      counts[byte][(keys[i] >> (8 * byte)) & 0xff]++;
+
+  uint64_t* from_keys = keys, *to_keys = buffer_keys;
+  size_t* from_positions = positions, *to_positions = buffer_positions;
+  for(int byte = 0; byte < 8; byte++)
+  {
+    int shift = 8 * byte;
+    if(counts[byte][(from_keys[0] >> shift) & 0xff] == n)
+      continue;
+
+    size_t offsets[256];
+    size_t sum = 0;
+    for(int digit = 0; digit < 256; digit++)
+    {
+      offsets[digit] = sum;
+      sum += counts[byte][digit];
+    }
+    for(size_t i = 0; i < n; i++)
+    {
+      size_t j = offsets[(from_keys[i] >> shift) & 0xff]++;
+      to_keys[j] = from_keys[i];
+      to_positions[j] = from_positions[i];
+    }
+
+    uint64_t* swap_keys = from_keys;
+    from_keys = to_keys;
+    to_keys = swap_keys;
+    size_t* swap_positions = from_positions;
+    from_positions = to_positions;
+    to_positions = swap_positions;
+  }
+
+  if(from_keys != keys)
+  {
+    memcpy(keys, from_keys, sizeof(uint64_t) * n);
+    memcpy(positions, from_positions, sizeof(size_t) * n);
+  }
+}
+
+int ffsort_radix_keys(uint64_t* keys, size_t* positions, size_t n)
+{
+  uint64_t* buffer_keys = (uint64_t*)malloc(sizeof(uint64_t) * n);
+  size_t* buffer_positions = (size_t*)malloc(sizeof(size_t) * n);
+  if(n > 0 && (buffer_keys == NULL || buffer_positions == NULL))
+  {
+    fferror_print(__FILE__, __LINE__, __func__, "malloc failed");
+    free(buffer_keys);
+    free(buffer_positions);
+    return EXIT_FAILURE;
+  }
+  if(n > 0)
+    ffsort_radix_keys_buffered(keys, positions, n, buffer_keys, buffer_positions);
+  free(buffer_keys);
+  free(buffer_positions);
+  return EXIT_SUCCESS;
+}
+
+typedef struct ffsort_names_state {
+  char** names;
+  uint64_t* keys;
+  size_t* positions;
+  uint64_t* buffer_keys;
+  size_t* buffer_positions;
+} ffsort_names_state_t;
+
+/* Names in [begin, end) agree in their first depth bytes, keys hold bytes depth to depth + 7 */
+static void ffsort_names_range(ffsort_names_state_t* state, size_t begin, size_t end, size_t depth)
+{
+  uint64_t* keys = state->keys;
+  size_t* positions = state->positions;
+  size_t n = end - begin;
+
+  if(n <= FFSORT_INSERTION_SORT_MAX)
+  {
+    for(size_t i = begin + 1; i < end; i++)
+    {
+      uint64_t key = keys[i];
+      size_t position = positions[i];
+      const char* name = state->names[position] + depth;
+      size_t j = i;
+      for(; j > begin; j--)
+      {
+        if(keys[j - 1] < key)
+          break;
+        if(keys[j - 1] == key && strncmp(state->names[positions[j - 1]] + depth, name, FFINDEX_MAX_ENTRY_NAME_CHARS - depth) <= 0)
+          break;
+        keys[j] = keys[j - 1];
+        positions[j] = positions[j - 1];
+      }
+      keys[j] = key;
+      positions[j] = position;
+    }
+    return;
+  }
+
+  ffsort_radix_keys_buffered(keys + begin, positions + begin, n, state->buffer_keys, state->buffer_positions);
+
+  /* Names with equal keys that go on after these 8 bytes are sorted by the next 8 */
+  size_t next_depth = depth + 8;
+  if(next_depth >= FFINDEX_MAX_ENTRY_NAME_CHARS)
+    return;
+  for(size_t run_begin = begin, run_end; run_begin < end; run_begin = run_end)
+  {
+    for(run_end = run_begin + 1; run_end < end && keys[run_end] == keys[run_begin]; run_end++)
+      ;
+    if(run_end - run_begin > 1 && (keys[run_begin] & 0xff) != 0)
+    {
+      for(size_t i = run_begin; i < run_end; i++)
+        keys[i] = ffindex_name_key(state->names[positions[i]], next_depth);
+      ffsort_names_range(state, run_begin, run_end, next_depth);
+    }
+  }
+}
+
+int ffsort_names(char** names, size_t n, size_t* positions)
+{
+  ffsort_names_state_t state;
+  state.names = names;
+  state.positions = positions;
+  state.keys = (uint64_t*)malloc(sizeof(uint64_t) * n);
+  state.buffer_keys = (uint64_t*)malloc(sizeof(uint64_t) * n);
+  state.buffer_positions = (size_t*)malloc(sizeof(size_t) * n);
+  if(n > 0 && (state.keys == NULL || state.buffer_keys == NULL || state.buffer_positions == NULL))
+  {
+    fferror_print(__FILE__, __LINE__, __func__, "malloc failed");
+    free(state.keys);
+    free(state.buffer_keys);
+    free(state.buffer_positions);
+    return EXIT_FAILURE;
+  }
+
+  for(size_t i = 0; i < n; i++)
+  {
+    positions[i] = i;
+    state.keys[i] = ffindex_name_key(names[i], 0);
+  }
+  if(n > 0)
+    ffsort_names_range(&state, 0, n, 0);
+
+  free(state.keys);
+  free(state.buffer_keys);
+  free(state.buffer_positions);
+  return EXIT_SUCCESS;
+}
+
+/* Moves entries[positions[i]] to entries[i]. Gathers into a second entries array with
+ * prefetching; if that cannot be allocated, follows the cycles of the permutation with
+ * one entry of extra memory, slower because each move waits for the previous one.
+ */
+void ffsort_permute_entries(ffindex_entry_t* entries, size_t* positions, size_t n)
+{
+  ffindex_entry_t* sorted = (ffindex_entry_t*)malloc(sizeof(ffindex_entry_t) * n);
+  if(sorted != NULL)
+  {
+    for(size_t i = 0; i < n; i++)
+    {
+      if(i + FFSORT_PREFETCH_DISTANCE < n)
+        __builtin_prefetch(&entries[positions[i + FFSORT_PREFETCH_DISTANCE]]);
+      sorted[i] = entries[positions[i]];
+    }
+    memcpy(entries, sorted, sizeof(ffindex_entry_t) * n);
+    free(sorted);
+    return;
+  }
+
+  for(size_t i = 0; i < n; i++)
+  {
+    if(positions[i] == i)
+      continue;
+    ffindex_entry_t entry = entries[i];
+    size_t j = i;
+    while(positions[j] != i)
+    {
+      size_t next = positions[j];
+      entries[j] = entries[next];
+      positions[j] = j;
+      j = next;
+    }
+    entries[j] = entry;
+    positions[j] = j;
+  }
+}
+
+static int ffsort_compare_names(const void* pname1, const void* pname2)
+{
+  return strncmp(*(char* const*)pname1, *(char* const*)pname2, FFINDEX_MAX_ENTRY_NAME_CHARS);
+}
+
+typedef struct ffsort_task {
+  char** names;
+  size_t* positions; /* positions sorted per chunk */
+  size_t* merged; /* positions after the merge */
+  ffindex_entry_t* entries;
+  ffindex_entry_t* sorted;
+  size_t begin; /* chunk of names, or slice of merged and sorted */
+  size_t end;
+  size_t* cuts; /* per chunk the part of it that belongs to this slice */
+  int n_chunks;
+  int err;
+} ffsort_task_t;
+
+static void* ffsort_chunk_worker(void* arg)
+{
+  ffsort_task_t* task = (ffsort_task_t*)arg;
+  size_t* positions = task->positions + task->begin;
+  size_t n = task->end - task->begin;
+  task->err = ffsort_names(task->names + task->begin, n, positions);
+  for(size_t i = 0; i < n; i++)
+    positions[i] += task->begin;
+  return NULL;
+}
+
+/* First position in the sorted chunk [begin, end) whose name is not less than name */
+static size_t ffsort_lower_bound(char** names, size_t* positions, size_t begin, size_t end, const char* name)
+{
+  while(begin < end)
+  {
+    size_t mid = begin + (end - begin) / 2;
+    if(strncmp(names[positions[mid]], name, FFINDEX_MAX_ENTRY_NAME_CHARS) < 0)
+      begin = mid + 1;
+    else
+      end = mid;
+  }
+  return begin;
+}
+
+/* Merges the parts [cuts[2c], cuts[2c+1]) of all chunks into merged[begin, end) with a binary heap of chunks */
+static void* ffsort_merge_worker(void* arg)
+{
+  ffsort_task_t* task = (ffsort_task_t*)arg;
+  char** names = task->names;
+  size_t* positions = task->positions;
+  size_t* cuts = task->cuts;
+  int heap[task->n_chunks];
+  int heap_size = 0;
+
+  for(int c = 0; c < task->n_chunks; c++)
+  {
+    if(cuts[2 * c] == cuts[2 * c + 1])
+      continue;
+    /* sift up */
+    int i = heap_size++;
+    const char* name = names[positions[cuts[2 * c]]];
+    while(i > 0 && strncmp(names[positions[cuts[2 * heap[(i - 1) / 2]]]], name, FFINDEX_MAX_ENTRY_NAME_CHARS) > 0)
+    {
+      heap[i] = heap[(i - 1) / 2];
+      i = (i - 1) / 2;
+    }
+    heap[i] = c;
+  }
+
+  for(size_t out = task->begin; heap_size > 0; out++)
+  {
+    int c = heap[0];
+    task->merged[out] = positions[cuts[2 * c]++];
+    if(cuts[2 * c] == cuts[2 * c + 1])
+      c = heap[--heap_size];
+    if(heap_size == 0)
+      break;
+
+    /* sift down chunk c from the root */
+    const char* name = names[positions[cuts[2 * c]]];
+    int i = 0;
+    while(1)
+    {
+      int child = 2 * i + 1;
+      if(child >= heap_size)
+        break;
+      if(child + 1 < heap_size && strncmp(names[positions[cuts[2 * heap[child + 1]]]], names[positions[cuts[2 * heap[child]]]], FFINDEX_MAX_ENTRY_NAME_CHARS) < 0)
+        child++;
+      if(strncmp(names[positions[cuts[2 * heap[child]]]], name, FFINDEX_MAX_ENTRY_NAME_CHARS) >= 0)
+        break;
+      heap[i] = heap[child];
+      i = child;
+    }
+    heap[i] = c;
+  }
+  return NULL;
+}
+
+static void* ffsort_gather_worker(void* arg)
+{
+  ffsort_task_t* task = (ffsort_task_t*)arg;
+  for(size_t i = task->begin; i < task->end; i++)
+  {
+    if(i + FFSORT_PREFETCH_DISTANCE < task->end)
+      __builtin_prefetch(&task->entries[task->merged[i + FFSORT_PREFETCH_DISTANCE]]);
+    task->sorted[i] = task->entries[task->merged[i]];
+  }
+  return NULL;
+}
+
+static void* ffsort_copy_worker(void* arg)
+{
+  ffsort_task_t* task = (ffsort_task_t*)arg;
+  memcpy(task->entries + task->begin, task->sorted + task->begin, sizeof(ffindex_entry_t) * (task->end - task->begin));
+  return NULL;
+}
+
+/* Sort chunks concurrently, cut all chunks at the same splitter names, merge the slices concurrently */
+static int ffsort_names_threaded(char** names, size_t n, size_t* merged, int n_threads)
+{
+  size_t* positions = (size_t*)malloc(sizeof(size_t) * n);
+  size_t* cuts = (size_t*)malloc(sizeof(size_t) * 2 * n_threads * n_threads);
+  char** samples = (char**)malloc(sizeof(char*) * FFSORT_SAMPLES_PER_CHUNK * n_threads);
+  ffsort_task_t* tasks = (ffsort_task_t*)malloc(sizeof(ffsort_task_t) * n_threads);
+  if(positions == NULL || cuts == NULL || samples == NULL || tasks == NULL)
+  {
+    fferror_print(__FILE__, __LINE__, __func__, "malloc failed");
+    free(positions);
+    free(cuts);
+    free(samples);
+    free(tasks);
+    return EXIT_FAILURE;
+  }
+
+  for(int t = 0; t < n_threads; t++)
+  {
+    tasks[t].names = names;
+    tasks[t].positions = positions;
+    tasks[t].merged = merged;
+    tasks[t].begin = n / n_threads * t;
+    tasks[t].end = t == n_threads - 1 ? n : n / n_threads * (t + 1);
+    tasks[t].cuts = cuts + 2 * n_threads * t;
+    tasks[t].n_chunks = n_threads;
+    tasks[t].err = EXIT_SUCCESS;
+  }
+  ffrun_tasks(tasks, sizeof(ffsort_task_t), n_threads, ffsort_chunk_worker);
+
+  int err = EXIT_SUCCESS;
+  for(int t = 0; t < n_threads; t++)
+    err |= tasks[t].err;
+  if(err == EXIT_SUCCESS)
+  {
+    /* Splitters: evenly spaced names of the sorted samples */
+    size_t n_samples = 0;
+    for(int t = 0; t < n_threads; t++)
+    {
+      size_t chunk_size = tasks[t].end - tasks[t].begin;
+      for(size_t s = 0; s < FFSORT_SAMPLES_PER_CHUNK; s++)
+        samples[n_samples++] = names[positions[tasks[t].begin + chunk_size * s / FFSORT_SAMPLES_PER_CHUNK]];
+    }
+    qsort(samples, n_samples, sizeof(char*), ffsort_compare_names);
+
+    /* Slice k gets the names in [splitter k, splitter k+1) of every chunk */
+    size_t chunk_begin[n_threads], chunk_end[n_threads];
+    for(int c = 0; c < n_threads; c++)
+    {
+      chunk_begin[c] = tasks[c].begin;
+      chunk_end[c] = tasks[c].end;
+    }
+    size_t out = 0;
+    for(int k = 0; k < n_threads; k++)
+    {
+      tasks[k].begin = out;
+      for(int c = 0; c < n_threads; c++)
+      {
+        size_t begin = k == 0 ? chunk_begin[c] : tasks[k - 1].cuts[2 * c + 1];
+        size_t end = chunk_end[c];
+        if(k < n_threads - 1)
+          end = ffsort_lower_bound(names, positions, begin, chunk_end[c], samples[n_samples / n_threads * (k + 1)]);
+        tasks[k].cuts[2 * c] = begin;
+        tasks[k].cuts[2 * c + 1] = end;
+        out += end - begin;
+      }
+      tasks[k].end = out;
+    }
+    ffrun_tasks(tasks, sizeof(ffsort_task_t), n_threads, ffsort_merge_worker);
+  }
+
+  free(positions);
+  free(cuts);
+  free(samples);
+  free(tasks);
+  return err;
+}
+
+int ffsort_entries_by_name(ffindex_entry_t* entries, size_t n, int n_threads)
+{
+  if((size_t)n_threads > n / FFSORT_THREAD_MIN_ENTRIES)
+    n_threads = n / FFSORT_THREAD_MIN_ENTRIES;
+  if(n_threads > FFINDEX_MAX_THREADS)
+    n_threads = FFINDEX_MAX_THREADS;
+  if(n_threads < 1)
+    n_threads = 1;
+
+  char** names = (char**)malloc(sizeof(char*) * n);
+  size_t* positions = (size_t*)malloc(sizeof(size_t) * n);
+  if(n > 0 && (names == NULL || positions == NULL))
+  {
+    fferror_print(__FILE__, __LINE__, __func__, "malloc failed");
+    free(names);
+    free(positions);
+    return EXIT_FAILURE;
+  }
+
+  for(size_t i = 0; i < n; i++)
+    names[i] = entries[i].name;
+
+  int err;
+  if(n_threads == 1)
+  {
+    err = ffsort_names(names, n, positions);
+    if(err == EXIT_SUCCESS)
+      ffsort_permute_entries(entries, positions, n);
+  }
+  else
+  {
+    err = ffsort_names_threaded(names, n, positions, n_threads);
+    ffindex_entry_t* sorted = err == EXIT_SUCCESS ? (ffindex_entry_t*)malloc(sizeof(ffindex_entry_t) * n) : NULL;
+    if(sorted != NULL)
+    {
+      ffsort_task_t tasks[n_threads];
+      for(int t = 0; t < n_threads; t++)
+      {
+        tasks[t].merged = positions;
+        tasks[t].entries = entries;
+        tasks[t].sorted = sorted;
+        tasks[t].begin = n / n_threads * t;
+        tasks[t].end = t == n_threads - 1 ? n : n / n_threads * (t + 1);
+      }
+      ffrun_tasks(tasks, sizeof(ffsort_task_t), n_threads, ffsort_gather_worker);
+      ffrun_tasks(tasks, sizeof(ffsort_task_t), n_threads, ffsort_copy_worker);
+      free(sorted);
+    }
+    else if(err == EXIT_SUCCESS)
+      ffsort_permute_entries(entries, positions, n);
+  }
+
+  free(names);
+  free(positions);
+  return err;
+}
+
+size_t ffsort_sorted_prefix(ffindex_entry_t* entries, size_t n)
+{
+  size_t i = 1;
+  while(i < n && strncmp(entries[i - 1].name, entries[i].name, FFINDEX_MAX_ENTRY_NAME_CHARS) <= 0)
+    i++;
+  return n < i ? n : i;
+}
+
+int ffsort_merge_tail(ffindex_entry_t* entries, size_t n, size_t n_sorted, int n_threads)
+{
+  size_t n_tail = n - n_sorted;
+  if(n_tail == 0)
+    return EXIT_SUCCESS;
+
+  ffindex_entry_t* tail = (ffindex_entry_t*)malloc(sizeof(ffindex_entry_t) * n_tail);
+  if(tail == NULL)
+  {
+    fferror_print(__FILE__, __LINE__, __func__, "malloc failed");
+    return EXIT_FAILURE;
+  }
+  if(ffsort_entries_by_name(entries + n_sorted, n_tail, n_threads) != EXIT_SUCCESS)
+  {
+    free(tail);
+    return EXIT_FAILURE;
+  }
+  memcpy(tail, entries + n_sorted, sizeof(ffindex_entry_t) * n_tail);
+
+  /* Merge from the back, so the sorted part is moved at most once. On equal names
+   * the tail goes behind, as if the tail had been appended to the sorted index. */
+  size_t i = n_sorted, j = n_tail, out = n;
+  while(j > 0 && i > 0)
+  {
+    if(strncmp(entries[i - 1].name, tail[j - 1].name, FFINDEX_MAX_ENTRY_NAME_CHARS) > 0)
+      entries[--out] = entries[--i];
+    else
+      entries[--out] = tail[--j];
+  }
+  memcpy(entries, tail, sizeof(ffindex_entry_t) * j);
+
+  free(tail);
+  return EXIT_SUCCESS;
+}
+
+/* One line of a text index, names truncated like ffindex_index_parse does */
+static int ffsort_parse_line(char* line, ffindex_entry_t* entry)
+{
+  char* d = line;
+  int p;
+  for(p = 0; *d != '\0' && *d != '\t'; d++)
+    if(p < FFINDEX_MAX_ENTRY_NAME_CHARS)
+      entry->name[p++] = *d;
+  entry->name[p] = '\0';
+  if(*d != '\t')
+    return EXIT_FAILURE;
+  char* next;
+  entry->offset = strtoull(d, &next, 10);
+  entry->length = strtoull(next, &next, 10);
+  return EXIT_SUCCESS;
+}
+
+typedef struct ffsort_run {
+  FILE* file;
+  ffindex_entry_t entry; /* next entry of the run */
+} ffsort_run_t;
+
+static int ffsort_run_less(ffsort_run_t* runs, int run1, int run2)
+{
+  return strncmp(runs[run1].entry.name, runs[run2].entry.name, FFINDEX_MAX_ENTRY_NAME_CHARS) < 0;
+}
+
+static void ffsort_sift_down(ffsort_run_t* runs, int* heap, int heap_size, int i)
+{
+  int run = heap[i];
+  while(1)
+  {
+    int child = 2 * i + 1;
+    if(child >= heap_size)
+      break;
+    if(child + 1 < heap_size && ffsort_run_less(runs, heap[child + 1], heap[child]))
+      child++;
+    if(!ffsort_run_less(runs, heap[child], run))
+      break;
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = run;
+}
+
+/* Merges binary runs into out, as text index if text is set. The runs are removed. */
+static int ffsort_merge_runs(char** run_filenames, int n_runs, FILE* out, int text, size_t buffer_size)
+{
+  int err = EXIT_SUCCESS;
+  ffsort_run_t runs[n_runs];
+  int heap[n_runs];
+  int heap_size = 0;
+
+  setvbuf(out, NULL, _IOFBF, buffer_size);
+  for(int r = 0; r < n_runs; r++)
+  {
+    runs[r].file = fopen(run_filenames[r], "r");
+    if(runs[r].file == NULL)
+    {
+      fferror_print(__FILE__, __LINE__, __func__, run_filenames[r]);
+      err = EXIT_FAILURE;
+      continue;
+    }
+    setvbuf(runs[r].file, NULL, _IOFBF, buffer_size);
+    if(fread(&runs[r].entry, sizeof(ffindex_entry_t), 1, runs[r].file) == 1)
+      heap[heap_size++] = r;
+  }
+  for(int i = heap_size / 2 - 1; i >= 0; i--)
+    ffsort_sift_down(runs, heap, heap_size, i);
+
+  while(heap_size > 0 && err == EXIT_SUCCESS)
+  {
+    ffsort_run_t* run = &runs[heap[0]];
+    if(text)
+    {
+      err = ffindex_fwrite_entry(out, run->entry.name, run->entry.offset, run->entry.length);
+    }
+    else if(fwrite(&run->entry, sizeof(ffindex_entry_t), 1, out) != 1)
+      err = EXIT_FAILURE;
+
+    if(fread(&run->entry, sizeof(ffindex_entry_t), 1, run->file) != 1)
+      heap[0] = heap[--heap_size];
+    ffsort_sift_down(runs, heap, heap_size, 0);
+  }
+
+  for(int r = 0; r < n_runs; r++)
+  {
+    if(runs[r].file != NULL)
+      fclose(runs[r].file);
+    unlink(run_filenames[r]);
+  }
+  return err;
+}
+
+static char* ffsort_run_filename(const char* index_filename, size_t run)
+{
+  char* filename = (char*)malloc(FILENAME_MAX);
+  if(filename != NULL)
+    snprintf(filename, FILENAME_MAX, "%s.%d.run%zu", index_filename, (int)getpid(), run);
+  return filename;
+}
+
+static int ffsort_write_sorted(ffindex_entry_t* entries, size_t n, FILE* out, int text)
+{
+  for(size_t i = 0; i < n; i++)
+  {
+    if(text)
+    {
+      if(ffindex_fwrite_entry(out, entries[i].name, entries[i].offset, entries[i].length) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+    }
+    else if(fwrite(&entries[i], sizeof(ffindex_entry_t), 1, out) != 1)
+      return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+/* The memory budget split into a read buffer per run and one for the output */
+static size_t ffsort_merge_buffer_size(size_t memory_size, int n_runs)
+{
+  size_t buffer_size = memory_size / (n_runs + 1);
+  return buffer_size < BUFSIZ ? BUFSIZ : buffer_size;
+}
+
+int ffsort_index_external(const char* index_filename, size_t memory_size)
+{
+  size_t max_entries = memory_size / FFSORT_BYTES_PER_ENTRY;
+  if(max_entries < 1024)
+    max_entries = 1024;
+
+  FILE* index_file = fopen(index_filename, "r");
+  if(index_file == NULL)
+  {
+    fferror_print(__FILE__, __LINE__, __func__, index_filename);
+    return EXIT_FAILURE;
+  }
+  ffindex_entry_t* entries = (ffindex_entry_t*)malloc(sizeof(ffindex_entry_t) * max_entries);
+  if(entries == NULL)
+  {
+    fferror_print(__FILE__, __LINE__, __func__, "malloc failed");
+    fclose(index_file);
+    return EXIT_FAILURE;
+  }
+
+  char tmp_filename[FILENAME_MAX];
+  snprintf(tmp_filename, FILENAME_MAX, "%s.%d", index_filename, (int)getpid());
+
+  /* Sorted runs of max_entries entries */
+  int err = EXIT_SUCCESS;
+  char** run_filenames = NULL;
+  size_t n_runs = 0;
+  char* line = NULL;
+  size_t line_size = 0;
+  int eof = 0;
+  while(!eof && err == EXIT_SUCCESS)
+  {
+    size_t n = 0;
+    while(n < max_entries)
+    {
+      if(getline(&line, &line_size, index_file) < 0)
+      {
+        eof = 1;
+        break;
+      }
+      if(ffsort_parse_line(line, &entries[n]) == EXIT_SUCCESS)
+        n++;
+    }
+    if(n == 0 && n_runs > 0)
+      break;
+    err = ffsort_entries_by_name(entries, n, ffget_num_threads());
+    if(err != EXIT_SUCCESS)
+      break;
+
+    /* Everything fit: no runs, write the index directly */
+    if(eof && n_runs == 0)
+    {
+      FILE* out = fopen(tmp_filename, "w");
+      if(out == NULL)
+      {
+        fferror_print(__FILE__, __LINE__, __func__, tmp_filename);
+        err = EXIT_FAILURE;
+        break;
+      }
+      err = ffsort_write_sorted(entries, n, out, 1);
+      if(fclose(out) != 0)
+        err = EXIT_FAILURE;
+      n_runs = 0;
+      break;
+    }
+
+    /* The old array is freed by a successful realloc, the cleanup below must not see it */
+    char** filenames = (char**)realloc(run_filenames, sizeof(char*) * (n_runs + 1));
+    if(filenames != NULL)
+      run_filenames = filenames;
+    char* run_filename = ffsort_run_filename(index_filename, n_runs);
+    if(filenames == NULL || run_filename == NULL)
+    {
+      fferror_print(__FILE__, __LINE__, __func__, "malloc failed");
+      free(run_filename);
+      err = EXIT_FAILURE;
+      break;
+    }
+    run_filenames[n_runs++] = run_filename;
+    FILE* run_file = fopen(run_filename, "w");
+    if(run_file == NULL)
+    {
+      fferror_print(__FILE__, __LINE__, __func__, run_filename);
+      err = EXIT_FAILURE;
+      break;
+    }
+    err = ffsort_write_sorted(entries, n, run_file, 0);
+    if(fclose(run_file) != 0)
+      err = EXIT_FAILURE;
+  }
+  free(line);
+  free(entries);
+  fclose(index_file);
+
+  /* Merge groups of runs into longer runs until one merge is left */
+  size_t first_run = 0;
+  while(err == EXIT_SUCCESS && n_runs - first_run > FFSORT_MAX_MERGE_RUNS)
+  {
+    size_t next_run = n_runs;
+    for(size_t r = first_run; r < n_runs && err == EXIT_SUCCESS; r += FFSORT_MAX_MERGE_RUNS)
+    {
+      int group = n_runs - r < FFSORT_MAX_MERGE_RUNS ? n_runs - r : FFSORT_MAX_MERGE_RUNS;
+      char** filenames = (char**)realloc(run_filenames, sizeof(char*) * (next_run + 1));
+      if(filenames != NULL)
+        run_filenames = filenames;
+      char* merged_filename = ffsort_run_filename(index_filename, next_run);
+      if(filenames == NULL || merged_filename == NULL)
+      {
+        fferror_print(__FILE__, __LINE__, __func__, "malloc failed");
+        free(merged_filename);
+        err = EXIT_FAILURE;
+        break;
+      }
+      run_filenames[next_run++] = merged_filename;
+      FILE* merged_file = fopen(merged_filename, "w");
+      if(merged_file == NULL)
+      {
+        fferror_print(__FILE__, __LINE__, __func__, merged_filename);
+        err = EXIT_FAILURE;
+        break;
+      }
+      err = ffsort_merge_runs(run_filenames + r, group, merged_file, 0, ffsort_merge_buffer_size(memory_size, group));
+      if(fclose(merged_file) != 0)
+        err = EXIT_FAILURE;
+    }
+    first_run = n_runs;
+    n_runs = next_run;
+  }
+
+  if(err == EXIT_SUCCESS && n_runs > first_run)
+  {
+    FILE* out = fopen(tmp_filename, "w");
+    if(out == NULL)
+    {
+      fferror_print(__FILE__, __LINE__, __func__, tmp_filename);
+      err = EXIT_FAILURE;
+    }
+    else
+    {
+      int group = n_runs - first_run;
+      err = ffsort_merge_runs(run_filenames + first_run, group, out, 1, ffsort_merge_buffer_size(memory_size, group));
+      if(fclose(out) != 0)
+        err = EXIT_FAILURE;
+    }
+  }
+
+  /* Runs left over after an error */
+  for(size_t r = 0; r < n_runs; r++)
+  {
+    unlink(run_filenames[r]);
+    free(run_filenames[r]);
+  }
+  free(run_filenames);
+
+  if(err == EXIT_SUCCESS && rename(tmp_filename, index_filename) != 0)
+  {
+    fferror_print(__FILE__, __LINE__, __func__, index_filename);
+    err = EXIT_FAILURE;
+  }
+  if(err != EXIT_SUCCESS)
+    unlink(tmp_filename);
+  return err;
+}
+
+/* vim: ts=2 sw=2 et
+*/
@@ -0,0 +1,463 @@
+/*
+ * Ffindex
+ * written by Andy Hauser <hauser@genzentrum.lmu.de>.
+ * Please add your name here if you distribute modified versions.
+ *
+ * Ffindex is provided under the Create Commons license "Attribution-ShareAlike
+ * 3.0", which basically captures the spirit of the Gnu Public License (GPL).
+ *
+ * See:
+ * http://creativecommons.org/licenses/by-sa/3.0/
+ *
+ * Inserts many files through io_uring: the opens, reads and closes of up to
+ * FFINDEX_URING_DEPTH files are queued in the kernel at once and submitted with one
+ * system call, while the calling thread writes the files read so far. Only the
+ * system calls are used, through the ring layout of linux/io_uring.h, so that no
+ * library is needed. Where the kernel has no io_uring, or it is disabled, the files
+ * are read by the threads of ffindex_writer_insert_files instead.
+*/
+
+#define _GNU_SOURCE 1
+#define _LARGEFILE64_SOURCE 1
+#define _FILE_OFFSET_BITS 64
+
+#include "ffindex.h"
+#include "ffutil.h"
+
+#include <stdlib.h>
+
+#ifdef HAVE_IO_URING
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Files opened and read at once */
+#define FFINDEX_URING_DEPTH 256
+
+enum { FFURING_OPEN, FFURING_READ, FFURING_CLOSE };
+enum { FFURING_FREE, FFURING_BUSY, FFURING_DONE };
+
+/* One file on its way through the ring */
+typedef struct ffuring_slot {
+  int state;
+  int error;
+  size_t file;
+  int fd;         /* left open for the writer if irregular */
+  int deferred;   /* large, opened again by the writer after a prefetch */
+  char* data;
+  size_t length;  /* read so far */
+  size_t size;
+} ffuring_slot_t;
+
+typedef struct ffuring {
+  int ring_fd;
+  void* sq_ring;
+  size_t sq_ring_size;
+  void* cq_ring;
+  size_t cq_ring_size;
+  struct io_uring_sqe* sqes;
+  size_t sqes_size;
+
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned* sq_mask;
+  unsigned* sq_array;
+  unsigned sq_entries;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned* cq_mask;
+  struct io_uring_cqe* cqes;
+
+  unsigned n_unsubmitted;
+  unsigned n_inflight; /* prepared and not completed yet */
+} ffuring_t;
+
+
+static int ffuring_setup(ffuring_t* ring, unsigned entries)
+{
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  memset(ring, 0, sizeof(ffuring_t));
+  ring->ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+  if(ring->ring_fd < 0)
+    return EXIT_FAILURE;
+
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if(params.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    if(ring->cq_ring_size > ring->sq_ring_size)
+      ring->sq_ring_size = ring->cq_ring_size;
+    ring->cq_ring_size = ring->sq_ring_size;
+  }
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+  if(ring->sq_ring == MAP_FAILED)
+    goto fail;
+  if(params.features & IORING_FEAT_SINGLE_MMAP)
+    ring->cq_ring = ring->sq_ring;
+  else
+  {
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_CQ_RING);
+    if(ring->cq_ring == MAP_FAILED)
+    {
+      munmap(ring->sq_ring, ring->sq_ring_size);
+      goto fail;
+    }
+  }
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+  if(ring->sqes == MAP_FAILED)
+  {
+    if(ring->cq_ring != ring->sq_ring)
+      munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    goto fail;
+  }
+
+  char* sq = (char*)ring->sq_ring;
+  char* cq = (char*)ring->cq_ring;
+  ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+  ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+  ring->sq_entries = params.sq_entries;
+  ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+  return EXIT_SUCCESS;
+
+fail:
+  close(ring->ring_fd);
+  return EXIT_FAILURE;
+}
+
+static void ffuring_free(ffuring_t* ring)
+{
+  munmap(ring->sqes, ring->sqes_size);
+  if(ring->cq_ring != ring->sq_ring)
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  munmap(ring->sq_ring, ring->sq_ring_size);
+  close(ring->ring_fd);
+}
+
+/* Whether the kernel knows the operations used here (Linux 5.6 and later) */
+static int ffuring_supported(ffuring_t* ring)
+{
+  int ops[] = { IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE };
+  size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe* probe = (struct io_uring_probe*)calloc(1, probe_size);
+  if(probe == NULL)
+    return 0;
+  int supported = syscall(__NR_io_uring_register, ring->ring_fd, IORING_REGISTER_PROBE, probe, 256) >= 0;
+  for(size_t i = 0; i < sizeof(ops) / sizeof(ops[0]) && supported; i++)
+    supported = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+  free(probe);
+  return supported;
+}
+
+/* Submits the prepared entries and waits for min_complete completions */
+static int ffuring_enter(ffuring_t* ring, unsigned min_complete)
+{
+  for(;;)
+  {
+    int submitted = syscall(__NR_io_uring_enter, ring->ring_fd, ring->n_unsubmitted, min_complete, min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if(submitted >= 0)
+    {
+      ring->n_unsubmitted -= submitted;
+      return EXIT_SUCCESS;
+    }
+    if(errno != EINTR)
+    {
+      fferror_print(__FILE__, __LINE__, __func__, "io_uring_enter");
+      return EXIT_FAILURE;
+    }
+  }
+}
+
+/* The next free submission entry, n_inflight never exceeds the ring size so there always is one */
+static struct io_uring_sqe* ffuring_get_sqe(ffuring_t* ring, int op, size_t slot)
+{
+  unsigned tail = *ring->sq_tail;
+  unsigned index = tail & *ring->sq_mask;
+  struct io_uring_sqe* sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->user_data = ((uint64_t)slot << 2) | op;
+  ring->sq_array[index] = index;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring->n_unsubmitted++;
+  ring->n_inflight++;
+  return sqe;
+}
+
+static void ffuring_prep_open(ffuring_t* ring, size_t slot, const char* path)
+{
+  struct io_uring_sqe* sqe = ffuring_get_sqe(ring, FFURING_OPEN, slot);
+  sqe->opcode = IORING_OP_OPENAT;
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (uint64_t)(uintptr_t)path;
+  sqe->open_flags = O_RDONLY | O_CLOEXEC;
+}
+
+static void ffuring_prep_read(ffuring_t* ring, size_t slot, ffuring_slot_t* s)
+{
+  struct io_uring_sqe* sqe = ffuring_get_sqe(ring, FFURING_READ, slot);
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = s->fd;
+  sqe->addr = (uint64_t)(uintptr_t)(s->data + s->length);
+  sqe->len = s->size - s->length;
+  sqe->off = s->length;
+}
+
+static void ffuring_prep_close(ffuring_t* ring, int fd)
+{
+  struct io_uring_sqe* sqe = ffuring_get_sqe(ring, FFURING_CLOSE, 0);
+  sqe->opcode = IORING_OP_CLOSE;
+  sqe->fd = fd;
+}
+
+/* Done with the read part of a file, its descriptor is closed in the ring */
+static void ffuring_finish_read(ffuring_t* ring, ffuring_slot_t* s)
+{
+  ffuring_prep_close(ring, s->fd);
+  s->fd = -1;
+  s->state = FFURING_DONE;
+}
+
+/* Advances the file of a slot by one completed operation */
+static void ffuring_complete(ffuring_t* ring, ffuring_slot_t* s, size_t slot, int op, int res, ffindex_file_list_t* files)
+{
+  const char* path = files->paths[s->file];
+  if(op == FFURING_OPEN)
+  {
+    if(res < 0)
+    {
+      errno = -res;
+      fferror_print(__FILE__, __LINE__, __func__, path);
+      s->error = 1;
+      s->state = FFURING_DONE;
+      return;
+    }
+    s->fd = res;
+
+    /* Irregular files are handed over open, files the writer copies in the kernel are
+     * closed and opened again by it, so that finished slots hold few descriptors */
+    struct stat sb;
+    if(fstat(s->fd, &sb) != 0 || !S_ISREG(sb.st_mode))
+    {
+      s->state = FFURING_DONE;
+      return;
+    }
+    if(sb.st_size >= FFINDEX_WRITER_ZERO_COPY_MIN)
+    {
+      posix_fadvise(s->fd, 0, 0, POSIX_FADV_WILLNEED);
+      s->deferred = 1;
+      ffuring_finish_read(ring, s);
+      return;
+    }
+    s->size = sb.st_size;
+    s->data = (char*)malloc(s->size + 1);
+    if(s->data == NULL)
+    {
+      fferror_print(__FILE__, __LINE__, __func__, "malloc failed");
+      s->error = 1;
+      ffuring_finish_read(ring, s);
+    }
+    else if(s->size == 0)
+      ffuring_finish_read(ring, s);
+    else
+      ffuring_prep_read(ring, slot, s);
+    return;
+  }
+
+  /* A read: again for the rest after a short one, until the size fstat gave or the end */
+  if(res == -EINTR || res == -EAGAIN)
+    ffuring_prep_read(ring, slot, s);
+  else if(res < 0)
+  {
+    errno = -res;
+    fferror_print(__FILE__, __LINE__, __func__, path);
+    s->error = 1;
+    ffuring_finish_read(ring, s);
+  }
+  else
+  {
+    s->length += res;
+    if(res == 0 || s->length == s->size)
+      ffuring_finish_read(ring, s);
+    else
+      ffuring_prep_read(ring, slot, s);
+  }
+}
+
+/* Writes a read file, failed ones are skipped. After a write error the writer's state is unknown */
+static void ffuring_write_slot(ffindex_writer_t* writer, ffuring_slot_t* s, ffindex_file_list_t* files, int* write_failed, int* err)
+{
+  const char* name = files->names[s->file];
+  if(s->deferred && !s->error)
+  {
+    s->fd = open(files->paths[s->file], O_RDONLY | O_CLOEXEC);
+    if(s->fd < 0)
+    {
+      fferror_print(__FILE__, __LINE__, __func__, files->paths[s->file]);
+      s->error = 1;
+    }
+  }
+  if(s->error)
+    *err = EXIT_FAILURE;
+  else if(!*write_failed)
+  {
+    int write_err = s->fd >= 0 ? ffindex_writer_insert_fd(writer, s->fd, name) : ffindex_writer_insert_memory(writer, s->data, s->length, name);
+    if(write_err != EXIT_SUCCESS)
+    {
+      *write_failed = 1;
+      *err = EXIT_FAILURE;
+    }
+  }
+  if(s->fd >= 0)
+    close(s->fd);
+  free(s->data);
+  s->fd = -1;
+  s->data = NULL;
+  s->state = FFURING_FREE;
+}
+
+static int ffuring_insert_files(ffuring_t* ring, ffindex_writer_t* writer, ffindex_file_list_t* files, int ordered)
+{
+  /* A slot holds a descriptor from its open to its close */
+  size_t n_slots = FFINDEX_URING_DEPTH;
+  if(n_slots > ffget_open_files_budget())
+    n_slots = ffget_open_files_budget();
+  ffuring_slot_t* slots = (ffuring_slot_t*)calloc(n_slots, sizeof(ffuring_slot_t));
+  size_t* free_slots = (size_t*)malloc(sizeof(size_t) * n_slots);
+  if(slots == NULL || free_slots == NULL)
+  {
+    fferror_print(__FILE__, __LINE__, __func__, "malloc failed");
+    free(slots);
+    free(free_slots);
+    return EXIT_FAILURE;
+  }
+  size_t n_free_slots = n_slots;
+  for(size_t i = 0; i < n_slots; i++)
+  {
+    slots[i].fd = -1;
+    free_slots[i] = n_slots - 1 - i;
+  }
+
+  int err = EXIT_SUCCESS, write_failed = 0;
+  size_t n_files = files->n_files, next_file = 0, n_written = 0;
+  while(n_written < n_files || ring->n_inflight > 0)
+  {
+    /* Ordered, file i goes to slot i % n_slots once file i - n_slots is written */
+    while(next_file < n_files && ring->n_inflight < ring->sq_entries)
+    {
+      size_t slot;
+      if(ordered)
+      {
+        if(next_file >= n_written + n_slots)
+          break;
+        slot = next_file % n_slots;
+      }
+      else
+      {
+        if(n_free_slots == 0)
+          break;
+        slot = free_slots[--n_free_slots];
+      }
+      ffuring_slot_t* s = &slots[slot];
+      s->state = FFURING_BUSY;
+      s->error = 0;
+      s->deferred = 0;
+      s->file = next_file++;
+      s->length = 0;
+      s->size = 0;
+      ffuring_prep_open(ring, slot, files->paths[s->file]);
+    }
+
+    if(ffuring_enter(ring, ring->n_inflight > 0 ? 1 : 0) != EXIT_SUCCESS)
+    {
+      err = EXIT_FAILURE;
+      break;
+    }
+
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for(; head != tail; head++)
+    {
+      struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+      int op = cqe->user_data & 3;
+      size_t slot = cqe->user_data >> 2;
+      int res = cqe->res;
+      ring->n_inflight--;
+      if(op == FFURING_CLOSE)
+        continue;
+
+      ffuring_slot_t* s = &slots[slot];
+      ffuring_complete(ring, s, slot, op, res, files);
+      if(s->state == FFURING_DONE && !ordered)
+      {
+        ffuring_write_slot(writer, s, files, &write_failed, &err);
+        free_slots[n_free_slots++] = slot;
+        n_written++;
+      }
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+    while(ordered && n_written < n_files && slots[n_written % n_slots].state == FFURING_DONE)
+    {
+      ffuring_slot_t* s = &slots[n_written % n_slots];
+      ffuring_write_slot(writer, s, files, &write_failed, &err);
+      n_written++;
+    }
+  }
+
+  /* Only after an error of the ring itself, the kernel may still use the buffers then */
+  if(ring->n_inflight > 0)
+    return err;
+  for(size_t i = 0; i < n_slots; i++)
+  {
+    if(slots[i].fd >= 0)
+      close(slots[i].fd);
+    free(slots[i].data);
+  }
+  free(slots);
+  free(free_slots);
+  return err;
+}
+
+int ffindex_writer_insert_files_uring(ffindex_writer_t* writer, ffindex_file_list_t* files, int n_threads, int ordered)
+{
+  ffuring_t ring;
+  if(files->n_files <= 1 || ffuring_setup(&ring, 2 * FFINDEX_URING_DEPTH) != EXIT_SUCCESS)
+    return ffindex_writer_insert_files(writer, files, n_threads, ordered);
+  if(!ffuring_supported(&ring))
+  {
+    ffuring_free(&ring);
+    return ffindex_writer_insert_files(writer, files, n_threads, ordered);
+  }
+
+  int err = ffuring_insert_files(&ring, writer, files, ordered);
+  ffuring_free(&ring);
+  return err;
+}
+
+#else
+
+int ffindex_writer_insert_files_uring(ffindex_writer_t* writer, ffindex_file_list_t* files, int n_threads, int ordered)
+{
+  return ffindex_writer_insert_files(writer, files, n_threads, ordered);
+}
+
+#endif
+
+/* vim: ts=2 sw=2 et
+*/
@@ -15,10 +15,23 @@
  * files.
  */
 
+#define _GNU_SOURCE 1
+#define _LARGEFILE64_SOURCE 1
+#define _FILE_OFFSET_BITS 64
+
 #include "ffutil.h"
+#include "ffindex.h"
+#include <fcntl.h>
 #include <stdio.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/resource.h>
 #include <stdlib.h>
+#include <unistd.h>
+
+#define FFCOUNT_BUFFER_SIZE (64 * 1024)
+#define FFCOPY_BUFFER_SIZE (1024 * 1024)
 
 int fferror_print(char *sourcecode_filename, int line, const char *function_name, const char *message)
 {
@@ -41,31 +54,145 @@ char* ffnchomp(char *s, size_t len)
   return s;
 }
 
+/* Counts the lines, a last line without newline counts too */
 size_t ffcount_lines(const char *filename)
 {
-  FILE *fp = fopen(filename, "r");
-  if (fp == NULL) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
     return 0;
   }
 
   size_t lines = 0;
-  int ch = 0;
+  char last = '\n';
+  char buffer[FFCOUNT_BUFFER_SIZE];
+  ssize_t read_size;
 
-  do {
-    ch = fgetc(fp);
-    if (ch == '\n') {
+  /* memchr is vectorized, much faster than checking char by char */
+  while ((read_size = read(fd, buffer, sizeof(buffer))) > 0) {
+    char *p = buffer;
+    char *end = buffer + read_size;
+    while ((p = memchr(p, '\n', end - p)) != NULL) {
       lines++;
+      p++;
     }
-  } while(ch != EOF);
+    last = end[-1];
+  }
 
-  if(ch != '\n' && lines != 0) {
+  if (last != '\n') {
     lines++;
   }
 
-  fclose(fp);
+  close(fd);
 
   return lines;
 }
 
+static int ffnum_threads = 0;
+
+int ffget_num_threads()
+{
+  int n_threads = ffnum_threads;
+  if(n_threads <= 0)
+  {
+    char* env = getenv("FFINDEX_THREADS");
+    n_threads = env != NULL ? atoi(env) : 1;
+    if(n_threads <= 0)
+      n_threads = 1;
+  }
+
+  /* Callers keep per-thread state on the stack */
+  if(n_threads > FFINDEX_MAX_THREADS)
+    n_threads = FFINDEX_MAX_THREADS;
+  return n_threads;
+}
+
+void ffset_num_threads(int n_threads)
+{
+  ffnum_threads = n_threads;
+}
+
+size_t ffget_open_files_budget()
+{
+  struct rlimit limit;
+  if(getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY)
+    return SIZE_MAX;
+  return limit.rlim_cur >= 8 ? limit.rlim_cur / 4 : 1;
+}
+
+void ffrun_tasks(void* tasks, size_t task_size, int n_tasks, void* (*worker)(void*))
+{
+  char* task = (char*)tasks;
+  pthread_t threads[n_tasks];
+  int started[n_tasks];
+  for(int t = 1; t < n_tasks; t++)
+    started[t] = pthread_create(&threads[t], NULL, worker, task + t * task_size) == 0;
+  if(n_tasks > 0)
+    worker(task);
+  for(int t = 1; t < n_tasks; t++)
+  {
+    if(started[t])
+      pthread_join(threads[t], NULL);
+    else
+      worker(task + t * task_size);
+  }
+}
+
+int ffcopy_range(int in_fd, off_t in_offset, int out_fd, size_t length)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+  /* Copied in the kernel, or shared on file systems with reflinks */
+  while(length > 0)
+  {
+    ssize_t copied = copy_file_range(in_fd, &in_offset, out_fd, NULL, length, 0);
+    if(copied > 0)
+      length -= copied;
+    else if(copied == 0)
+    {
+      errno = EIO; /* input shorter than the range */
+      return EXIT_FAILURE;
+    }
+    else if(errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)
+      break; /* not supported between these files, copy through user space */
+    else if(errno != EINTR)
+      return EXIT_FAILURE;
+  }
+  if(length == 0)
+    return EXIT_SUCCESS;
+#endif
+
+  char* buffer = (char*)malloc(length < FFCOPY_BUFFER_SIZE ? length : FFCOPY_BUFFER_SIZE);
+  if(buffer == NULL)
+    return EXIT_FAILURE;
+  while(length > 0)
+  {
+    ssize_t n = pread(in_fd, buffer, length < FFCOPY_BUFFER_SIZE ? length : FFCOPY_BUFFER_SIZE, in_offset);
+    if(n <= 0)
+    {
+      if(n < 0 && errno == EINTR)
+        continue;
+      if(n == 0)
+        errno = EIO;
+      free(buffer);
+      return EXIT_FAILURE;
+    }
+    for(ssize_t written = 0; written < n;)
+    {
+      ssize_t w = write(out_fd, buffer + written, n - written);
+      if(w < 0 && errno == EINTR)
+        continue;
+      if(w <= 0)
+      {
+        free(buffer);
+        return EXIT_FAILURE;
+      }
+      written += w;
+    }
+    in_offset += n;
+    length -= n;
+  }
+  free(buffer);
+  return EXIT_SUCCESS;
+}
+
 /* vim: ts=2 sw=2 et
 */
@@ -18,6 +18,7 @@
 #ifndef FFUTIL_H
 #define FFUTIL_H
 
+#include <sys/types.h>
 #include <err.h>
 #include <errno.h>
 #include <string.h>
@@ -30,6 +31,26 @@ char* ffnchomp(char *s, size_t len);
 
 size_t ffcount_lines(const char *filename);
 
+/* Threads used by the library, set by ffset_num_threads or else the environment variable FFINDEX_THREADS, default 1,
+ * at most FFINDEX_MAX_THREADS */
+int ffget_num_threads();
+
+void ffset_num_threads(int n_threads);
+
+/* Descriptors a batch of files may hold open at once: a quarter of RLIMIT_NOFILE, at least 1 */
+size_t ffget_open_files_budget();
+
+/* Runs worker on each of n_tasks tasks of task_size bytes, one thread per task and the
+ * first task in the calling thread. A task whose thread cannot be started runs in the caller.
+ */
+void ffrun_tasks(void* tasks, size_t task_size, int n_tasks, void* (*worker)(void*));
+
+/* Copies length bytes at in_offset of in_fd to the current position of out_fd, with
+ * copy_file_range where available (HAVE_COPY_FILE_RANGE) and read/write otherwise.
+ * Returns EXIT_SUCCESS or EXIT_FAILURE with errno set.
+ */
+int ffcopy_range(int in_fd, off_t in_offset, int out_fd, size_t length);
+
 #endif
 /* vim: ts=2 sw=2 et
 */
@@ -0,0 +1,518 @@
+/*
+ * Ffindex
+ * written by Andy Hauser <hauser@genzentrum.lmu.de>.
+ * Please add your name here if you distribute modified versions.
+ *
+ * Ffindex is provided under the Create Commons license "Attribution-ShareAlike
+ * 3.0", which basically captures the spirit of the Gnu Public License (GPL).
+ *
+ * See:
+ * http://creativecommons.org/licenses/by-sa/3.0/
+ *
+ * Parallel directory walker: every thread has a deque of directories still to read,
+ * takes the newest one from its own deque and steals the oldest one from another
+ * thread's when its own is empty. Directories are opened with openat relative to the
+ * root and read with getdents64, file types come from d_type and fstatat is only
+ * called where the file system does not fill it in.
+ *
+ * The files of a directory are found by one thread in one go and sorted by name, the
+ * directories are sorted by path at the end, so the list does not depend on the threads.
+*/
+
+#define _GNU_SOURCE 1
+#define _LARGEFILE64_SOURCE 1
+#define _FILE_OFFSET_BITS 64
+
+#include "ffindex.h"
+#include "ffutil.h"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#if defined(__linux__) && defined(SYS_getdents64)
+#define FFWALK_GETDENTS64 1
+#define FFWALK_GETDENTS_BUFFER_SIZE (64 * 1024)
+
+/* As returned by the system call, glibc only declares it since 2.30 */
+struct ffwalk_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+#endif
+
+/* The files one thread found in one directory */
+typedef struct ffwalk_chunk {
+  char* dir_path; /* relative to the root, empty or ending in '/' */
+  int thread;
+  size_t begin;
+  size_t end;
+} ffwalk_chunk_t;
+
+struct ffwalk;
+
+typedef struct ffwalk_thread {
+  struct ffwalk* walk;
+  int thread;
+
+  /* Directories to read, the owner takes from the tail, thieves from the head */
+  pthread_mutex_t mutex;
+  char** dirs;
+  size_t head;
+  size_t tail;
+  size_t max_dirs;
+
+  ffindex_file_list_t files;
+  ffwalk_chunk_t* chunks;
+  size_t n_chunks;
+  size_t max_chunks;
+
+  /* File names of the directory being read */
+  char** names;
+  size_t n_names;
+  size_t max_names;
+  char* buffer;
+
+  int err;
+} ffwalk_thread_t;
+
+typedef struct ffwalk {
+  int root_fd;
+  char* root_path; /* ending in '/' */
+  int recursive;
+  int relative_names;
+  int n_threads;
+  ffwalk_thread_t* threads;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t work;
+  size_t n_pending;  /* directories pushed and not read yet */
+  size_t generation; /* directories pushed so far */
+} ffwalk_t;
+
+
+static int ffwalk_push(ffwalk_thread_t* thread, char* dir_path)
+{
+  ffwalk_t* walk = thread->walk;
+  int err = EXIT_SUCCESS;
+
+  /* Counted before it can be stolen, so that n_pending never drops to 0 early */
+  pthread_mutex_lock(&walk->mutex);
+  pthread_mutex_lock(&thread->mutex);
+  if(thread->tail == thread->max_dirs)
+  {
+    if(thread->head > 0)
+    {
+      memmove(thread->dirs, thread->dirs + thread->head, sizeof(char*) * (thread->tail - thread->head));
+      thread->tail -= thread->head;
+      thread->head = 0;
+    }
+    else
+    {
+      size_t max_dirs = thread->max_dirs < 64 ? 64 : thread->max_dirs * 2;
+      char** dirs = (char**)realloc(thread->dirs, sizeof(char*) * max_dirs);
+      if(dirs == NULL)
+        err = EXIT_FAILURE;
+      else
+      {
+        thread->dirs = dirs;
+        thread->max_dirs = max_dirs;
+      }
+    }
+  }
+  if(err == EXIT_SUCCESS)
+    thread->dirs[thread->tail++] = dir_path;
+  pthread_mutex_unlock(&thread->mutex);
+  if(err == EXIT_SUCCESS)
+  {
+    walk->n_pending++;
+    walk->generation++;
+    pthread_cond_signal(&walk->work);
+  }
+  pthread_mutex_unlock(&walk->mutex);
+
+  if(err != EXIT_SUCCESS)
+  {
+    fferror_print(__FILE__, __LINE__, __func__, "realloc failed");
+    free(dir_path);
+  }
+  return err;
+}
+
+/* The newest directory of the own deque, else the oldest of another thread's */
+static char* ffwalk_take(ffwalk_thread_t* thread)
+{
+  ffwalk_t* walk = thread->walk;
+  char* dir_path = NULL;
+
+  pthread_mutex_lock(&thread->mutex);
+  if(thread->tail > thread->head)
+    dir_path = thread->dirs[--thread->tail];
+  pthread_mutex_unlock(&thread->mutex);
+
+  for(int i = 1; i < walk->n_threads && dir_path == NULL; i++)
+  {
+    ffwalk_thread_t* victim = &walk->threads[(thread->thread + i) % walk->n_threads];
+    pthread_mutex_lock(&victim->mutex);
+    if(victim->tail > victim->head)
+      dir_path = victim->dirs[victim->head++];
+    pthread_mutex_unlock(&victim->mutex);
+  }
+  return dir_path;
+}
+
+static int ffwalk_compare_names(const void* pname1, const void* pname2)
+{
+  return strcmp(*(char* const*)pname1, *(char* const*)pname2);
+}
+
+static int ffwalk_compare_chunks(const void* pchunk1, const void* pchunk2)
+{
+  return strcmp(((const ffwalk_chunk_t*)pchunk1)->dir_path, ((const ffwalk_chunk_t*)pchunk2)->dir_path);
+}
+
+/* Concatenation of three strings in a new buffer */
+static char* ffwalk_concat(const char* a, const char* b, const char* c)
+{
+  size_t a_length = strlen(a), b_length = strlen(b), c_length = strlen(c);
+  char* s = (char*)malloc(a_length + b_length + c_length + 1);
+  if(s == NULL)
+    return NULL;
+  memcpy(s, a, a_length);
+  memcpy(s + a_length, b, b_length);
+  memcpy(s + a_length + b_length, c, c_length + 1);
+  return s;
+}
+
+/* Notes a regular file or pushes a subdirectory */
+static int ffwalk_entry(ffwalk_thread_t* thread, int dir_fd, char* dir_path, const char* name, unsigned char type)
+{
+  ffwalk_t* walk = thread->walk;
+  if(name[0] == '.')
+    return EXIT_SUCCESS;
+
+  if(type == DT_UNKNOWN || type == DT_LNK)
+  {
+    struct stat sb;
+    if(fstatat(dir_fd, name, &sb, 0) == -1)
+    {
+      fferror_print(__FILE__, __LINE__, __func__, name);
+      return EXIT_SUCCESS;
+    }
+    if(S_ISREG(sb.st_mode))
+      type = DT_REG;
+    else if(S_ISDIR(sb.st_mode) && type == DT_UNKNOWN)
+      type = DT_DIR;
+    else
+      return EXIT_SUCCESS;
+  }
+
+  if(type == DT_DIR && walk->recursive)
+  {
+    char* subdir_path = ffwalk_concat(dir_path, name, "/");
+    if(subdir_path == NULL)
+      return EXIT_FAILURE;
+    return ffwalk_push(thread, subdir_path);
+  }
+  if(type != DT_REG)
+    return EXIT_SUCCESS;
+
+  if(thread->n_names == thread->max_names)
+  {
+    size_t max_names = thread->max_names < 1024 ? 1024 : thread->max_names * 2;
+    char** names = (char**)realloc(thread->names, sizeof(char*) * max_names);
+    if(names == NULL)
+      return EXIT_FAILURE;
+    thread->names = names;
+    thread->max_names = max_names;
+  }
+  if((thread->names[thread->n_names] = strdup(name)) == NULL)
+    return EXIT_FAILURE;
+  thread->n_names++;
+  return EXIT_SUCCESS;
+}
+
+/* Reads one directory, its files go to the thread's list as one chunk */
+static int ffwalk_read_dir(ffwalk_thread_t* thread, char* dir_path)
+{
+  ffwalk_t* walk = thread->walk;
+  int err = EXIT_SUCCESS;
+
+  int dir_fd = openat(walk->root_fd, dir_path[0] != '\0' ? dir_path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if(dir_fd < 0)
+  {
+    char* path = ffwalk_concat(walk->root_path, dir_path, "");
+    fferror_print(__FILE__, __LINE__, __func__, path != NULL ? path : dir_path);
+    free(path);
+    free(dir_path);
+    return EXIT_FAILURE;
+  }
+
+  thread->n_names = 0;
+#ifdef FFWALK_GETDENTS64
+  for(;;)
+  {
+    long n_bytes = syscall(SYS_getdents64, dir_fd, thread->buffer, FFWALK_GETDENTS_BUFFER_SIZE);
+    if(n_bytes < 0 && errno == EINTR)
+      continue;
+    if(n_bytes <= 0)
+    {
+      if(n_bytes < 0)
+        err = EXIT_FAILURE;
+      break;
+    }
+    for(long position = 0; position < n_bytes && err == EXIT_SUCCESS;)
+    {
+      struct ffwalk_dirent64* entry = (struct ffwalk_dirent64*)(thread->buffer + position);
+      err = ffwalk_entry(thread, dir_fd, dir_path, entry->d_name, entry->d_type);
+      position += entry->d_reclen;
+    }
+    if(err != EXIT_SUCCESS)
+      break;
+  }
+  close(dir_fd);
+#else
+  DIR* dir = fdopendir(dir_fd);
+  if(dir == NULL)
+  {
+    close(dir_fd);
+    err = EXIT_FAILURE;
+  }
+  else
+  {
+    struct dirent* entry;
+    while(err == EXIT_SUCCESS && (entry = readdir(dir)) != NULL)
+      err = ffwalk_entry(thread, dir_fd, dir_path, entry->d_name, entry->d_type);
+    closedir(dir);
+  }
+#endif
+  if(err != EXIT_SUCCESS)
+    fferror_print(__FILE__, __LINE__, __func__, dir_path[0] != '\0' ? dir_path : walk->root_path);
+
+  /* Add the files sorted by name */
+  qsort(thread->names, thread->n_names, sizeof(char*), ffwalk_compare_names);
+  size_t begin = thread->files.n_files;
+  if(ffindex_file_list_reserve(&thread->files, thread->n_names) != EXIT_SUCCESS)
+    err = EXIT_FAILURE;
+  for(size_t i = 0; i < thread->n_names; i++)
+  {
+    char* name = thread->names[i];
+    if(err == EXIT_SUCCESS)
+    {
+      char* path = ffwalk_concat(walk->root_path, dir_path, name);
+      char* entry_name = walk->relative_names ? ffwalk_concat(dir_path, name, "") : name;
+      if(path == NULL || entry_name == NULL)
+      {
+        free(path);
+        err = EXIT_FAILURE;
+      }
+      else
+      {
+        thread->files.paths[thread->files.n_files] = path;
+        thread->files.names[thread->files.n_files] = entry_name;
+        thread->files.n_files++;
+        if(entry_name == name)
+          continue;
+      }
+    }
+    free(name);
+  }
+
+  if(thread->files.n_files == begin)
+  {
+    free(dir_path);
+    return err;
+  }
+  if(thread->n_chunks == thread->max_chunks)
+  {
+    size_t max_chunks = thread->max_chunks < 64 ? 64 : thread->max_chunks * 2;
+    ffwalk_chunk_t* chunks = (ffwalk_chunk_t*)realloc(thread->chunks, sizeof(ffwalk_chunk_t) * max_chunks);
+    if(chunks == NULL)
+    {
+      free(dir_path);
+      return EXIT_FAILURE;
+    }
+    thread->chunks = chunks;
+    thread->max_chunks = max_chunks;
+  }
+  ffwalk_chunk_t* chunk = &thread->chunks[thread->n_chunks++];
+  chunk->dir_path = dir_path;
+  chunk->thread = thread->thread;
+  chunk->begin = begin;
+  chunk->end = thread->files.n_files;
+  return err;
+}
+
+static void* ffwalk_worker(void* pthread)
+{
+  ffwalk_thread_t* thread = (ffwalk_thread_t*)pthread;
+  ffwalk_t* walk = thread->walk;
+
+  for(;;)
+  {
+    pthread_mutex_lock(&walk->mutex);
+    size_t generation = walk->generation;
+    pthread_mutex_unlock(&walk->mutex);
+
+    char* dir_path = ffwalk_take(thread);
+    if(dir_path != NULL)
+    {
+      thread->err |= ffwalk_read_dir(thread, dir_path);
+      pthread_mutex_lock(&walk->mutex);
+      if(--walk->n_pending == 0)
+        pthread_cond_broadcast(&walk->work);
+      pthread_mutex_unlock(&walk->mutex);
+      continue;
+    }
+
+    /* Nothing to take: done, or wait unless something was pushed since looking */
+    pthread_mutex_lock(&walk->mutex);
+    if(walk->n_pending == 0)
+    {
+      pthread_mutex_unlock(&walk->mutex);
+      break;
+    }
+    if(walk->generation == generation)
+      pthread_cond_wait(&walk->work, &walk->mutex);
+    pthread_mutex_unlock(&walk->mutex);
+  }
+  return NULL;
+}
+
+int ffindex_file_list_add_tree(ffindex_file_list_t* list, char* input_dir_name, int recursive, int relative_names, int n_threads)
+{
+  if(n_threads < 1 || !recursive)
+    n_threads = 1;
+
+  ffwalk_t walk;
+  memset(&walk, 0, sizeof(walk));
+  walk.recursive = recursive;
+  walk.relative_names = relative_names;
+  walk.n_threads = n_threads;
+  walk.root_fd = open(input_dir_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if(walk.root_fd < 0)
+  {
+    fferror_print(__FILE__, __LINE__, __func__, input_dir_name);
+    return EXIT_FAILURE;
+  }
+  size_t input_dir_name_len = strlen(input_dir_name);
+  walk.root_path = ffwalk_concat(input_dir_name, input_dir_name_len > 0 && input_dir_name[input_dir_name_len - 1] == '/' ? "" : "/", "");
+  walk.threads = (ffwalk_thread_t*)calloc(n_threads, sizeof(ffwalk_thread_t));
+  char* root_dir_path = strdup("");
+  if(walk.root_path == NULL || walk.threads == NULL || root_dir_path == NULL)
+  {
+    fferror_print(__FILE__, __LINE__, __func__, "malloc failed");
+    close(walk.root_fd);
+    free(walk.root_path);
+    free(walk.threads);
+    free(root_dir_path);
+    return EXIT_FAILURE;
+  }
+  pthread_mutex_init(&walk.mutex, NULL);
+  pthread_cond_init(&walk.work, NULL);
+
+  int err = EXIT_SUCCESS;
+  for(int t = 0; t < n_threads; t++)
+  {
+    ffwalk_thread_t* thread = &walk.threads[t];
+    thread->walk = &walk;
+    thread->thread = t;
+    pthread_mutex_init(&thread->mutex, NULL);
+#ifdef FFWALK_GETDENTS64
+    thread->buffer = (char*)malloc(FFWALK_GETDENTS_BUFFER_SIZE);
+    if(thread->buffer == NULL)
+      err = EXIT_FAILURE;
+#endif
+  }
+  if(err == EXIT_SUCCESS)
+    err = ffwalk_push(&walk.threads[0], root_dir_path);
+  else
+    free(root_dir_path);
+  if(err == EXIT_SUCCESS)
+    ffrun_tasks(walk.threads, sizeof(ffwalk_thread_t), n_threads, ffwalk_worker);
+
+  /* All chunks sorted by directory, then moved to the list */
+  size_t n_chunks = 0, n_files = 0;
+  for(int t = 0; t < n_threads; t++)
+  {
+    n_chunks += walk.threads[t].n_chunks;
+    n_files += walk.threads[t].files.n_files;
+    err |= walk.threads[t].err;
+  }
+  ffwalk_chunk_t* chunks = (ffwalk_chunk_t*)malloc(sizeof(ffwalk_chunk_t) * (n_chunks + 1));
+  if(chunks == NULL || ffindex_file_list_reserve(list, n_files) != EXIT_SUCCESS)
+  {
+    fferror_print(__FILE__, __LINE__, __func__, "malloc failed");
+    err = EXIT_FAILURE;
+    n_chunks = 0;
+  }
+  else
+  {
+    n_chunks = 0;
+    for(int t = 0; t < n_threads; t++)
+    {
+      if(walk.threads[t].n_chunks > 0)
+        memcpy(chunks + n_chunks, walk.threads[t].chunks, sizeof(ffwalk_chunk_t) * walk.threads[t].n_chunks);
+      n_chunks += walk.threads[t].n_chunks;
+      walk.threads[t].n_chunks = 0;
+    }
+    qsort(chunks, n_chunks, sizeof(ffwalk_chunk_t), ffwalk_compare_chunks);
+    for(size_t c = 0; c < n_chunks; c++)
+    {
+      ffindex_file_list_t* files = &walk.threads[chunks[c].thread].files;
+      size_t n = chunks[c].end - chunks[c].begin;
+      memcpy(list->paths + list->n_files, files->paths + chunks[c].begin, sizeof(char*) * n);
+      memcpy(list->names + list->n_files, files->names + chunks[c].begin, sizeof(char*) * n);
+      list->n_files += n;
+      free(chunks[c].dir_path);
+    }
+  }
+  free(chunks);
+
+  for(int t = 0; t < n_threads; t++)
+  {
+    ffwalk_thread_t* thread = &walk.threads[t];
+    /* Only left after an error, the moved ones are freed by the list's owner */
+    for(size_t c = 0; c < thread->n_chunks; c++)
+    {
+      for(size_t i = thread->chunks[c].begin; i < thread->chunks[c].end; i++)
+      {
+        free(thread->files.paths[i]);
+        free(thread->files.names[i]);
+      }
+      free(thread->chunks[c].dir_path);
+    }
+    for(size_t d = thread->head; d < thread->tail; d++)
+      free(thread->dirs[d]);
+    free(thread->dirs);
+    free(thread->files.paths);
+    free(thread->files.names);
+    free(thread->chunks);
+    free(thread->names);
+    free(thread->buffer);
+    pthread_mutex_destroy(&thread->mutex);
+  }
+  pthread_cond_destroy(&walk.work);
+  pthread_mutex_destroy(&walk.mutex);
+  free(walk.threads);
+  free(walk.root_path);
+  close(walk.root_fd);
+  return err;
+}
+
+/* vim: ts=2 sw=2 et
+*/
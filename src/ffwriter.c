@@ -0,0 +1,737 @@
+/*
+ * Ffindex
+ * written by Andy Hauser <hauser@genzentrum.lmu.de>.
+ * Please add your name here if you distribute modified versions.
+ *
+ * Ffindex is provided under the Create Commons license "Attribution-ShareAlike
+ * 3.0", which basically captures the spirit of the Gnu Public License (GPL).
+ *
+ * See:
+ * http://creativecommons.org/licenses/by-sa/3.0/
+ *
+ * Buffered writer for new entries: data and index lines are collected in two
+ * private buffers and written with one system call each when a buffer is full.
+ * Data larger than the free buffer space is written together with the buffered
+ * bytes by one writev, without copying it into the buffer first.
+ *
+ * Regular files of at least FFINDEX_WRITER_ZERO_COPY_MIN bytes are moved into
+ * the data file by the kernel with copy_file_range or else sendfile, reading
+ * through the buffer only where neither works between the two files.
+*/
+
+#define _GNU_SOURCE 1
+#define _LARGEFILE64_SOURCE 1
+#define _FILE_OFFSET_BITS 64
+
+#include "ffindex.h"
+#include "ffutil.h"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FFINDEX_WRITER_ZERO_COPY_CHUNK (1024 * 1024 * 1024)
+/* Files read ahead of the writer per reader thread */
+#define FFINDEX_WRITER_QUEUE_PER_THREAD 16
+
+
+size_t ffindex_format_entry_numbers(char* buffer, size_t offset, size_t length)
+{
+  char digits[2 * 20];
+  char* p = buffer;
+  size_t numbers[2] = { offset, length };
+  for(int i = 0; i < 2; i++)
+  {
+    size_t n_digits = 0, number = numbers[i];
+    do
+    {
+      digits[n_digits++] = '0' + number % 10;
+      number /= 10;
+    } while(number > 0);
+    *p++ = '\t';
+    while(n_digits > 0)
+      *p++ = digits[--n_digits];
+  }
+  *p++ = '\n';
+  return p - buffer;
+}
+
+/* Writes all iov_count buffers, retrying after short writes */
+static int ffindex_writer_writev(int fd, struct iovec* iov, int iov_count)
+{
+  while(iov_count > 0)
+  {
+    ssize_t written = writev(fd, iov, iov_count);
+    if(written < 0)
+    {
+      if(errno == EINTR)
+        continue;
+      return EXIT_FAILURE;
+    }
+    while(iov_count > 0 && (size_t)written >= iov->iov_len)
+    {
+      written -= iov->iov_len;
+      iov++;
+      iov_count--;
+    }
+    if(iov_count > 0)
+    {
+      iov->iov_base = (char*)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+  return EXIT_SUCCESS;
+}
+
+static int ffindex_writer_flush_data(ffindex_writer_t* writer)
+{
+  struct iovec iov = { writer->data_buffer, writer->data_used };
+  if(ffindex_writer_writev(writer->data_fd, &iov, writer->data_used > 0) != EXIT_SUCCESS)
+  {
+    fferror_print(__FILE__, __LINE__, __func__, "write data file");
+    return EXIT_FAILURE;
+  }
+  writer->data_used = 0;
+  return EXIT_SUCCESS;
+}
+
+static int ffindex_writer_flush_index(ffindex_writer_t* writer)
+{
+  struct iovec iov = { writer->index_buffer, writer->index_used };
+  if(ffindex_writer_writev(writer->index_fd, &iov, writer->index_used > 0) != EXIT_SUCCESS)
+  {
+    fferror_print(__FILE__, __LINE__, __func__, "write index file");
+    return EXIT_FAILURE;
+  }
+  writer->index_used = 0;
+  return EXIT_SUCCESS;
+}
+
+int ffindex_writer_flush(ffindex_writer_t* writer)
+{
+  if(ffindex_writer_flush_data(writer) != EXIT_SUCCESS)
+    return EXIT_FAILURE;
+  return ffindex_writer_flush_index(writer);
+}
+
+ffindex_writer_t* ffindex_writer_new(int data_fd, int index_fd, size_t offset)
+{
+  ffindex_writer_t* writer = (ffindex_writer_t*)calloc(1, sizeof(ffindex_writer_t));
+  if(writer == NULL)
+  {
+    fferror_print(__FILE__, __LINE__, __func__, "calloc failed");
+    return NULL;
+  }
+  writer->data_fd = data_fd;
+  writer->index_fd = index_fd;
+  writer->offset = offset;
+  writer->entry_offset = offset;
+  writer->buffer_size = FFINDEX_WRITER_BUFFER_SIZE;
+  writer->data_buffer = (char*)malloc(writer->buffer_size);
+  writer->index_buffer = (char*)malloc(writer->buffer_size);
+  if(writer->data_buffer == NULL || writer->index_buffer == NULL)
+  {
+    fferror_print(__FILE__, __LINE__, __func__, "malloc failed");
+    free(writer->data_buffer);
+    free(writer->index_buffer);
+    free(writer);
+    return NULL;
+  }
+  return writer;
+}
+
+ffindex_writer_t* ffindex_writer_open(char* data_filename, char* index_filename, char* mode)
+{
+  int flags = O_WRONLY | O_CREAT;
+  if(mode[0] != 'a')
+    flags |= O_EXCL;
+
+  int data_fd = open(data_filename, flags, 0666);
+  if(data_fd < 0) { perror(data_filename); return NULL; }
+  int index_fd = open(index_filename, flags, 0666);
+  if(index_fd < 0) { perror(index_filename); close(data_fd); return NULL; }
+
+  /* Appending continues at the current end, the offsets of new entries start there */
+  off_t offset = lseek(data_fd, 0, SEEK_END);
+  if(offset == -1 || lseek(index_fd, 0, SEEK_END) == -1)
+  {
+    fferror_print(__FILE__, __LINE__, __func__, data_filename);
+    close(data_fd);
+    close(index_fd);
+    return NULL;
+  }
+
+  ffindex_writer_t* writer = ffindex_writer_new(data_fd, index_fd, offset);
+  if(writer == NULL)
+  {
+    close(data_fd);
+    close(index_fd);
+    return NULL;
+  }
+  writer->owns_fds = 1;
+  return writer;
+}
+
+int ffindex_writer_close(ffindex_writer_t* writer)
+{
+  int err = ffindex_writer_flush(writer);
+  if(writer->owns_fds)
+  {
+    if(close(writer->data_fd) != 0 || close(writer->index_fd) != 0)
+      err = EXIT_FAILURE;
+  }
+  free(writer->data_buffer);
+  free(writer->index_buffer);
+  free(writer);
+  return err;
+}
+
+int ffindex_writer_add(ffindex_writer_t* writer, const char* data, size_t length)
+{
+  if(length <= writer->buffer_size - writer->data_used)
+  {
+    memcpy(writer->data_buffer + writer->data_used, data, length);
+    writer->data_used += length;
+  }
+  else
+  {
+    /* Too large for the buffer: write both at once, skipping the copy */
+    struct iovec iov[2] = { { writer->data_buffer, writer->data_used }, { (char*)data, length } };
+    if(ffindex_writer_writev(writer->data_fd, iov, 2) != EXIT_SUCCESS)
+    {
+      fferror_print(__FILE__, __LINE__, __func__, "write data file");
+      return EXIT_FAILURE;
+    }
+    writer->data_used = 0;
+  }
+  writer->offset += length;
+  return EXIT_SUCCESS;
+}
+
+int ffindex_writer_end(ffindex_writer_t* writer, const char* name)
+{
+  /* Separate by '\0' and thus also make sure at least one byte is written */
+  if(writer->data_used == writer->buffer_size && ffindex_writer_flush_data(writer) != EXIT_SUCCESS)
+    return EXIT_FAILURE;
+  writer->data_buffer[writer->data_used++] = '\0';
+  writer->offset++;
+
+  size_t name_length = strlen(name);
+  if(name_length + FFINDEX_ENTRY_NUMBERS_MAX > writer->buffer_size - writer->index_used)
+  {
+    /* The data first, so that index lines on disk never point past the data on disk */
+    if(ffindex_writer_flush(writer) != EXIT_SUCCESS)
+      return EXIT_FAILURE;
+    /* Longer than the whole buffer */
+    if(name_length + FFINDEX_ENTRY_NUMBERS_MAX > writer->buffer_size)
+    {
+      char numbers[FFINDEX_ENTRY_NUMBERS_MAX];
+      struct iovec iov[2] = { { (char*)name, name_length }, { numbers, 0 } };
+      iov[1].iov_len = ffindex_format_entry_numbers(numbers, writer->entry_offset, writer->offset - writer->entry_offset);
+      writer->entry_offset = writer->offset;
+      return ffindex_writer_writev(writer->index_fd, iov, 2);
+    }
+  }
+  char* line = writer->index_buffer + writer->index_used;
+  memcpy(line, name, name_length);
+  writer->index_used += name_length + ffindex_format_entry_numbers(line + name_length, writer->entry_offset, writer->offset - writer->entry_offset);
+  writer->entry_offset = writer->offset;
+  return EXIT_SUCCESS;
+}
+
+int ffindex_writer_insert_memory(ffindex_writer_t* writer, const char* data, size_t length, const char* name)
+{
+  if(ffindex_writer_add(writer, data, length) != EXIT_SUCCESS)
+    return EXIT_FAILURE;
+  return ffindex_writer_end(writer, name);
+}
+
+/* Not possible between these two files, as opposed to an I/O error */
+static int ffindex_writer_zero_copy_unsupported(int error)
+{
+  return error == EXDEV || error == ENOSYS || error == EINVAL || error == EOPNOTSUPP || error == EBADF;
+}
+
+/* Moves the rest of fd from its current position to the data file in the kernel.
+ * Both positions advance with the copied bytes, so after an unsupported combination
+ * of files the caller reads on from where this stopped. Returns EXIT_FAILURE only on I/O errors.
+ */
+static int ffindex_writer_zero_copy(ffindex_writer_t* writer, int fd, const char* name)
+{
+  if(ffindex_writer_flush_data(writer) != EXIT_SUCCESS)
+    return EXIT_FAILURE;
+
+#ifdef HAVE_COPY_FILE_RANGE
+  for(;;)
+  {
+    ssize_t copied = copy_file_range(fd, NULL, writer->data_fd, NULL, FFINDEX_WRITER_ZERO_COPY_CHUNK, 0);
+    if(copied > 0)
+    {
+      writer->offset += copied;
+      continue;
+    }
+    if(copied == 0)
+      return EXIT_SUCCESS;
+    if(errno == EINTR)
+      continue;
+    if(ffindex_writer_zero_copy_unsupported(errno))
+      break;
+    fferror_print(__FILE__, __LINE__, __func__, name);
+    return EXIT_FAILURE;
+  }
+#endif
+
+#ifdef HAVE_SYS_SENDFILE_H
+  for(;;)
+  {
+    ssize_t copied = sendfile(writer->data_fd, fd, NULL, FFINDEX_WRITER_ZERO_COPY_CHUNK);
+    if(copied > 0)
+    {
+      writer->offset += copied;
+      continue;
+    }
+    if(copied == 0)
+      return EXIT_SUCCESS;
+    if(errno == EINTR)
+      continue;
+    if(ffindex_writer_zero_copy_unsupported(errno))
+      break;
+    fferror_print(__FILE__, __LINE__, __func__, name);
+    return EXIT_FAILURE;
+  }
+#endif
+
+  return EXIT_SUCCESS;
+}
+
+int ffindex_writer_insert_fd(ffindex_writer_t* writer, int fd, const char* name)
+{
+  struct stat sb;
+  if(fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size >= FFINDEX_WRITER_ZERO_COPY_MIN
+     && ffindex_writer_zero_copy(writer, fd, name) != EXIT_SUCCESS)
+    return EXIT_FAILURE;
+
+  /* Read straight into the buffer, the rest if the zero copy stopped early */
+  for(;;)
+  {
+    if(writer->data_used == writer->buffer_size && ffindex_writer_flush_data(writer) != EXIT_SUCCESS)
+      return EXIT_FAILURE;
+    ssize_t read_size = read(fd, writer->data_buffer + writer->data_used, writer->buffer_size - writer->data_used);
+    if(read_size < 0)
+    {
+      if(errno == EINTR)
+        continue;
+      fferror_print(__FILE__, __LINE__, __func__, name);
+      return EXIT_FAILURE;
+    }
+    if(read_size == 0)
+      break;
+    writer->data_used += read_size;
+    writer->offset += read_size;
+  }
+  return ffindex_writer_end(writer, name);
+}
+
+int ffindex_writer_insert_filestream(ffindex_writer_t* writer, FILE* file, const char* name)
+{
+  size_t read_size;
+  do
+  {
+    if(writer->data_used == writer->buffer_size && ffindex_writer_flush_data(writer) != EXIT_SUCCESS)
+      return EXIT_FAILURE;
+    read_size = fread(writer->data_buffer + writer->data_used, sizeof(char), writer->buffer_size - writer->data_used, file);
+    writer->data_used += read_size;
+    writer->offset += read_size;
+  } while(read_size > 0);
+  if(ferror(file))
+  {
+    fferror_print(__FILE__, __LINE__, __func__, name);
+    return EXIT_FAILURE;
+  }
+  return ffindex_writer_end(writer, name);
+}
+
+int ffindex_writer_insert_file(ffindex_writer_t* writer, const char* path, const char* name)
+{
+  int fd = open(path, O_RDONLY);
+  if(fd < 0)
+  {
+    fferror_print(__FILE__, __LINE__, __func__, path);
+    return EXIT_FAILURE;
+  }
+  int err = ffindex_writer_insert_fd(writer, fd, name);
+  close(fd);
+  return err;
+}
+
+int ffindex_file_list_reserve(ffindex_file_list_t* list, size_t n_more)
+{
+  if(list->n_files + n_more > list->max_files)
+  {
+    size_t max_files = list->max_files < 1024 ? 1024 : list->max_files * 2;
+    if(max_files < list->n_files + n_more)
+      max_files = list->n_files + n_more;
+    char** paths = (char**)realloc(list->paths, sizeof(char*) * max_files);
+    if(paths != NULL)
+      list->paths = paths;
+    char** names = (char**)realloc(list->names, sizeof(char*) * max_files);
+    if(names != NULL)
+      list->names = names;
+    if(paths == NULL || names == NULL)
+    {
+      fferror_print(__FILE__, __LINE__, __func__, "realloc failed");
+      return EXIT_FAILURE;
+    }
+    list->max_files = max_files;
+  }
+  return EXIT_SUCCESS;
+}
+
+int ffindex_file_list_add(ffindex_file_list_t* list, const char* path, const char* name)
+{
+  if(ffindex_file_list_reserve(list, 1) != EXIT_SUCCESS)
+    return EXIT_FAILURE;
+  list->paths[list->n_files] = strdup(path);
+  list->names[list->n_files] = strdup(name);
+  if(list->paths[list->n_files] == NULL || list->names[list->n_files] == NULL)
+  {
+    fferror_print(__FILE__, __LINE__, __func__, "strdup failed");
+    free(list->paths[list->n_files]);
+    free(list->names[list->n_files]);
+    return EXIT_FAILURE;
+  }
+  list->n_files++;
+  return EXIT_SUCCESS;
+}
+
+int ffindex_file_list_add_list_file(ffindex_file_list_t* list, FILE* list_file)
+{
+  char path[PATH_MAX], name[PATH_MAX];
+  while(fgets(path, PATH_MAX, list_file) != NULL)
+  {
+    ffnchomp(path, strlen(path));
+    strcpy(name, path);
+    if(ffindex_file_list_add(list, path, basename(name)) != EXIT_SUCCESS)
+      return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+int ffindex_file_list_add_dir(ffindex_file_list_t* list, char* input_dir_name)
+{
+  return ffindex_file_list_add_tree(list, input_dir_name, 0, 0, 1);
+}
+
+void ffindex_file_list_free(ffindex_file_list_t* list)
+{
+  for(size_t i = 0; i < list->n_files; i++)
+  {
+    free(list->paths[i]);
+    free(list->names[i]);
+  }
+  free(list->paths);
+  free(list->names);
+  memset(list, 0, sizeof(ffindex_file_list_t));
+}
+
+/* A file read by a reader thread, waiting in the queue for the writer */
+typedef struct ffindex_read_item {
+  size_t file;  /* position in the file list */
+  int ready;
+  int error;
+  int deferred; /* large or irregular files are opened by the writer, regular ones prefetched */
+  char* data;   /* otherwise their content */
+  size_t length;
+} ffindex_read_item_t;
+
+typedef struct ffindex_read_queue {
+  ffindex_writer_t* writer;
+  ffindex_file_list_t* files;
+  int ordered;
+  pthread_mutex_t mutex;
+  pthread_cond_t item_ready;
+  pthread_cond_t slot_free;        /* unordered: any slot */
+  pthread_cond_t* file_slot_free;  /* ordered: per slot, for the one file that goes there next */
+  ffindex_read_item_t* items;
+  size_t capacity;
+  size_t next_file; /* next file to be read */
+  size_t n_queued;  /* unordered: items put into the ring */
+  size_t n_taken;   /* unordered: items taken from the ring */
+  size_t n_written; /* files written or skipped, in order if ordered */
+  int write_failed;
+  int err;
+} ffindex_read_queue_t;
+
+typedef struct ffindex_read_task {
+  ffindex_read_queue_t* queue;
+  int is_writer;
+} ffindex_read_task_t;
+
+static void ffindex_read_file(const char* path, ffindex_read_item_t* item)
+{
+  item->error = 0;
+  item->deferred = 0;
+  item->data = NULL;
+  item->length = 0;
+
+  /* Queued files hold no descriptor, a full queue must stay within RLIMIT_NOFILE */
+  struct stat sb;
+  if(stat(path, &sb) != 0)
+  {
+    fferror_print(__FILE__, __LINE__, __func__, path);
+    item->error = 1;
+    return;
+  }
+  if(!S_ISREG(sb.st_mode))
+  {
+    item->deferred = 1;
+    return;
+  }
+
+  int fd = open(path, O_RDONLY);
+  if(fd < 0)
+  {
+    fferror_print(__FILE__, __LINE__, __func__, path);
+    item->error = 1;
+    return;
+  }
+  if(fstat(fd, &sb) != 0 || sb.st_size >= FFINDEX_WRITER_ZERO_COPY_MIN)
+  {
+    /* The pages stay cached for the writer's open */
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+    item->deferred = 1;
+    return;
+  }
+
+  item->data = (char*)malloc(sb.st_size + 1);
+  if(item->data == NULL)
+  {
+    fferror_print(__FILE__, __LINE__, __func__, "malloc failed");
+    item->error = 1;
+    close(fd);
+    return;
+  }
+  while(item->length < (size_t)sb.st_size)
+  {
+    ssize_t read_size = read(fd, item->data + item->length, sb.st_size - item->length);
+    if(read_size < 0 && errno == EINTR)
+      continue;
+    if(read_size < 0)
+    {
+      fferror_print(__FILE__, __LINE__, __func__, path);
+      item->error = 1;
+      break;
+    }
+    if(read_size == 0)
+      break;
+    item->length += read_size;
+  }
+  close(fd);
+}
+
+/* Deferred files are opened one at a time, a file that cannot be opened is skipped like one that could not be read */
+static int ffindex_write_item(ffindex_writer_t* writer, ffindex_read_item_t* item, ffindex_file_list_t* files)
+{
+  const char* name = files->names[item->file];
+  if(!item->deferred)
+    return ffindex_writer_insert_memory(writer, item->data, item->length, name);
+
+  int fd = open(files->paths[item->file], O_RDONLY);
+  if(fd < 0)
+  {
+    fferror_print(__FILE__, __LINE__, __func__, files->paths[item->file]);
+    item->error = 1;
+    return EXIT_SUCCESS;
+  }
+  int err = ffindex_writer_insert_fd(writer, fd, name);
+  close(fd);
+  return err;
+}
+
+static void* ffindex_read_worker(void* ptask)
+{
+  ffindex_read_task_t* task = (ffindex_read_task_t*)ptask;
+  ffindex_read_queue_t* queue = task->queue;
+  size_t n_files = queue->files->n_files;
+  ffindex_read_item_t item;
+
+  pthread_mutex_lock(&queue->mutex);
+  if(!task->is_writer)
+  {
+    while(queue->next_file < n_files)
+    {
+      item.file = queue->next_file++;
+      pthread_mutex_unlock(&queue->mutex);
+      ffindex_read_file(queue->files->paths[item.file], &item);
+      pthread_mutex_lock(&queue->mutex);
+
+      ffindex_read_item_t* slot;
+      if(queue->ordered)
+      {
+        while(item.file >= queue->n_written + queue->capacity)
+          pthread_cond_wait(&queue->file_slot_free[item.file % queue->capacity], &queue->mutex);
+        slot = &queue->items[item.file % queue->capacity];
+      }
+      else
+      {
+        while(queue->n_queued - queue->n_taken >= queue->capacity)
+          pthread_cond_wait(&queue->slot_free, &queue->mutex);
+        slot = &queue->items[queue->n_queued++ % queue->capacity];
+      }
+      *slot = item;
+      slot->ready = 1;
+      pthread_cond_signal(&queue->item_ready);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return NULL;
+  }
+
+  /* The writer also reads a file itself rather than wait for one nobody is reading yet */
+  while(queue->n_written < n_files)
+  {
+    ffindex_read_item_t* slot = &queue->items[(queue->ordered ? queue->n_written : queue->n_taken) % queue->capacity];
+    if(slot->ready)
+    {
+      item = *slot;
+      slot->ready = 0;
+      /* Readers wait only on a full ring, they are woken together when half of it is free */
+      if(!queue->ordered)
+      {
+        queue->n_taken++;
+        if(queue->n_queued - queue->n_taken == queue->capacity / 2)
+          pthread_cond_broadcast(&queue->slot_free);
+      }
+      pthread_mutex_unlock(&queue->mutex);
+    }
+    else if(queue->ordered ? queue->next_file == queue->n_written : queue->next_file < n_files)
+    {
+      item.file = queue->next_file++;
+      pthread_mutex_unlock(&queue->mutex);
+      ffindex_read_file(queue->files->paths[item.file], &item);
+    }
+    else
+    {
+      pthread_cond_wait(&queue->item_ready, &queue->mutex);
+      continue;
+    }
+
+    /* Files that could not be read are skipped, after a write error the writer's state is unknown */
+    if(!item.error && !queue->write_failed && ffindex_write_item(queue->writer, &item, queue->files) != EXIT_SUCCESS)
+      queue->write_failed = 1;
+    if(item.error || queue->write_failed)
+      queue->err = EXIT_FAILURE;
+    free(item.data);
+
+    pthread_mutex_lock(&queue->mutex);
+    queue->n_written++;
+    if(queue->ordered)
+      pthread_cond_signal(&queue->file_slot_free[(queue->n_written - 1) % queue->capacity]);
+  }
+  pthread_mutex_unlock(&queue->mutex);
+  return NULL;
+}
+
+int ffindex_writer_insert_files(ffindex_writer_t* writer, ffindex_file_list_t* files, int n_threads, int ordered)
+{
+  int err = EXIT_SUCCESS;
+  if(n_threads <= 1 || files->n_files <= 1)
+  {
+    for(size_t i = 0; i < files->n_files; i++)
+      err |= ffindex_writer_insert_file(writer, files->paths[i], files->names[i]);
+    return err;
+  }
+
+  /* Each reader holds one descriptor while it reads */
+  if((size_t)n_threads > ffget_open_files_budget())
+    n_threads = ffget_open_files_budget();
+
+  ffindex_read_queue_t queue;
+  memset(&queue, 0, sizeof(queue));
+  queue.writer = writer;
+  queue.files = files;
+  queue.ordered = ordered;
+  queue.capacity = (size_t)n_threads * FFINDEX_WRITER_QUEUE_PER_THREAD;
+  queue.items = (ffindex_read_item_t*)calloc(queue.capacity, sizeof(ffindex_read_item_t));
+  queue.file_slot_free = (pthread_cond_t*)malloc(sizeof(pthread_cond_t) * queue.capacity);
+  ffindex_read_task_t* tasks = (ffindex_read_task_t*)malloc(sizeof(ffindex_read_task_t) * (n_threads + 1));
+  if(queue.items == NULL || queue.file_slot_free == NULL || tasks == NULL)
+  {
+    fferror_print(__FILE__, __LINE__, __func__, "malloc failed");
+    free(queue.items);
+    free(queue.file_slot_free);
+    free(tasks);
+    return EXIT_FAILURE;
+  }
+  pthread_mutex_init(&queue.mutex, NULL);
+  pthread_cond_init(&queue.item_ready, NULL);
+  pthread_cond_init(&queue.slot_free, NULL);
+  for(size_t i = 0; i < queue.capacity; i++)
+    pthread_cond_init(&queue.file_slot_free[i], NULL);
+
+  /* The calling thread writes, the others read */
+  for(int t = 0; t <= n_threads; t++)
+  {
+    tasks[t].queue = &queue;
+    tasks[t].is_writer = t == 0;
+  }
+  ffrun_tasks(tasks, sizeof(ffindex_read_task_t), n_threads + 1, ffindex_read_worker);
+
+  for(size_t i = 0; i < queue.capacity; i++)
+    pthread_cond_destroy(&queue.file_slot_free[i]);
+  free(queue.file_slot_free);
+  pthread_cond_destroy(&queue.slot_free);
+  pthread_cond_destroy(&queue.item_ready);
+  pthread_mutex_destroy(&queue.mutex);
+  free(tasks);
+  free(queue.items);
+  return queue.err;
+}
+
+int ffindex_writer_insert_list_file(ffindex_writer_t* writer, FILE* list_file)
+{
+  ffindex_file_list_t files;
+  memset(&files, 0, sizeof(files));
+  int err = ffindex_file_list_add_list_file(&files, list_file);
+  err |= ffindex_writer_insert_files(writer, &files, 1, 1);
+  ffindex_file_list_free(&files);
+  return err;
+}
+
+int ffindex_writer_insert_dir(ffindex_writer_t* writer, char* input_dir_name)
+{
+  ffindex_file_list_t files;
+  memset(&files, 0, sizeof(files));
+  int err = ffindex_file_list_add_dir(&files, input_dir_name);
+  err |= ffindex_writer_insert_files(writer, &files, 1, 1);
+  ffindex_file_list_free(&files);
+  return err;
+}
+
+int ffindex_writer_insert_ffindex(ffindex_writer_t* writer, char* data_to_add, ffindex_index_t* index_to_add)
+{
+  for(size_t entry_i = 0; entry_i < index_to_add->n_entries; entry_i++)
+  {
+    ffindex_entry_t *entry = ffindex_get_entry_by_index(index_to_add, entry_i);
+    if(entry == NULL) { fferror_print(__FILE__, __LINE__, __func__, ""); return EXIT_FAILURE; }
+    /* skip \0 suffix */
+    if(ffindex_writer_insert_memory(writer, ffindex_get_data_by_entry(data_to_add, entry), entry->length - 1, entry->name) != EXIT_SUCCESS)
+      return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+/* vim: ts=2 sw=2 et
+*/
@@ -0,0 +1,124 @@
+/*
+ * Ffindex
+ * written by Andy Hauser <hauser@genzentrum.lmu.de>.
+ * Please add your name here if you distribute modified versions.
+ *
+ * Ffindex is provided under the Create Commons license "Attribution-ShareAlike
+ * 3.0", which basically captures the spirit of the Gnu Public License (GPL).
+ *
+ * See:
+ * http://creativecommons.org/licenses/by-sa/3.0/
+ *
+ * Every name of an index spread over many blocks of a blocked index must be found,
+ * one at a time by ffindex_get_entry_by_name and all at once by
+ * ffindex_get_entries_by_names, including names of 32 and more characters.
+ * Usage: blocks DIRECTORY
+*/
+
+#define _GNU_SOURCE 1
+
+#include "ffindex.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define N_ENTRIES 3000
+#define NAME_MAX_LENGTH 48
+
+static void test_name(size_t i, char* name)
+{
+  /* Every third name is longer than the part kept in an entry, distinct in that part */
+  if(i % 3 == 0)
+    snprintf(name, NAME_MAX_LENGTH, "%010zu_long_name_of_forty_characters", i);
+  else
+    snprintf(name, NAME_MAX_LENGTH, "name_%zu", i);
+}
+
+int main(int argn, char** argv)
+{
+  if(argn != 2)
+  {
+    fprintf(stderr, "USAGE: %s DIRECTORY\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  char index_filename[FILENAME_MAX];
+  char blocks_filename[FILENAME_MAX];
+  if(snprintf(index_filename, FILENAME_MAX, "%s/blocks.ffindex", argv[1]) >= FILENAME_MAX
+     || snprintf(blocks_filename, FILENAME_MAX, "%s%s", index_filename, FFINDEX_BLOCKS_SUFFIX) >= FILENAME_MAX)
+    return EXIT_FAILURE;
+
+  static char names[N_ENTRIES][NAME_MAX_LENGTH];
+  char* name_list[N_ENTRIES];
+  ffindex_index_t* written = ffindex_index_new(N_ENTRIES);
+  if(written == NULL)
+    return EXIT_FAILURE;
+  for(size_t i = 0; i < N_ENTRIES; i++)
+  {
+    test_name(i, names[i]);
+    name_list[i] = names[i];
+    ffindex_index_add_entry(written, names[i], i * 10, 10);
+  }
+  ffindex_sort_index_file(written);
+
+  FILE* index_file = fopen(index_filename, "w");
+  if(index_file == NULL || ffindex_write(written, index_file) != EXIT_SUCCESS || fclose(index_file) != 0)
+  {
+    perror(index_filename);
+    return EXIT_FAILURE;
+  }
+  /* The smallest blocks, of the entries filling whole pages, 12 blocks here */
+  if(ffindex_write_blocks(written, index_filename, 1) != EXIT_SUCCESS)
+    return EXIT_FAILURE;
+  ffindex_index_free(written);
+
+  ffindex_index_t* index = ffindex_index_parse_blocks(index_filename);
+  if(index == NULL || index->n_blocks < 2)
+  {
+    fprintf(stderr, "%s: no blocked index of several blocks\n", blocks_filename);
+    return EXIT_FAILURE;
+  }
+
+  int err = EXIT_SUCCESS;
+  size_t n_missing = 0;
+  for(size_t i = 0; i < N_ENTRIES; i++)
+  {
+    ffindex_entry_t* entry = ffindex_get_entry_by_name(index, names[i]);
+    if(entry == NULL || entry->offset != i * 10)
+      n_missing++;
+  }
+  if(n_missing > 0)
+  {
+    fprintf(stderr, "ffindex_get_entry_by_name: %zu of %d names not found in %zu blocks\n", n_missing, N_ENTRIES, index->n_blocks);
+    err = EXIT_FAILURE;
+  }
+
+  ffindex_entry_t* entries[N_ENTRIES];
+  n_missing = 0;
+  if(ffindex_get_entries_by_names(index, name_list, N_ENTRIES, entries) != EXIT_SUCCESS)
+    n_missing = N_ENTRIES;
+  for(size_t i = 0; i < N_ENTRIES && n_missing < N_ENTRIES; i++)
+    if(entries[i] == NULL || entries[i]->offset != i * 10)
+      n_missing++;
+  if(n_missing > 0)
+  {
+    fprintf(stderr, "ffindex_get_entries_by_names: %zu of %d names not found\n", n_missing, N_ENTRIES);
+    err = EXIT_FAILURE;
+  }
+
+  if(ffindex_get_entry_by_name(index, "name_3000") != NULL || ffindex_get_entry_by_name(index, "a") != NULL
+     || ffindex_get_entry_by_name(index, "zzz") != NULL)
+  {
+    fprintf(stderr, "ffindex_get_entry_by_name: found a name not in the index\n");
+    err = EXIT_FAILURE;
+  }
+
+  ffindex_index_free(index);
+  unlink(blocks_filename);
+  unlink(index_filename);
+  return err;
+}
+
+/* vim: ts=2 sw=2 et
+*/
@@ -0,0 +1,49 @@
+#!/bin/sh
+# Names of 32 and more characters are cut to FFINDEX_MAX_ENTRY_NAME_CHARS in the
+# index, lookups by the full name must still find them, in every search mode.
+# The blocked index here has a single block, test/blocks.c covers several.
+# Usage: long_names.sh BINARY_DIR
+set -e
+bin="$1"
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+name32=abcdefghijklmnopqrstuvwxyz012345
+name40=ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789abcd
+mkdir "$dir/files"
+echo thirtytwo > "$dir/files/$name32"
+echo forty > "$dir/files/$name40"
+echo short > "$dir/files/short"
+
+"$bin/ffindex_build" -s "$dir/t.ffdata" "$dir/t.ffindex" "$dir/files"
+
+check()
+{
+  out=$("$@" "$dir/t.ffdata" "$dir/t.ffindex" "$name32" "$name40" short | tr -d '\0' | tr '\n' ' ')
+  if [ "$out" != "thirtytwo forty short " ]; then
+    echo "$*: got '$out'" >&2
+    exit 1
+  fi
+}
+
+check "$bin/ffindex_get"
+check env FFINDEX_SEARCH=eytzinger "$bin/ffindex_get"
+check env FFINDEX_SEARCH=prefix "$bin/ffindex_get"
+check "$bin/ffindex_get" -c
+
+"$bin/ffindex_build" -a -b -B -H "$dir/t.ffdata" "$dir/t.ffindex"
+check "$bin/ffindex_get"
+rm "$dir/t.ffindex.hash"
+check "$bin/ffindex_get"
+rm "$dir/t.ffindex.blocks"
+check "$bin/ffindex_get"
+
+# The packed index keeps names in full: two names that differ after the cut part
+# are both found, also when the index is not sorted.
+printf 'one\n\0two\n\0' > "$dir/p.ffdata"
+printf '%s\t0\t5\n%s\t5\t5\n' "${name40}_2" "${name40}_1" > "$dir/p.ffindex"
+out=$("$bin/ffindex_get" -c "$dir/p.ffdata" "$dir/p.ffindex" "${name40}_1" "${name40}_2" | tr -d '\0' | tr '\n' ' ')
+if [ "$out" != "two one " ]; then
+  echo "ffindex_get -c: got '$out'" >&2
+  exit 1
+fi